@@ -1,12 +1,29 @@
+// 1: build para Linux con la capa de hardware de host/ (ver CMakeLists.txt)
+#ifndef HAL_NATIVO
+#define HAL_NATIVO 0
+#endif
+
+// Periféricos: solo los usa la capa de hardware
+#if !HAL_NATIVO
 #include <SPI.h>
 #include <MFRC522.h>
 #include <WiFi.h>
-#include <HTTPClient.h>
-#include <ArduinoJson.h>
 #include <Wire.h>
-#include <Adafruit_GFX.h>
 #include <Adafruit_SSD1306.h>
+#include <esp_partition.h>
+#include <LittleFS.h>
+#include <Preferences.h>
+#include <esp_sntp.h>
+#include <esp_timer.h>
+#endif
+#include <Arduino.h>
+#include <FS.h>
+#include <ArduinoJson.h>
+#include <Adafruit_GFX.h>
 #include <time.h>
+#include <esp_crc.h>
+#include <esp_heap_caps.h>
+#include <atomic>
 
 // Definición de pines según tu diagrama
 #define RST_PIN 15
@@ -14,13 +31,166 @@
 #define LED_VERDE 2
 #define LED_ROJO 4
 #define BUZZER 13
+#define IRQ_PIN 27                      // IRQ del RC522 (activa a nivel bajo)
+#define NUM_LECTORES 1                  // RC522 en el mismo bus SPI, un SS por lector (ver pinesSSLector)
 
 // Configuración OLED
 #define OLED_SDA 21
 #define OLED_SCL 22
 #define SCREEN_WIDTH 128
 #define SCREEN_HEIGHT 64
-#define OLED_RESET -1
+#define OLED_DIRECCION 0x3C
+#define OLED_I2C_HZ 400000              // Máximo del SSD1306; 800000 solo en módulos comprobados a esa velocidad
+#define OLED_PAGINAS (SCREEN_HEIGHT / 8)
+#define OLED_BLOQUE_I2C 127             // Buffer de Wire de 128 bytes menos el byte de control
+#ifndef MEDIR_PANTALLAS
+#define MEDIR_PANTALLAS 0               // 1: al arrancar compara sprites con el dibujo por primitivas (rfid_pantallas en el build nativo)
+#endif
+
+// Lista blanca local (particiones lista_a/lista_b, ver partitions.csv)
+#define LISTA_MAGIC 0x4C425246          // "FRBL"
+#define LISTA_UID_MAX 10                // UIDs MIFARE de 4, 7 o 10 bytes
+#define LISTA_BLOOM_BYTES 512           // Prefiltro Bloom de 4096 bits
+#define LISTA_BLOOM_HASHES 3
+#define INTERVALO_LISTA_MS 900000       // Buscar versión nueva cada 15 minutos (sin suscripción)
+#define LISTA_MAGIC_DELTA 0x44425246    // "FRBD"
+#define LISTA_SUSCRIPCION 1             // Long-poll de cambios; 0: solo la consulta periódica
+#define LISTA_ESPERA_S 30               // Cuánto retiene el backend el long-poll si no hay cambios
+#define LISTA_VIGENCIA_MS 90000         // Sin confirmación más reciente, las desconocidas van a /verificar
+#define REINTENTO_SUSCRIPCION_MS 10000
+
+// UIDs y payloads sin memoria dinámica
+#define UID_MAX 10                      // UIDs MIFARE de 4, 7 o 10 bytes
+#define UID_HEX_MAX (UID_MAX * 2 + 1)
+#define VERIFICAR_HEAP 1                // Comprobar que una tarjeta no reserva heap (CONFIG_HEAP_TASK_TRACKING o build nativo)
+
+// El recuento global de bloques incluye lo que reservan WiFi y lwIP en el otro
+// núcleo, así que solo sirve el de la propia tarea: sin seguimiento por tarea
+// en el sdkconfig la comprobación no se compila. En el dispositivo solo se
+// ven los bloques que siguen vivos; el build nativo cuenta cada malloc y new
+// del hilo, también los que se liberan enseguida, y su prueba falla si hay alguno
+#if VERIFICAR_HEAP && (HAL_NATIVO || defined(CONFIG_HEAP_TASK_TRACKING))
+#if !HAL_NATIVO
+#include <esp_heap_task_info.h>
+#endif
+#define COMPROBAR_HEAP 1
+#else
+#define COMPROBAR_HEAP 0
+#endif
+
+// Formato de los payloads
+#define FORMATO_BINARIO 0               // 1: MessagePack si el backend lo acepta, JSON si no
+#define MEDIR_FORMATOS 0                // 1: al arrancar compara tamaño y tiempo de JSON y MessagePack
+#define TIPO_MSGPACK "application/msgpack"
+#define TIPO_JSON "application/json"
+#define HTTP_FORMATO_NO_ACEPTADO 415
+
+// Transacción única de toque
+#define TOQUE_UNICO 1                   // 1: una sola petición verifica, registra, captura y notifica si el backend la tiene
+
+// Tareas y colas
+#define NUCLEO_RED 0                    // El stack WiFi también corre en el núcleo 0
+#define PILA_TAREA_RED 12288
+#define NUCLEO_LECTOR 1                 // Mismo núcleo que loop(), con más prioridad
+#define PRIORIDAD_TAREA_LECTOR 3
+#define PILA_TAREA_LECTOR 4096
+#define VERIFICAR_DOC_BYTES 128         // Documento de /verificar: solo valida y nombreEmpleado
+#define CAPACIDAD_COLA_TARJETAS 16      // Potencia de 2
+#define CAPACIDAD_COLA_RESULTADOS 16    // Potencia de 2
+
+// Detección de tarjetas
+#define DETECCION_IRQ 1                 // 0: sondeo continuo con PICC_IsNewCardPresent
+#define INTERVALO_REQA_MS 50            // Cada cuánto se emite REQA esperando la interrupción
+#define INTERVALO_SONDEO_MS 50          // Periodo del sondeo (modo sin IRQ)
+#define IRQ_PERDIDAS_MAX 3              // Respuestas seguidas sin interrupción antes de pasar a sondeo
+#define SONDEO_HUECO_MAX_MS 150         // Aviso si un lector pasa más tiempo sin sondearse
+#define INTERVALO_INFORME_LECTOR_MS 60000
+#define LECTOR_VIRTUAL HAL_NATIVO       // 1: las tarjetas llegan por el monitor serie ("tarjeta 04A23B91")
+#define CAPACIDAD_LECTOR_VIRTUAL 4      // Potencia de 2
+
+// Latencias por etapa de la tarjeta
+#define HISTO_CUBETAS 24                // Cubetas log2 en us: 1 us .. 8,4 s
+#define PUERTO_METRICAS 9100            // GET /metrics en texto Prometheus (0: sin servidor)
+#define METRICAS_TIMEOUT_MS 200         // Espera máxima por la petición del cliente
+#define PRIORIDAD_TAREA_METRICAS 0      // Por debajo de la tarea de red, en su mismo núcleo
+#define PILA_TAREA_METRICAS 4096
+#define INTERVALO_METRICAS_MS 100       // Cada cuánto se mira si hay un cliente esperando
+
+// Telemetría de memoria: heap y pilas de las tareas
+#define MEMORIA_INTERVALO_MS 30000      // Una muestra cada 30 s
+#define MEMORIA_HISTORIAL 120           // Muestras guardadas (1 h con el intervalo por defecto)
+#define MEMORIA_AVISO_BLOQUE 8192       // Aviso si el mayor bloque libre baja de esto
+#define MEMORIA_AVISO_PILA 512          // Aviso si a una tarea le quedan menos bytes de pila
+
+// Banco de pruebas: traza de toques contra un backend simulado
+#define BANCO_PRUEBAS 0                 // 1: backend simulado y comando "banco" en el monitor serie
+#define BANCO_LATENCIA_MS 80            // Latencia media del backend simulado
+#define BANCO_JITTER_MS 40              // Variación +- sobre la latencia
+#define BANCO_ERRORES_PCT 2             // Peticiones que reciben un 500
+#define BANCO_TIMEOUTS_PCT 0            // Peticiones que agotan su timeout
+#define BANCO_MAX_TOQUES 256
+#define BANCO_TOQUES_NORMALES 30        // Traza sintética: llegadas sueltas...
+#define BANCO_INTERVALO_NORMAL_MS 2000
+#define BANCO_TOQUES_RAFAGA 90          // ...y cambio de turno
+#define BANCO_INTERVALO_RAFAGA_MS 250
+#define BANCO_MIN_TOQUES_MIN 60         // Umbrales: fuera de ellos el banco falla
+#define BANCO_MAX_COLA_P99_MS 2000
+#define BANCO_MAX_FEEDBACK_P99_MS 3000
+#define BANCO_LISTA_INTERVALO_MS 5000   // El backend simulado publica una versión de la lista cada tanto
+#define BANCO_LISTA_CAMBIOS 16          // Altas y bajas por versión
+#define BANCO_LISTA_SALTO 5             // Cada tantas versiones falta el delta y va la lista completa
+
+// Reloj de fichajes: monótono, anclado a NTP y corregido por la deriva medida
+#define EPOCA_RELOJ 1704067200UL        // 2024-01-01 UTC, origen de los instantes del diario
+#define INSTANTE_RELATIVO 0x80000000UL  // Marca de instante en segundos desde el arranque (sin hora aún)
+#define RELOJ_MIN_DERIVA_MS 600000      // Intervalo mínimo entre dos NTP para medir la deriva
+#define RELOJ_MAX_DERIVA_PPM 500        // Más que esto es un salto de hora, no deriva del cristal
+
+// Antirrebote por UID
+#define ANTIRREBOTE_CAPACIDAD 8         // UIDs recordados (LRU)
+#define ANTIRREBOTE_VENTANA_MS 60000    // Repetir tarjeta antes de esto no vuelve a fichar
+
+// Diario de fichajes en LittleFS (partición spiffs)
+#define DIARIO_DIR "/diario"
+#define DIARIO_MARCA 0xD1A1
+#define DIARIO_SEGMENTO_BYTES 8192      // Segmentos pequeños: se borran enteros al confirmarse
+#define DIARIO_MAX_SEGMENTOS 64         // 512 KB como máximo en cola
+#define LOTE_MAX_FICHAJES 20            // Fichajes por petición de lote
+#define LOTE_INTERVALO_MS 3000          // Edad máxima del fichaje pendiente más antiguo
+#define REINTENTO_SUBIDA_MIN_MS 2000
+#define REINTENTO_SUBIDA_MAX_MS 60000
+
+// Notificaciones Telegram en segundo plano
+#define NOTIF_CAPACIDAD 16              // Eventos distintos en cola
+#define NOTIF_VENTANA_DEDUP_MS 60000    // Mismo UID y tipo dentro de la ventana se ignora
+#define NOTIF_AGRUPAR_MS 2000           // Espera para juntar ráfagas en un resumen
+#define NOTIF_RAFAGA 3                  // Envíos seguidos permitidos
+#define NOTIF_INTERVALO_MS 10000        // Un envío más cada 10 s (6 por minuto)
+#define NOTIF_TIMEOUT_MS 500            // Espera por envío; lo que no llega sigue en cola para el siguiente token
+
+// Arranque
+#define ARRANQUE_ESPERA_RED_MS 15000    // Tarjetas en cola esperando la red; después se atienden sin ella
+
+// Reconexión WiFi
+#define REINTENTO_WIFI_MS 2500          // Sin aviso del driver en este tiempo, el intento con la red guardada falló
+#define REINTENTO_WIFI_MIN_MS 100       // Entre dos intentos, aunque el driver avise antes del fallo
+#define ESPERA_DHCP_MS 10000            // Asociado al AP pero sin IP: no cortar el DHCP en curso
+#define REINTENTO_WIFI_ESCANEO_MS 5000  // Tras un intento con escaneo completo
+#define ESCANEO_WIFI_CADA_MS 30000      // Sin conectar con la red guardada, un escaneo completo cada tanto
+#define REUTILIZAR_CONCESION 0          // 1: reusar la última IP de DHCP; solo con reserva por MAC en el router
+
+// Conexión persistente con el backend
+#define BACKEND_INACTIVIDAD_MS 60000    // Reabrir antes que el keep-alive del servidor
+
+// Plazo por tarjeta y corte del backend
+#define PLAZO_TOQUE_MS 800              // Red de una tarjeta: todas sus peticiones salen de este plazo
+#define PLAZO_MIN_PETICION_MS 50        // Con menos margen la petición ni se envía
+#define CORTE_FALLOS 3                  // Fallos seguidos que abren el corte
+#define CORTE_ESPERA_MIN_MS 5000        // Primera prueba en segundo plano tras abrirlo
+#define CORTE_ESPERA_MAX_MS 60000       // La espera entre pruebas se dobla hasta esto
+#define CAPTURA_CAPACIDAD 16            // Tarjetas desconocidas pendientes de enviar a captura
+#define FONDO_TIMEOUT_MS 2000           // Respuesta de una petición de fondo (lote, lista, prueba del corte); una tarjeta la interrumpe
+#define FONDO_CONEXION_MS 300           // Conexión de una petición de fondo: no se puede interrumpir, por debajo de PLAZO_TOQUE_MS
 
 // Credenciales WiFi
 const char* ssid = "XXXXX";
@@ -28,780 +198,5700 @@ const char* password = "XXXXXX";
 const char* serverIP = "192.168.1.XXX";  
 const int serverPort = 5181;
 
+// IP fija opcional; con ipFija vacía se usa DHCP. Es la reconexión más
+// rápida: sin DHCP, la IP está en cuanto el AP acepta la asociación
+const char* ipFija = "";
+const char* puertaEnlaceFija = "";
+const char* mascaraFija = "255.255.255.0";
+const char* dnsFijo = "";               // Vacío: la puerta de enlace
+
+// Rutas del backend
+const char* rutaVerificar = "/api/rfid/verificar/";
+const char* rutaFichaje = "/api/fichajes/rfid";
+const char* rutaFichajeLote = "/api/fichajes/rfid/lote";
+const char* rutaCaptura = "/api/Rfid/capture/unknown";
+const char* rutaNotificacion = "/api/telegramnotifications/fichaje-invalido";
+const char* rutaResumen = "/api/telegramnotifications/resumen";
+const char* rutaTestTelegram = "/api/telegramnotifications/test";
+const char* rutaListaBlanca = "/api/rfid/lista-blanca";
+const char* rutaCambiosLista = "/api/rfid/lista-blanca/cambios";
+const char* rutaToque = "/api/rfid/toque";
+
 // Configuración NTP para hora
 const char* ntpServer = "pool.ntp.org";
 const long gmtOffset_sec = -21600;  // GMT-6 para El Salvador
 const int daylightOffset_sec = 0;
 
+// Un elemento por lector; el 0 usa los pines de arriba. RST es común a todos
+const uint8_t pinesSSLector[NUM_LECTORES] = {SS_PIN};
+const uint8_t pinesIrqLector[NUM_LECTORES] = {IRQ_PIN};
+const uint8_t pinesLedVerde[NUM_LECTORES] = {LED_VERDE};
+const uint8_t pinesLedRojo[NUM_LECTORES] = {LED_ROJO};
+static_assert(NUM_LECTORES >= 1 && NUM_LECTORES <= 16, "El diario guarda el lector en 4 bits");
+
+// Framebuffer de la pantalla en RAM, con el orden del SSD1306 (páginas de 8
+// filas, bit 0 arriba). Aquí solo se dibuja; volcarPantalla() envía por la
+// capa de hardware las columnas que cambian
+enum ColorOLED : uint16_t { OLED_NEGRO = 0, OLED_BLANCO = 1 };
+
+class LienzoOLED : public Adafruit_GFX {
+ public:
+  LienzoOLED() : Adafruit_GFX(SCREEN_WIDTH, SCREEN_HEIGHT) { setTextColor(OLED_BLANCO); }
+  void drawPixel(int16_t x, int16_t y, uint16_t color) override;
+  void drawFastVLine(int16_t x, int16_t y, int16_t h, uint16_t color) override;
+  void drawFastHLine(int16_t x, int16_t y, int16_t w, uint16_t color) override;
+  void fillScreen(uint16_t color) override;
+  void clearDisplay() { fillScreen(OLED_NEGRO); }
+  uint8_t* getBuffer() { return _buffer; }
+ private:
+  uint8_t _buffer[SCREEN_WIDTH * OLED_PAGINAS] = {};
+};
+
 // Objetos
-MFRC522 mfrc522(SS_PIN, RST_PIN);
-Adafruit_SSD1306 display(SCREEN_WIDTH, SCREEN_HEIGHT, &Wire, OLED_RESET);
+LienzoOLED lienzo;
+bool dibujoPrimitivas = false;          // Solo MEDIR_PANTALLAS: iconos con Adafruit_GFX, como antes de los sprites
+
+// Copia de lo que ya tiene la memoria del SSD1306: solo se envía lo que cambia
+uint8_t sombraOLED[SCREEN_WIDTH * OLED_PAGINAS];
+bool sombraValida = false;
+unsigned long volcadosOLED = 0;
+unsigned long bytesOLED = 0;
+unsigned long microsOLED = 0;
+size_t ultimoVolcadoBytes = 0;
+unsigned long ultimoVolcadoUs = 0;
+int ultimoMinutoInforme = -1;
 
 // Variables de tiempo
 unsigned long ultimaActualizacion = 0;
 bool animacionActiva = false;
 
+// Pares hexadecimales de cada byte, generados en compilación
+struct TablaHex {
+  char pares[256][2];
+  constexpr TablaHex() : pares() {
+    for (int i = 0; i < 256; i++) {
+      pares[i][0] = "0123456789ABCDEF"[i >> 4];
+      pares[i][1] = "0123456789ABCDEF"[i & 0x0F];
+    }
+  }
+};
+constexpr TablaHex TABLA_HEX;
+static_assert(TABLA_HEX.pares[0xA7][0] == 'A' && TABLA_HEX.pares[0xA7][1] == '7', "Tabla hexadecimal incorrecta");
+
+// UID por valor, de tamaño fijo: se copia entre colas sin tocar el heap
+struct Uid {
+  uint8_t bytes[UID_MAX];
+  uint8_t longitud;
+  
+  void asignar(const uint8_t* origen, uint8_t n) {
+    memset(bytes, 0, sizeof(bytes));
+    longitud = n > UID_MAX ? UID_MAX : n;
+    memcpy(bytes, origen, longitud);
+  }
+  
+  bool operator==(const Uid& otro) const {
+    return longitud == otro.longitud && memcmp(bytes, otro.bytes, longitud) == 0;
+  }
+  
+  // Hexadecimal en mayúsculas terminado en '\0'; destino de UID_HEX_MAX bytes
+  void aHex(char* destino) const {
+    for (uint8_t i = 0; i < longitud; i++) {
+      destino[i * 2] = TABLA_HEX.pares[bytes[i]][0];
+      destino[i * 2 + 1] = TABLA_HEX.pares[bytes[i]][1];
+    }
+    destino[longitud * 2] = '\0';
+  }
+};
+
+// Cabeceras comunes y dirección IP preparadas una vez, no en cada petición
+char cabecerasComunes[128];
+char ipLocal[16] = "0.0.0.0";
+uint8_t ipLocalBytes[4] = {0, 0, 0, 0};
+
+// Se desactiva en cuanto el backend rechaza un payload binario
+bool formatoBinario = FORMATO_BINARIO;
+bool respuestaBinaria = false;          // Content-Type de la última respuesta
+
+// Escritor MessagePack mínimo sobre un buffer fijo: solo los tipos que usan
+// los payloads del lector (arrays, enteros sin signo, bin, str y nil)
+struct EscritorMsgPack {
+  uint8_t* datos;
+  size_t maximo;
+  size_t largo = 0;
+  bool desbordado = false;
+  
+  EscritorMsgPack(uint8_t* destino, size_t capacidad) : datos(destino), maximo(capacidad) {}
+  
+  void bytes(const void* origen, size_t n) {
+    if (largo + n > maximo) {
+      desbordado = true;
+      return;
+    }
+    memcpy(datos + largo, origen, n);
+    largo += n;
+  }
+  
+  void byte(uint8_t b) { bytes(&b, 1); }
+  
+  void array(uint16_t n) {
+    if (n < 16) {
+      byte(0x90 | n);
+    } else {
+      uint8_t c[3] = {0xDC, (uint8_t)(n >> 8), (uint8_t)n};
+      bytes(c, 3);
+    }
+  }
+  
+  void entero(uint32_t v) {
+    if (v < 0x80) {
+      byte(v);
+    } else if (v <= 0xFF) {
+      uint8_t c[2] = {0xCC, (uint8_t)v};
+      bytes(c, 2);
+    } else if (v <= 0xFFFF) {
+      uint8_t c[3] = {0xCD, (uint8_t)(v >> 8), (uint8_t)v};
+      bytes(c, 3);
+    } else {
+      uint8_t c[5] = {0xCE, (uint8_t)(v >> 24), (uint8_t)(v >> 16), (uint8_t)(v >> 8), (uint8_t)v};
+      bytes(c, 5);
+    }
+  }
+  
+  void binario(const uint8_t* origen, uint8_t n) {
+    uint8_t c[2] = {0xC4, n};
+    bytes(c, 2);
+    bytes(origen, n);
+  }
+  
+  void texto(const char* t) {
+    size_t n = strlen(t);
+    if (n < 32) {
+      byte(0xA0 | n);
+    } else {
+      uint8_t c[2] = {0xD9, (uint8_t)(n > 0xFF ? 0xFF : n)};
+      bytes(c, 2);
+      if (n > 0xFF) n = 0xFF;
+    }
+    bytes(t, n);
+  }
+  
+  void nulo() { byte(0xC0); }
+  
+  size_t terminar() const { return desbordado ? 0 : largo; }
+};
+
+// Memoria usada por el documento de /verificar en la última respuesta y como máximo
+size_t verificacionMemoria = 0;
+size_t verificacionMemoriaMax = 0;
+
+// Tarjetas cuya ruta sin red dejó bloques reservados por la tarea de red (COMPROBAR_HEAP)
+unsigned long tarjetasConAsignaciones = 0;
+
+// Formato de la lista blanca en flash: cabecera + entradas ordenadas de ancho fijo
+struct __attribute__((packed)) CabeceraLista {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t cantidad;
+  uint32_t crc;                         // CRC32 de bloom + entradas
+  uint8_t bloom[LISTA_BLOOM_BYTES];
+};
+
+struct __attribute__((packed)) EntradaLista {
+  uint8_t longitud;
+  uint8_t uid[LISTA_UID_MAX];           // Rellenado con ceros
+};
+
+// Delta entre dos versiones: cabecera + operaciones en el mismo orden que la
+// lista. Cada operación es un byte de control (bit 7 baja, bits 4-6 bytes del
+// UID iguales a la operación anterior, bits 0-3 longitud) y el resto del UID
+struct __attribute__((packed)) CabeceraDelta {
+  uint32_t magic;
+  uint32_t versionBase;                 // 0: sobre la lista vacía
+  uint32_t version;
+  uint32_t operaciones;
+  uint32_t altas;                       // Para reservar sitio antes de fusionar
+  uint32_t bytes;                       // Operaciones codificadas
+  uint32_t crc;                         // CRC32 de las operaciones
+};
+
+enum ResultadoLista { LISTA_NO_DISPONIBLE, LISTA_VALIDA, LISTA_DESCONOCIDA };
+
+// Fotograma clave: al llegar a t ms aplica LEDs, tono y pantalla
+#define SIN_CAMBIO -1
+struct Fotograma {
+  uint16_t t;
+  int8_t ledVerde;                      // HIGH, LOW o SIN_CAMBIO
+  int8_t ledRojo;
+  uint16_t frecuencia;                  // 0 sin tono
+  uint16_t duracionTono;
+  void (*pantalla)(uint8_t paso);       // nullptr sin cambio de pantalla
+  uint8_t paso;
+};
+
+struct LineaTiempo {
+  const Fotograma* fotogramas;
+  uint8_t cantidad;
+  uint16_t duracion;
+  uint16_t minimo;                      // ms visibles antes de ceder a otra animación
+  bool repetir;
+  bool esResultado;                     // Cierra el ciclo de una tarjeta
+};
+
+// Estado del motor de animaciones (solo lo toca loop())
+const LineaTiempo* animacionActual = nullptr;
+const LineaTiempo* animacionSiguiente = nullptr;
+uint8_t canalAnimacion = 0;             // Lector cuyos LEDs usa la animación
+uint8_t canalSiguiente = 0;
+unsigned long inicioAnimacion = 0;
+uint8_t siguienteFotograma = 0;
+int tarjetasEnCurso = 0;               // Puede bajar de 0 un instante si el resultado llega antes que el aviso
+uint32_t cicloDesdeMs = 0;              // Detección de la tarjeta cuyo resultado se muestra
+uint32_t cicloPendienteMs = 0;          // Detección del resultado que aún espera turno
+unsigned long ciclosMedidos = 0;
+unsigned long ciclosSumaMs = 0;
+unsigned long cicloMaximoMs = 0;
+
+// Cola de un productor y un consumidor sin bloqueos: solo el productor mueve
+// la cabeza y solo el consumidor mueve la cola
+template <typename T, size_t N>
+class ColaSPSC {
+  static_assert((N & (N - 1)) == 0, "La capacidad debe ser potencia de 2");
+ public:
+  bool encolar(const T& elemento) {
+    size_t cabeza = _cabeza.load(std::memory_order_relaxed);
+    if (cabeza - _cola.load(std::memory_order_acquire) == N) return false;
+    _datos[cabeza & (N - 1)] = elemento;
+    _cabeza.store(cabeza + 1, std::memory_order_release);
+    return true;
+  }
+  bool desencolar(T& elemento) {
+    size_t cola = _cola.load(std::memory_order_relaxed);
+    if (cola == _cabeza.load(std::memory_order_acquire)) return false;
+    elemento = _datos[cola & (N - 1)];
+    _cola.store(cola + 1, std::memory_order_release);
+    return true;
+  }
+  size_t ocupacion() const {
+    return _cabeza.load(std::memory_order_acquire) - _cola.load(std::memory_order_acquire);
+  }
+ private:
+  T _datos[N];
+  std::atomic<size_t> _cabeza{0};
+  std::atomic<size_t> _cola{0};
+};
+
+// Registro de tamaño fijo que viaja del lector a la tarea de red
+struct EventoTarjeta {
+  Uid uid;
+  uint32_t detectadaMs;
+  uint8_t lector;                       // Índice en pinesSSLector
+};
+
+enum ResultadoTarjeta { RESULTADO_PERMITIDO, RESULTADO_DENEGADO, RESULTADO_ERROR_FICHAJE, RESULTADO_YA_REGISTRADO };
+
+// Respuesta de la tarea de red para el lector
+struct ResultadoEvento {
+  EventoTarjeta evento;
+  uint8_t resultado;
+  uint32_t resueltaMs;
+};
+
+// Una cola por lector: una ráfaga en un torniquete no llena la de los demás
+ColaSPSC<EventoTarjeta, CAPACIDAD_COLA_TARJETAS> colasTarjetas[NUM_LECTORES];
+ColaSPSC<ResultadoEvento, CAPACIDAD_COLA_RESULTADOS> colaResultados;
+// Toques repetidos que el lector responde sin pasar por la tarea de red
+ColaSPSC<ResultadoEvento, CAPACIDAD_COLA_RESULTADOS> colaRepetidas;
+TaskHandle_t tareaRedHandle = nullptr;
+unsigned long tarjetasDescartadas = 0;
+
+// Últimos toques resueltos, del más reciente al menos reciente. Los anota la
+// tarea de red y los consulta también el lector, siempre con antirreboteMux
+struct ToqueReciente {
+  Uid uid;
+  uint8_t lector;
+  uint8_t resultado;
+  uint32_t resueltoMs;
+};
+
+ToqueReciente toquesRecientes[ANTIRREBOTE_CAPACIDAD];
+int toquesEnCache = 0;
+portMUX_TYPE antirreboteMux = portMUX_INITIALIZER_UNLOCKED;
+unsigned long antirreboteAciertos = 0;
+unsigned long antirreboteFallos = 0;
+
+// Tarjetas del lector virtual: las escribe loop() desde el monitor serie
+ColaSPSC<Uid, CAPACIDAD_LECTOR_VIRTUAL> colaLectorVirtual;
+
+// Tarea del lector: avisa a loop() de lecturas nuevas y descartadas
+TaskHandle_t tareaLectorHandle = nullptr;
+std::atomic<uint32_t> lecturasNuevas(0);
+std::atomic<uint32_t> lecturasDescartadas(0);
+std::atomic<uint8_t> ultimoLector(0);
+volatile uint32_t irqLectorMicros = 0;
+bool deteccionIrq = DETECCION_IRQ && !LECTOR_VIRTUAL;
+unsigned long irqLector = 0;
+unsigned long irqPerdidas = 0;
+uint8_t irqPerdidasSeguidas = 0;        // Se reinicia con cada interrupción
+unsigned long armadosREQA = 0;
+unsigned long sondeosLector = 0;
+uint8_t turnoLector = 0;
+
+// Latencia de detección y huecos de sondeo de cada lector (solo tarea del lector)
+struct EstadisticasLector {
+  unsigned long lecturas;
+  unsigned long deteccionSumaUs;
+  unsigned long deteccionMaximoUs;
+  uint32_t ultimoSondeoMs;
+  uint32_t huecoMaximoMs;
+  unsigned long huecosExcedidos;
+};
+
+EstadisticasLector estadisticasLector[NUM_LECTORES];
+
+// Etapas medidas de cada tarjeta; cada una la anota una sola tarea
+enum EtapaTarjeta : uint8_t {
+  ETAPA_LECTURA,                        // Detección -> UID leído (tarea del lector)
+  ETAPA_LISTA,                          // Consulta de la lista blanca local
+  ETAPA_VERIFICAR,                      // verificarTarjeta contra el backend
+  ETAPA_FICHAJE,                        // Diario o registrarFichaje
+  ETAPA_CAPTURA,                        // enviarACaptura de tarjetas denegadas
+  ETAPA_NOTIFICACION,                   // Envío a Telegram (fuera del camino de la tarjeta)
+  ETAPA_COLA,                           // Detección -> la tarea de red empieza con la tarjeta
+  ETAPA_RESUELTA,                       // Detección -> resultado publicado por la tarea de red
+  ETAPA_FEEDBACK,                       // Detección -> resultado en pantalla
+  ETAPA_CICLO,                          // Detección -> fin del feedback en pantalla
+  ETAPA_RECONEXION,                     // Caída del WiFi -> IP de nuevo (no es de tarjeta)
+  ETAPA_DELTA_LISTA,                    // Aplicar un delta de la lista blanca (no es de tarjeta)
+  ETAPA_TOQUE,                          // Transacción única de toque contra el backend
+  NUM_ETAPAS
+};
+
+const char* const nombresEtapa[NUM_ETAPAS] = {
+  "lectura", "lista", "verificar", "fichaje", "captura", "notificacion", "cola", "resuelta", "feedback",
+  "ciclo", "reconexion_wifi", "delta_lista", "toque"
+};
+
+// Cubeta i: hasta 2^i us. Lo que supera la última solo cuenta en +Inf
+struct Histograma {
+  uint32_t cubetas[HISTO_CUBETAS];
+  uint32_t cuenta;
+  uint64_t sumaUs;
+};
+
+Histograma histogramas[NUM_ETAPAS];
+
+// Mide con el contador de ciclos del núcleo; las tareas están fijadas a un
+// núcleo, así que inicio y fin leen el mismo contador
+struct Cronometro {
+  uint32_t ciclos;
+  uint32_t us;
+  
+  void iniciar();
+  uint32_t transcurridoUs() const;
+};
+
+#if PUERTO_METRICAS
+TaskHandle_t tareaMetricasHandle = nullptr;
+#endif
+
+// Hitos del arranque, en ms desde el encendido (0: aún no)
+enum HitoArranque : uint8_t { HITO_LECTOR, HITO_WIFI, HITO_BACKEND, HITO_PRIMERA_TARJETA, NUM_HITOS };
+const char* const nombresHito[NUM_HITOS] = {"lector", "wifi", "backend", "primera_tarjeta"};
+volatile uint32_t hitosArranque[NUM_HITOS] = {0};
+
+// Telemetría de memoria. La muestrea la tarea de red; loop() la lee desde el
+// monitor serie, así que el historial va bajo memoriaMux
+enum TareaMedida : uint8_t { TAREA_RED, TAREA_LECTOR, TAREA_LOOP, TAREA_METRICAS, NUM_TAREAS_MEDIDAS };
+const char* const nombresTarea[NUM_TAREAS_MEDIDAS] = {"red", "lector", "loop", "metricas"};
+
+struct MuestraMemoria {
+  uint32_t ms;
+  uint32_t libre;                       // Bytes libres en el heap de malloc
+  uint32_t bloqueMayor;                 // Mayor reserva posible: baja con la fragmentación
+  uint32_t minimoLibre;                 // Mínimo desde el arranque
+  uint16_t bloques;                     // Bloques reservados
+  uint16_t toques;                      // Tarjetas atendidas en el intervalo
+  int16_t bloquesToqueMax;              // Peor variación de bloques durante una tarjeta
+  uint16_t pila[NUM_TAREAS_MEDIDAS];    // Pila que nunca se ha usado, en bytes
+};
+
+MuestraMemoria historialMemoria[MEMORIA_HISTORIAL];
+uint32_t muestrasMemoria = 0;           // Total tomadas; la más reciente en (n - 1) % MEMORIA_HISTORIAL
+portMUX_TYPE memoriaMux = portMUX_INITIALIZER_UNLOCKED;
+TaskHandle_t tareaLoopHandle = nullptr;
+
+// Variación del heap alrededor de cada tarjeta (solo tarea de red). Es neta y
+// cuenta lo que otras tareas reserven a la vez, pero una fuga o una reserva
+// que sobrevive a la tarjeta se ve en cuanto se repite
+uint32_t toquesMedidos = 0;
+int32_t bloquesToqueSuma = 0;
+int16_t bloquesToqueMax = 0;
+uint16_t toquesIntervalo = 0;
+
+// Última red conocida, guardada en NVS: reconectar sin escaneo ni DHCP
+struct RedGuardada {
+  uint8_t bssid[6];
+  uint8_t canal;
+  uint8_t reservado;                    // Sin huecos: se compara con memcmp
+  uint32_t ip;                          // Concesión DHCP; 0 si no hay
+  uint32_t puerta;
+  uint32_t mascara;
+  uint32_t dns;
+};
+
+RedGuardada redGuardada = {};
+bool redGuardadaValida = false;
+
+// Lo que la capa de hardware avisa de la radio
+enum EventoRed : uint8_t { RED_ASOCIADA, RED_CAIDA, RED_CON_IP };
+
+// Los eventos llegan desde la tarea de eventos WiFi; loop() hace el resto.
+// Tras el arranque wifiCaido solo lo escribe la tarea de eventos
+volatile bool wifiCaido = false;
+volatile bool wifiAsociado = false;
+volatile bool wifiConexionNueva = false;
+volatile bool conexionTrasCaida = false;
+volatile uint32_t caidaWiFiMs = 0;
+volatile uint32_t conexionWiFiMs = 0;
+volatile uint32_t duracionCaidaMs = 0;
+volatile uint32_t avisosCaidaWiFi = 0;  // Caídas e intentos fallidos que avisó el driver
+uint32_t avisosAlIntentar = 0;
+uint32_t ultimoIntentoWiFiMs = 0;
+uint32_t esperaIntentoWiFiMs = 0;
+uint32_t ultimoEscaneoWiFiMs = 0;
+bool intentoConCache = false;
+bool concesionEnUso = false;
+bool wifiConectadoAlgunaVez = false;
+bool avisoSinRedMostrado = false;
+unsigned long reconexionesWiFi = 0;
+unsigned long reconexionMaximaMs = 0;
+
+// Banco de pruebas: loop() prepara la traza y la tarea del lector la inyecta
+struct ToqueTraza {
+  uint32_t ms;                          // Desde el inicio de la reproducción
+  Uid uid;
+  uint8_t lector;
+};
+
+enum EstadoBanco : uint8_t { BANCO_PARADO, BANCO_EN_CURSO };
+
+ToqueTraza trazaBanco[BANCO_MAX_TOQUES];
+int toquesTraza = 0;
+std::atomic<uint8_t> estadoBanco(BANCO_PARADO);
+std::atomic<bool> trazaInyectada(false);
+int siguienteToque = 0;                 // Solo tarea del lector
+uint32_t inicioBancoMs = 0;
+uint32_t ultimoFeedbackBancoMs = 0;
+uint32_t muestrasCola[BANCO_MAX_TOQUES];      // Tarea de red
+int muestrasColaN = 0;
+uint32_t muestrasFeedback[BANCO_MAX_TOQUES];  // loop()
+int muestrasFeedbackN = 0;
+uint32_t semillaBackendSimulado = 0x9E3779B9;
+
+// Respuesta del backend simulado: CuerpoHTTP la lee como si viniera del socket
+class ClienteSimulado : public Client {
+ public:
+  void cargar(const char* datos, size_t largo) { _datos = datos; _largo = largo; _pos = 0; }
+  int connect(IPAddress, uint16_t) override { return 1; }
+  int connect(const char*, uint16_t) override { return 1; }
+#if defined(ESP_ARDUINO_VERSION_MAJOR) && ESP_ARDUINO_VERSION_MAJOR >= 3
+  int connect(IPAddress, uint16_t, int32_t) override { return 1; }
+  int connect(const char*, uint16_t, int32_t) override { return 1; }
+#endif
+  size_t write(uint8_t) override { return 1; }
+  size_t write(const uint8_t*, size_t n) override { return n; }
+  int available() override { return _largo - _pos; }
+  int read() override { return _pos < _largo ? (uint8_t)_datos[_pos++] : -1; }
+  int read(uint8_t* destino, size_t n) override {
+    size_t i = 0;
+    while (i < n && _pos < _largo) destino[i++] = _datos[_pos++];
+    return i;
+  }
+  int peek() override { return _pos < _largo ? (uint8_t)_datos[_pos] : -1; }
+  void flush() override {}
+  void stop() override { _pos = _largo; }
+  uint8_t connected() override { return _pos < _largo; }
+  operator bool() override { return true; }
+ private:
+  const char* _datos = "";
+  size_t _largo = 0;
+  size_t _pos = 0;
+};
+
+ClienteSimulado clienteSimulado;
+ClienteSimulado clienteCambiosSimulado;
+uint32_t versionListaSimulada = 1;
+
+// Registro del diario: solo se añade, nunca se reescribe
+enum TipoRegistro : uint8_t {
+  REGISTRO_INICIO = 1,                  // Primer registro de cada segmento
+  REGISTRO_FICHAJE = 2,
+  REGISTRO_CONFIRMACION = 3             // El backend aceptó el fichaje con esa secuencia
+};
+
+struct __attribute__((packed)) RegistroDiario {
+  uint16_t marca;
+  uint8_t tipo;
+  uint8_t longitud;                     // Bits 0-3: longitud del UID; 4-7: lector
+  uint32_t secuencia;                   // INICIO: última secuencia escrita
+  union {
+    uint32_t confirmado;                // INICIO: última secuencia confirmada
+    uint32_t instante;                  // FICHAJE: momento del toque (0: desconocido, ver marcarInstante)
+  };
+  uint8_t uid[10];
+  uint32_t crc;                         // CRC32 de los campos anteriores
+};
+
+// Estado del diario (solo lo toca la tarea de red)
+File archivoDiario;
+bool diarioDisponible = false;
+uint32_t diarioSecuencia = 0;
+uint32_t diarioConfirmado = 0;
+uint32_t secuenciaArranque = 0;         // Las posteriores se escribieron en este arranque
+uint32_t segmentoEscritura = 1;
+uint32_t segmentoLectura = 1;
+size_t offsetLectura = 0;
+unsigned long proximaSubidaMs = 0;
+unsigned long esperaSubidaMs = REINTENTO_SUBIDA_MIN_MS;
+unsigned long pendienteDesdeMs = 0;
+
+// Posición de lectura dentro del diario
+struct CursorDiario {
+  uint32_t segmento;
+  size_t offset;
+};
+
+// Subida por lotes (se desactiva si el backend no tiene el endpoint)
+bool loteDisponible = true;
+bool toqueDisponible = TOQUE_UNICO;     // Se desactiva si el backend no tiene rutaToque
+unsigned long toquesUnicos = 0;         // Tarjetas resueltas en una sola petición
+unsigned long toquesPorSeparado = 0;    // Transacciones sin respuesta que siguieron por separado
+unsigned long peticionesSubida = 0;
+unsigned long fichajesSubidos = 0;
+
+// Notificación pendiente; las repetidas se acumulan en cantidad
+enum TipoNotificacion : uint8_t { NOTIF_VALIDO, NOTIF_INVALIDO, NOTIF_ERROR };
+const char* nombresNotificacion[] = {"VALIDO", "INVALIDO", "ERROR"};
+
+struct Notificacion {
+  Uid uid;
+  uint8_t tipo;
+  uint16_t cantidad;
+  uint32_t primeraMs;                   // En cola: primera aparición; recientes: envío
+};
+
+// Estado del notificador (solo lo toca la tarea de red)
+Notificacion colaNotificaciones[NOTIF_CAPACIDAD];
+int notificacionesEnCola = 0;
+Notificacion notificacionesRecientes[NOTIF_CAPACIDAD];
+int indiceRecientes = 0;
+uint8_t tokensNotificacion = NOTIF_RAFAGA;
+unsigned long ultimaRecargaNotifMs = 0;
+bool resumenDisponible = true;
+unsigned long notifEncoladas = 0;
+unsigned long notifFusionadas = 0;
+unsigned long notifDeduplicadas = 0;
+unsigned long notifDescartadas = 0;
+unsigned long notifEnviadas = 0;
+unsigned long notifResumenes = 0;
+unsigned long notifFallidas = 0;
+
+// Reloj de fichajes. Lo escribe el aviso de SNTP (tarea de lwIP) y lo leen
+// las demás tareas, así que todo acceso va bajo relojMux
+enum FuenteReloj : uint8_t { RELOJ_SIN_HORA, RELOJ_RTC, RELOJ_NTP };
+
+struct EstadoReloj {
+  uint8_t fuente;
+  int64_t anclaMonoUs;                  // esp_timer en la última sincronización
+  int64_t anclaUnixUs;                  // Hora UTC en ese momento
+  int64_t baseMonoUs;                   // Inicio del intervalo en que se mide la deriva
+  int64_t baseUnixUs;
+  int32_t derivaPpb;                    // > 0: el reloj local atrasa
+  bool derivaMedida;
+  int64_t ultimoErrorUs;                // Predicción - NTP en la última sincronización
+  uint32_t sincronizaciones;
+};
+
+EstadoReloj reloj = {RELOJ_SIN_HORA, 0, 0, 0, 0, 0, false, 0, 0};
+portMUX_TYPE relojMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Conexión HTTP/1.1 keep-alive compartida por todos los endpoints (SOCKET_PETICIONES)
+unsigned long ultimoUsoBackend = 0;
+bool peticionEnCurso = false;
+bool cerrarTrasPeticion = false;
+bool ultimaPeticionReutilizada = false;
+unsigned long peticionesBackend = 0;
+unsigned long reutilizacionesBackend = 0;
+unsigned long reconexionesBackend = 0;
+bool ultimaPeticionFallida = false;     // Sin respuesta, 5xx, cancelada o cortada
+
+// Plazo de la tarjeta en curso y corte del backend (solo tarea de red). Con el
+// corte abierto las tarjetas no usan la red y una prueba de fondo lo cierra
+enum EstadoCorte : uint8_t { CORTE_CERRADO, CORTE_ABIERTO };
+bool plazoActivo = false;
+uint32_t plazoHastaMs = 0;
+uint8_t estadoCorte = CORTE_CERRADO;
+uint8_t fallosSeguidos = 0;
+uint32_t esperaCorteMs = CORTE_ESPERA_MIN_MS;
+uint32_t pruebaCorteMs = 0;
+unsigned long plazosVencidos = 0;
+unsigned long peticionesCanceladas = 0;
+bool peticionCedida = false;            // La petición de fondo en curso se dejó por una tarjeta
+unsigned long peticionesCedidas = 0;
+unsigned long aperturasCorte = 0;
+unsigned long decisionesSinBackend = 0;
+
+// Capturas que no llegaron al backend: se envían cuando vuelve (solo tarea de red)
+struct CapturaPendiente {
+  Uid uid;
+  uint8_t lector;
+};
+
+CapturaPendiente capturasPendientes[CAPTURA_CAPACIDAD];
+int capturasEnCola = 0;
+unsigned long capturasDescartadas = 0;
+
+// Cuerpo de la respuesta en curso: corta en Content-Length o decodifica chunked
+// para no consumir bytes de la siguiente respuesta del mismo socket
+class CuerpoHTTP : public Stream {
+ public:
+  void iniciar(Client* cliente, long longitud, bool chunked, unsigned long hasta);
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t write(uint8_t) override { return 0; }
+  bool terminado() const { return _fin; }
+  size_t leidos() const { return _leidos; }
+  bool error() const { return _error; }
+  void descartar();
+ private:
+  bool prepararDatos();
+  bool esperarDatos();
+  Client* _cliente = nullptr;
+  long _restante = 0;         // Bytes pendientes del cuerpo o del chunk actual, -1 hasta cierre
+  bool _chunked = false;
+  bool _enChunk = false;
+  bool _fin = true;
+  bool _error = false;
+  unsigned long _hasta = 0;
+  size_t _leidos = 0;
+};
+
+CuerpoHTTP cuerpoRespuesta;
+
+// Ambas particiones quedan mapeadas; cambiar de versión es solo cambiar el índice
+size_t tamanosLista[2] = {0, 0};
+const CabeceraLista* mapasLista[2] = {nullptr, nullptr};
+volatile int listaActiva = -1;
+
+// Suscripción a cambios de la lista: un long-poll abierto en un socket propio
+// que la tarea de red revisa en cada vuelta sin bloquearse
+enum EstadoSuscripcion : uint8_t { SUSCRIPCION_INACTIVA, SUSCRIPCION_ESPERANDO };
+CuerpoHTTP cuerpoCambios;
+uint8_t estadoSuscripcion = SUSCRIPCION_INACTIVA;
+bool suscripcionDisponible = LISTA_SUSCRIPCION;
+uint32_t suscripcionDesdeMs = 0;
+uint32_t proximaSuscripcionMs = 0;
+uint32_t listaConfirmadaMs = 0;         // El backend dio por buena la versión local
+unsigned long sincronizacionesDelta = 0;
+unsigned long sincronizacionesCompletas = 0;
+unsigned long bytesDelta = 0;
+unsigned long bytesCompletas = 0;
+unsigned long verificacionesEvitadas = 0;
+
+// Cabeceras de una respuesta HTTP ya leídas del socket
+struct CabecerasHTTP {
+  int codigo;
+  long longitud;                        // -1 sin Content-Length
+  bool chunked;
+  bool cerrar;
+  bool binaria;
+};
+
 // ==================== DECLARACIONES DE FUNCIONES ====================
 
 // Funciones WiFi
-void conectarWiFi();
+void iniciarWiFi();
+void iniciarConexionWiFi(bool usarRedGuardada);
+void aplicarDireccion(bool usarConcesion);
+void eventoWiFi(uint8_t evento);
+void vigilarWiFi();
+void registrarConexionWiFi(bool reconexion);
+void cargarRedGuardada();
+void guardarRed();
 void mostrarConectandoWiFi();
 void mostrarWiFiConectado();
 void mostrarErrorWiFi();
 
 // Funciones OLED mejoradas
 void mostrarPantallaReloj();
-void mostrarLeyendoTarjeta();
+void pantallaReloj(const struct tm& timeinfo);
+void mostrarLeyendoTarjeta(uint8_t lector = 0);
 void mostrarProcesando();
-void mostrarAccesoPermitido();
-void mostrarAccesoDenegado();
-void mostrarErrorFichaje();
+void mostrarAccesoPermitido(uint8_t lector = 0);
+void mostrarAccesoDenegado(uint8_t lector = 0);
+void mostrarErrorFichaje(uint8_t lector = 0);
+void mostrarYaRegistrado(uint8_t lector = 0);
 void dibujarIconoWiFi(int x, int y, bool conectado);
 void dibujarIconoRFID(int x, int y);
 void dibujarCheck(int x, int y);
 void dibujarX(int x, int y);
-void animacionCargando(int ciclos);
+void dibujarLector();
+void dibujarHora(const char* hora, int y);
+void medirPantallas();
+void volcarPantalla();
+
+// Pantallas de las animaciones (un paso por fotograma)
+void pantallaLeyendo(uint8_t paso);
+void pantallaProcesando(uint8_t paso);
+void pantallaPermitido(uint8_t paso);
+void pantallaDenegado(uint8_t paso);
+void pantallaErrorFichaje(uint8_t paso);
+void pantallaYaRegistrado(uint8_t paso);
+void pantallaConectando(uint8_t paso);
+void pantallaWiFiConectado(uint8_t paso);
+void pantallaSinConexion(uint8_t paso);
+
+// Motor de animaciones sin bloqueo
+void iniciarAnimacion(const LineaTiempo* linea, uint8_t canal = 0);
+void avanzarAnimacion();
+void terminarAnimacion();
 
 // Funciones sonido mejoradas
-void sonidoAceptacion();
-void sonidoDenegado();
-void sonidoError();
-void sonidoConexionWiFi();
 void sonidoEsperaRFID();
+void parpadeoActivo();
 
 // Funciones RFID
-String leerUID();
-bool verificarTarjeta(String uid);
-bool registrarFichaje(String uid);
-void enviarACaptura(String uid);
-void procesarTarjeta(String uid);
+bool verificarTarjeta(const char* uidHex, char* nombreEmpleado = nullptr, size_t maximoNombre = 0, uint8_t lector = 0);
+void negociarToque();
+int transaccionToque(const EventoTarjeta& evento, uint32_t instante, char* nombreEmpleado, size_t maximoNombre);
+bool registrarFichaje(const Uid& uid, uint32_t secuencia = 0, uint32_t instante = 0, uint8_t lector = 0);
+bool enviarACaptura(const Uid& uid, uint8_t lector = 0, uint32_t timeoutMs = 8000);
+void encolarCaptura(const Uid& uid, uint8_t lector);
+void enviarCapturasPendientes();
+int procesarTarjeta(const EventoTarjeta& evento);
+int consultarToqueReciente(const Uid& uid, uint8_t lector, uint32_t ahoraMs);
+void recordarToque(const Uid& uid, uint8_t lector, uint8_t resultado, uint32_t ahoraMs);
+void mostrarResultado(const ResultadoEvento& resultado);
+
+// Funciones tareas
+void tareaRed(void* parametro);
+void tareaLector(void* parametro);
+void tareaMetricas(void* parametro);
+void esperarRedArranque();
+void comprobarBackendArranque();
+void atenderTarjetas();
+void atenderTarjeta(const EventoTarjeta& evento);
+size_t tarjetasEnCola();
+void marcarHito(uint8_t hito);
+
+// Funciones detección de tarjetas
+void IRAM_ATTR interrupcionLector();
+bool leerTarjeta(uint8_t lector, uint32_t detectadaUs);
+bool publicarLectura(const EventoTarjeta& evento);
+bool responderRepetida(const EventoTarjeta& evento);
+void marcarSondeo(uint8_t lector);
+void informeLector();
+
+// Funciones reloj de fichajes
+void iniciarReloj();
+void sincronizacionNTP(struct timeval* tv);
+bool relojAUnix(int64_t monoUs, int64_t& unixUs);
+uint32_t marcarInstante(uint32_t detectadaMs);
+uint32_t instanteUnix(uint32_t instante, bool mismoArranque);
+
+// Funciones telemetría de memoria
+void tomarMuestraMemoria();
+void imprimirMemoria(Print& salida);
+void imprimirMuestraMemoria(Print& salida, const MuestraMemoria& m);
+
+// Funciones de métricas
+void anotarLatencia(uint8_t etapa, uint32_t us);
+void escribirMetricas(Print& salida);
+void atenderMetricas();
+
+// Capa de hardware: todo acceso a periféricos, red, flash y relojes pasa por aquí
+enum SocketBackend : uint8_t { SOCKET_PETICIONES, SOCKET_CAMBIOS, NUM_SOCKETS };
+void halIniciar();
+void halLed(uint8_t pin, int nivel);
+void halTono(unsigned int frecuencia, unsigned long duracionMs);
+void halSilencio();
+bool halRedConectada();
+uint32_t halCiclos();
+uint32_t halCiclosPorUs();
+void halConfigurarIrqLector();
+void halDesactivarIrqLector();
+void halArmarREQA(uint8_t lector);
+bool halRespuestaLector(uint8_t lector);
+void halLimpiarIrqLector(uint8_t lector);
+bool halHayTarjetaNueva(uint8_t lector);
+bool halLeerUID(uint8_t lector, Uid& uid);
+bool halEnviarPantalla(uint8_t pagina, uint8_t desde, uint8_t hasta, const uint8_t* datos);
+unsigned long halMillis();
+unsigned long halMicros();
+unsigned long halMicrosReales();
+void halEsperar(uint32_t ms);
+int64_t halRelojUs();
+void halHoraSistema(struct timeval& ahora);
+bool halHoraLocal(struct tm& hora);
+void halIniciarNTP(void (*aviso)(struct timeval*));
+void halIniciarWiFi(void (*aviso)(uint8_t evento));
+void halConectarWiFi(const char* red, const char* clave, uint8_t canal, const uint8_t* bssid);
+void halDesconectarWiFi();
+void halConfigurarDireccion(uint32_t ip, uint32_t puerta, uint32_t mascara, uint32_t dns);
+bool halWiFiConectada();
+bool halLeerRed(RedGuardada& red);
+uint32_t halIPLocal();
+bool halLeerAjustes(const char* espacio, const char* clave, void* datos, size_t largo);
+void halGuardarAjustes(const char* espacio, const char* clave, const void* datos, size_t largo);
+bool halMontarArchivos();
+File halAbrirArchivo(const char* ruta, const char* modo, bool crear = false);
+bool halExisteArchivo(const char* ruta);
+void halCrearDirectorio(const char* ruta);
+void halBorrarArchivo(const char* ruta);
+const uint8_t* halMapearLista(uint8_t particion, size_t& tamano);
+size_t halReservasTarea();
+bool halBorrarLista(uint8_t particion, size_t bytes);
+bool halEscribirLista(uint8_t particion, size_t offset, const void* datos, size_t bytes);
+Client& halSocket(uint8_t socket);
+bool halConectarSocket(uint8_t socket, uint32_t timeoutMs);
+void halIniciarServidorMetricas();
+Client* halClienteMetricas();
+
+// Monitor serie: comandos de diagnóstico
+void atenderSerie();
+void volcarPBM();
+
+// Funciones banco de pruebas
+void iniciarBanco();
+void generarTrazaSintetica();
+void reproducirTraza();
+void comprobarFinBanco();
+void informeBanco();
+uint32_t percentil(uint32_t* muestras, int n, int porcentaje);
+uint32_t aleatorioBanco(uint32_t& estado);
+int peticionSimulada(const char* ruta, const char* tipoContenido, const uint8_t* cuerpo, size_t longitudCuerpo, uint32_t timeoutMs);
+void cambiosSimulados(uint32_t version);
+size_t listaSimulada(uint8_t* destino, size_t maximo);
+
+// Funciones diario de fichajes
+bool iniciarDiario();
+bool anotarFichaje(const EventoTarjeta& evento, uint32_t& secuencia);
+bool subirDiario();
+uint32_t fichajesPendientes();
+unsigned long esperaHastaSubida();
+int enviarLote(const RegistroDiario* lote, int cantidad);
+int enviarIndividual(const RegistroDiario* lote, int cantidad);
 
 // Funciones Telegram
-bool notificarTelegram(String uid, String tipo, String nombreEmpleado = "");
+bool notificarTelegram(const Uid& uid, uint8_t tipo, const char* nombreEmpleado = nullptr);
 bool testConexionTelegram();
+void encolarNotificacion(const Uid& uid, uint8_t tipo);
+void enviarNotificaciones();
+bool enviarResumen();
+
+// Funciones lista blanca local
+void cargarListaBlanca();
+int consultarListaBlanca(const byte* uid, byte longitud);
+bool instalarListaBlanca(Stream& origen);
+bool actualizarListaBlanca();
+uint32_t versionListaLocal();
+bool listaAlDia();
+void bloomAgregar(uint8_t* bloom, const EntradaLista& e);
+bool leerOperacionDelta(Stream& origen, EntradaLista& e, bool& baja, uint32_t& crc, uint32_t& bytes);
+size_t codificarOperacionDelta(uint8_t* destino, const EntradaLista& anterior, const EntradaLista& e, bool baja);
+bool aplicarDeltaLista(Stream& origen);
+void atenderSuscripcionLista();
+void abrirSuscripcionLista();
+void procesarCambiosLista();
+
+// Funciones conexión backend
+int peticionBackend(const char* metodo, const char* ruta, const char* tipoContenido, const uint8_t* cuerpo, size_t longitudCuerpo, uint32_t timeoutMs);
+int enviarPeticionBackend(const char* metodo, const char* ruta, const char* tipoContenido, const uint8_t* cuerpo, size_t longitudCuerpo, uint32_t timeoutMs);
+uint32_t plazoPeticion(uint32_t timeoutMs);
+void anotarRespuestaBackend(int codigo);
+bool cederPeticion();
+void probarBackend();
+bool leerCabecerasHTTP(Client& cliente, unsigned long hasta, bool sinCuerpo, CabecerasHTTP& c);
+void finalizarPeticionBackend();
+void prepararConexionBackend();
+void actualizarIPLocal();
+int postJSONBackend(const char* ruta, const char* json, size_t largo, uint32_t timeoutMs);
+int postBinarioBackend(const char* ruta, const uint8_t* datos, size_t largo, uint32_t timeoutMs);
+bool rechazaBinario(int httpCode);
+
+// Serializadores de payloads: escriben en el buffer del llamador y devuelven
+// la longitud, o 0 si no cabe
+size_t jsonFichaje(char* destino, size_t maximo, const char* uidHex, uint32_t secuencia, uint32_t instante = 0, uint8_t lector = 0);
+size_t jsonNotificacion(char* destino, size_t maximo, const char* uidHex, const char* tipo, const char* nombreEmpleado);
+size_t jsonCaptura(char* destino, size_t maximo, const char* uidHex, uint8_t lector = 0);
+size_t msgpackFichaje(uint8_t* destino, size_t maximo, const Uid& uid, uint32_t secuencia, uint32_t instante = 0, uint8_t lector = 0);
+size_t msgpackNotificacion(uint8_t* destino, size_t maximo, const Uid& uid, uint8_t tipo, const char* nombreEmpleado);
+size_t msgpackCaptura(uint8_t* destino, size_t maximo, const Uid& uid, uint8_t lector = 0);
+void compararFormatos();
+void imprimirComparacion(const char* payload, size_t largoJson, float usJson, size_t largoBinario, float usBinario);
+
+// Comprobación de memoria dinámica
+size_t bloquesHeap();
 
 void setup() {
   Serial.begin(115200);
   
-  // Configurar pines
-  pinMode(LED_VERDE, OUTPUT);
-  pinMode(LED_ROJO, OUTPUT);
-  pinMode(BUZZER, OUTPUT);
-  digitalWrite(BUZZER, LOW);
-  
-  // Inicializar SPI para RFID
-  SPI.begin();
-  mfrc522.PCD_Init();
+  // Pines, lector RFID y pantalla: lo único imprescindible para aceptar tarjetas
+  halIniciar();
   
-  // Inicializar OLED
-  Wire.begin(OLED_SDA, OLED_SCL);
-  if(!display.begin(SSD1306_SWITCHCAPVCC, 0x3C)) {
-    Serial.println("Error al inicializar OLED");
-    for(;;);
-  }
+  // La asociación y el NTP avanzan solos mientras sigue el arranque
+  iniciarWiFi();
+  iniciarReloj();
   
-  Serial.println("OLED inicializado correctamente");
+  // Lista blanca local desde flash (no necesita red)
+  cargarListaBlanca();
   
-  display.clearDisplay();
-  display.setTextColor(SSD1306_WHITE);
-  display.display();
+  // Diario de fichajes pendientes de subir
+  if (!iniciarDiario()) {
+    Serial.println("Diario no disponible, los fichajes iran directo al backend");
+  }
   
-  // Conectar WiFi con estética mejorada
-  conectarWiFi();
+  // Cabeceras HTTP comunes, una sola vez
+  prepararConexionBackend();
   
-  // Configurar servidor NTP para hora
-  configTime(gmtOffset_sec, daylightOffset_sec, ntpServer);
-  delay(2000);
+  // La red trabaja en el núcleo 0; el lector y loop() (pantalla) en el núcleo 1.
+  // Lo que necesita backend (lista blanca, test de Telegram) lo hace la tarea de red
+  tareaLoopHandle = xTaskGetCurrentTaskHandle();
+  xTaskCreatePinnedToCore(tareaRed, "red", PILA_TAREA_RED, nullptr, 1, &tareaRedHandle, NUCLEO_RED);
+  xTaskCreatePinnedToCore(tareaLector, "lector", PILA_TAREA_LECTOR, nullptr, PRIORIDAD_TAREA_LECTOR,
+                          &tareaLectorHandle, NUCLEO_LECTOR);
+#if PUERTO_METRICAS
+  // Un cliente lento de /metrics solo retrasa a esta tarea, nunca una tarjeta
+  xTaskCreatePinnedToCore(tareaMetricas, "metricas", PILA_TAREA_METRICAS, nullptr, PRIORIDAD_TAREA_METRICAS,
+                          &tareaMetricasHandle, NUCLEO_RED);
+#endif
   
-  // Test inicial de Telegram
-  Serial.println("Realizando test inicial de Telegram...");
-  if (testConexionTelegram()) {
-    Serial.println("Test Telegram exitoso");
-  } else {
-    Serial.println("Test Telegram falló");
-  }
+  // Solo en builds de medición: bloquea el arranque
+  if (MEDIR_PANTALLAS) medirPantallas();
   
-  // Mostrar pantalla de reloj inicial
-  mostrarPantallaReloj();
+  // Animación de conexión hasta que haya IP; una tarjeta la interrumpe
+  mostrarConectandoWiFi();
 }
 
 void loop() {
-  // Actualizar pantalla de reloj cada 5 segundos
-  if (millis() - ultimaActualizacion > 5000 && !animacionActiva) {
-    mostrarPantallaReloj();
-    ultimaActualizacion = millis();
-  }
+  // Las animaciones avanzan por tiempo, nunca con delay()
+  avanzarAnimacion();
+  
+  // Comandos del monitor serie (volcado de pantalla, lector virtual)
+  atenderSerie();
   
-  // Parpadeo sutil LED verde cada 10 segundos (sistema activo)
-  static unsigned long ultimoParpadeo = 0;
-  if (millis() - ultimoParpadeo > 10000) {
-    digitalWrite(LED_VERDE, HIGH);
-    delay(50);
-    digitalWrite(LED_VERDE, LOW);
-    ultimoParpadeo = millis();
+  // Reconexión en segundo plano; halConectarWiFi no bloquea
+  vigilarWiFi();
+  
+  // Lecturas de la tarea del lector desde la última vuelta; van antes que los
+  // resultados para que "leyendo" no tape un resultado que llega a la vez
+  uint32_t descartadas = lecturasDescartadas.exchange(0);
+  uint32_t nuevas = lecturasNuevas.exchange(0);
+  if (descartadas > 0) {
+    mostrarErrorFichaje();
+  }
+  if (nuevas > 0) {
+    tarjetasEnCurso += nuevas;
+    // Una tarjeta nueva interrumpe el feedback de la anterior
+    mostrarLeyendoTarjeta(ultimoLector.load());
   }
   
-  // Sonido sutil cada 30 segundos para indicar que está activo
-  static unsigned long ultimoSonido = 0;
-  if (millis() - ultimoSonido > 30000) {
-    sonidoEsperaRFID();
-    ultimoSonido = millis();
+  // Resultados que la tarea de red ya resolvió
+  ResultadoEvento resultado;
+  if (colaResultados.desencolar(resultado) || colaRepetidas.desencolar(resultado)) {
+    tarjetasEnCurso--;
+    mostrarResultado(resultado);
   }
   
-  if (!mfrc522.PICC_IsNewCardPresent()) return;
-  if (!mfrc522.PICC_ReadCardSerial()) return;
+  // Mientras la red trabaja se mantiene la animación de espera
+  if (animacionActual == nullptr && tarjetasEnCurso > 0) {
+    mostrarProcesando();
+  }
   
-  animacionActiva = true;
-  String uid = leerUID();
-  Serial.println("Tarjeta detectada: " + uid);
+  if (BANCO_PRUEBAS) comprobarFinBanco();
   
-  mostrarLeyendoTarjeta();
-  procesarTarjeta(uid);
+  if (!animacionActiva) {
+    // Actualizar pantalla de reloj cada 5 segundos
+    if (halMillis() - ultimaActualizacion > 5000) {
+      mostrarPantallaReloj();
+      ultimaActualizacion = halMillis();
+    }
+    
+    // Parpadeo sutil LED verde cada 10 segundos (sistema activo)
+    static unsigned long ultimoParpadeo = 0;
+    if (halMillis() - ultimoParpadeo > 10000) {
+      parpadeoActivo();
+      ultimoParpadeo = halMillis();
+    }
+    
+    // Sonido sutil cada 30 segundos para indicar que está activo
+    static unsigned long ultimoSonido = 0;
+    if (halMillis() - ultimoSonido > 30000) {
+      sonidoEsperaRFID();
+      ultimoSonido = halMillis();
+    }
+  }
   
-  mfrc522.PICC_HaltA();
-  animacionActiva = false;
-  delay(500);  // Reducido de 1000ms a 500ms
-  mostrarPantallaReloj();
+  // La lectura ya no depende de loop(): se cede el núcleo entre vueltas
+  halEsperar(5);
 }
 
 // ==================== FUNCIONES PANTALLA OLED MEJORADAS ====================
 
 void mostrarPantallaReloj() {
   struct tm timeinfo;
-  if(!getLocalTime(&timeinfo)){
+  if(!halHoraLocal(timeinfo)){
     // Si no hay hora, mostrar pantalla de inicio simple
-    display.clearDisplay();
-    display.setTextSize(2);
-    display.setCursor(10, 15);
-    display.println("SISTEMA");
-    display.setCursor(20, 35);
-    display.println("FICHAJE");
-    display.setTextSize(1);
-    display.setCursor(20, 52);
-    display.println("Acercar tarjeta");
-    display.display();
+    lienzo.clearDisplay();
+    lienzo.setTextSize(2);
+    lienzo.setCursor(10, 15);
+    lienzo.println("SISTEMA");
+    lienzo.setCursor(20, 35);
+    lienzo.println("FICHAJE");
+    lienzo.setTextSize(1);
+    lienzo.setCursor(20, 52);
+    lienzo.println("Acercar tarjeta");
+    volcarPantalla();
     return;
   }
   
-  display.clearDisplay();
+  pantallaReloj(timeinfo);
+  
+  // Coste de los volcados, una vez por minuto
+  if (timeinfo.tm_min != ultimoMinutoInforme) {
+    ultimoMinutoInforme = timeinfo.tm_min;
+    Serial.print("OLED: ");
+    Serial.print(volcadosOLED);
+    Serial.print(" volcados, media ");
+    Serial.print(volcadosOLED ? bytesOLED / volcadosOLED : 0);
+    Serial.print(" bytes / ");
+    Serial.print(volcadosOLED ? microsOLED / volcadosOLED : 0);
+    Serial.print(" us (ultimo ");
+    Serial.print(ultimoVolcadoBytes);
+    Serial.print(" bytes / ");
+    Serial.print(ultimoVolcadoUs);
+    Serial.println(" us)");
+  }
+}
+
+void pantallaReloj(const struct tm& timeinfo) {
+  lienzo.clearDisplay();
   
   // Dibujar borde decorativo superior
-  display.drawLine(0, 8, 127, 8, SSD1306_WHITE);
+  lienzo.drawLine(0, 8, 127, 8, OLED_BLANCO);
   
   // Icono RFID en esquina superior izquierda
   dibujarIconoRFID(2, 0);
   
   // Icono WiFi en esquina superior derecha
-  dibujarIconoWiFi(108, 0, WiFi.status() == WL_CONNECTED);
+  dibujarIconoWiFi(108, 0, halRedConectada());
   
-  // Hora grande y centrada
-  display.setTextSize(3);
+  // Hora grande y centrada, con los glifos precalculados
   char horaStr[6];
   strftime(horaStr, 6, "%H:%M", &timeinfo);
-  int16_t x1, y1;
-  uint16_t w, h;
-  display.getTextBounds(horaStr, 0, 0, &x1, &y1, &w, &h);
-  display.setCursor((128 - w) / 2, 18);
-  display.print(horaStr);
-  
-  // Fecha pequeña centrada
-  display.setTextSize(1);
+  dibujarHora(horaStr, 18);
+  
+  // Fecha pequeña centrada (fuente fija de 6 px por carácter)
+  lienzo.setTextSize(1);
   char fechaStr[20];
   strftime(fechaStr, 20, "%d/%m/%Y", &timeinfo);
-  display.getTextBounds(fechaStr, 0, 0, &x1, &y1, &w, &h);
-  display.setCursor((128 - w) / 2, 45);
-  display.print(fechaStr);
+  lienzo.setCursor((128 - strlen(fechaStr) * 6) / 2, 45);
+  lienzo.print(fechaStr);
   
   // Indicador parpadeante
-  if ((millis() / 500) % 2 == 0) {
-    display.fillCircle(64, 58, 2, SSD1306_WHITE);
+  if ((halMillis() / 500) % 2 == 0) {
+    lienzo.fillCircle(64, 58, 2, OLED_BLANCO);
   }
   
   // Texto inferior
-  display.setTextSize(1);
-  display.setCursor(15, 55);
-  display.print("Acercar tarjeta");
+  lienzo.setTextSize(1);
+  lienzo.setCursor(15, 55);
+  lienzo.print("Acercar tarjeta");
   
-  display.display();
+  volcarPantalla();
 }
 
-void mostrarLeyendoTarjeta() {
-  display.clearDisplay();
-  
-  // Parpadeo rápido ambos LEDs (tarjeta detectada)
-  for(int i = 0; i < 2; i++) {
-    digitalWrite(LED_VERDE, HIGH);
-    digitalWrite(LED_ROJO, HIGH);
-    delay(80);
-    digitalWrite(LED_VERDE, LOW);
-    digitalWrite(LED_ROJO, LOW);
-    delay(80);
+void pantallaLeyendo(uint8_t paso) {
+  // paso 0: pantalla completa; pasos siguientes solo añaden barras
+  if (paso == 0) {
+    lienzo.clearDisplay();
+    
+    // Icono RFID grande centrado
+    dibujarIconoRFID(54, 10);
+    
+    // Texto
+    lienzo.setTextSize(2);
+    lienzo.setCursor(25, 30);
+    lienzo.println("LEYENDO");
   }
   
-  // Icono RFID grande centrado
-  dibujarIconoRFID(54, 10);
-  
-  // Texto
-  display.setTextSize(2);
-  display.setCursor(25, 30);
-  display.println("LEYENDO");
-  
-  // Animación de carga con LEDs alternados
-  for(int c = 0; c < 3; c++) {
-    // Alternar LEDs durante la lectura
-    if(c % 2 == 0) {
-      digitalWrite(LED_VERDE, HIGH);
-    } else {
-      digitalWrite(LED_ROJO, HIGH);
-    }
-    
-    for(int i = 0; i < 8; i++) {
-      int x = 44 + (i * 5);
-      if(i <= c * 3) {
-        display.fillRect(x, 50, 3, 8, SSD1306_WHITE);
-      }
+  for(int i = 0; i < 8; i++) {
+    int x = 44 + (i * 5);
+    if(i <= paso * 3) {
+      lienzo.fillRect(x, 50, 3, 8, OLED_BLANCO);
     }
-    display.display();
-    delay(150);
-    
-    digitalWrite(LED_VERDE, LOW);
-    digitalWrite(LED_ROJO, LOW);
   }
+  volcarPantalla();
 }
 
-void mostrarProcesando() {
-  display.clearDisplay();
-  display.setTextSize(2);
-  display.setCursor(5, 15);
-  display.println("PROCESANDO");
-  
-  // Animación de puntos con LEDs alternados
-  for(int i = 0; i < 4; i++) {
-    // Alternar LEDs durante procesamiento
-    if(i % 2 == 0) {
-      digitalWrite(LED_VERDE, HIGH);
-      digitalWrite(LED_ROJO, LOW);
-    } else {
-      digitalWrite(LED_VERDE, LOW);
-      digitalWrite(LED_ROJO, HIGH);
-    }
-    
-    display.fillRect(30, 40, 70, 10, SSD1306_BLACK);
-    display.setTextSize(2);
-    display.setCursor(40, 40);
-    for(int j = 0; j <= i; j++) {
-      display.print(".");
-    }
-    display.display();
-    tone(BUZZER, 1500 + (i * 100), 80);
-    delay(350);
+void pantallaProcesando(uint8_t paso) {
+  if (paso == 0) {
+    lienzo.clearDisplay();
+    lienzo.setTextSize(2);
+    lienzo.setCursor(5, 15);
+    lienzo.println("PROCESANDO");
   }
   
-  // Apagar LEDs
-  digitalWrite(LED_VERDE, LOW);
-  digitalWrite(LED_ROJO, LOW);
+  // Animación de puntos
+  lienzo.fillRect(30, 40, 70, 10, OLED_NEGRO);
+  lienzo.setTextSize(2);
+  lienzo.setCursor(40, 40);
+  for(int j = 0; j <= paso; j++) {
+    lienzo.print(".");
+  }
+  volcarPantalla();
 }
 
-void mostrarAccesoPermitido() {
-  display.clearDisplay();
+void pantallaPermitido(uint8_t paso) {
+  lienzo.clearDisplay();
   
   // Check grande centrado
   dibujarCheck(44, 5);
   
   // Texto
-  display.setTextSize(2);
-  display.setCursor(15, 35);
-  display.println("PERMITIDO");
+  lienzo.setTextSize(2);
+  lienzo.setCursor(15, 35);
+  lienzo.println("PERMITIDO");
   
   // Borde verde (simulado con líneas)
-  display.drawRect(5, 5, 118, 54, SSD1306_WHITE);
-  display.drawRect(6, 6, 116, 52, SSD1306_WHITE);
-  
-  display.display();
+  lienzo.drawRect(5, 5, 118, 54, OLED_BLANCO);
+  lienzo.drawRect(6, 6, 116, 52, OLED_BLANCO);
   
-  // Efecto LED verde pulsante más dramático
-  for(int i = 0; i < 3; i++) {
-    digitalWrite(LED_VERDE, HIGH);
-    delay(200);
-    digitalWrite(LED_VERDE, LOW);
-    delay(100);
-  }
-  
-  // LED verde fijo durante 800ms
-  digitalWrite(LED_VERDE, HIGH);
-  delay(800);
-  digitalWrite(LED_VERDE, LOW);
+  dibujarLector();
+  volcarPantalla();
 }
 
-void mostrarAccesoDenegado() {
-  display.clearDisplay();
+void pantallaDenegado(uint8_t paso) {
+  // paso 1 con borde, paso 0 sin borde (efecto de parpadeo)
+  lienzo.clearDisplay();
   
   // X grande centrada
   dibujarX(44, 5);
   
   // Texto
-  display.setTextSize(2);
-  display.setCursor(20, 35);
-  display.println("DENEGADO");
-  
-  // Efecto de parpadeo pantalla + LED rojo
-  for(int i = 0; i < 3; i++) {
-    digitalWrite(LED_ROJO, HIGH);
-    display.drawRect(5, 5, 118, 54, SSD1306_WHITE);
-    display.drawRect(6, 6, 116, 52, SSD1306_WHITE);
-    display.display();
-    delay(180);
-    
-    digitalWrite(LED_ROJO, LOW);
-    display.fillRect(5, 5, 118, 54, SSD1306_BLACK);
-    display.setTextSize(2);
-    display.setCursor(20, 35);
-    display.println("DENEGADO");
-    dibujarX(44, 5);
-    display.display();
-    delay(180);
-  }
-  
-  // LED rojo fijo durante 600ms
-  digitalWrite(LED_ROJO, HIGH);
-  display.drawRect(5, 5, 118, 54, SSD1306_WHITE);
-  display.drawRect(6, 6, 116, 52, SSD1306_WHITE);
-  display.display();
-  delay(600);
-  digitalWrite(LED_ROJO, LOW);
-}
-
-void mostrarErrorFichaje() {
-  display.clearDisplay();
+  lienzo.setTextSize(2);
+  lienzo.setCursor(20, 35);
+  lienzo.println("DENEGADO");
   
-  // Símbolo de advertencia
-  display.fillTriangle(64, 10, 50, 35, 78, 35, SSD1306_WHITE);
-  display.fillTriangle(64, 15, 55, 32, 73, 32, SSD1306_BLACK);
-  display.fillCircle(64, 26, 2, SSD1306_WHITE);
-  display.fillRect(62, 18, 4, 6, SSD1306_WHITE);
-  
-  display.setTextSize(1);
-  display.setCursor(20, 42);
-  display.println("ERROR FICHAJE");
-  display.setCursor(15, 54);
-  display.println("Intente de nuevo");
-  
-  display.display();
-  
-  // Parpadeo alternado rápido de ambos LEDs
-  for(int i = 0; i < 5; i++) {
-    digitalWrite(LED_ROJO, HIGH);
-    digitalWrite(LED_VERDE, LOW);
-    delay(120);
-    digitalWrite(LED_ROJO, LOW);
-    digitalWrite(LED_VERDE, HIGH);
-    delay(120);
-  }
-  
-  // LED rojo fijo por 700ms
-  digitalWrite(LED_VERDE, LOW);
-  digitalWrite(LED_ROJO, HIGH);
-  delay(700);
-  digitalWrite(LED_ROJO, LOW);
-}
-
-void mostrarConectandoWiFi() {
-  display.clearDisplay();
-  
-  // Icono WiFi desconectado animado
-  for(int i = 0; i < 10; i++) {
-    display.fillRect(0, 0, 128, 64, SSD1306_BLACK);
-    
-    // Alternar LEDs durante conexión
-    if(i % 2 == 0) {
-      digitalWrite(LED_VERDE, HIGH);
-      digitalWrite(LED_ROJO, LOW);
-    } else {
-      digitalWrite(LED_VERDE, LOW);
-      digitalWrite(LED_ROJO, HIGH);
-    }
-    
-    // WiFi animado
-    int offset = (i % 3) * 15;
-    dibujarIconoWiFi(54 + offset - 15, 5, false);
-    
-    display.setTextSize(2);
-    display.setCursor(10, 30);
-    display.println("CONECTANDO");
-    
-    // Barra de progreso
-    int progreso = (i * 12);
-    display.drawRect(14, 50, 100, 8, SSD1306_WHITE);
-    display.fillRect(16, 52, progreso, 4, SSD1306_WHITE);
-    
-    display.display();
-    
-    tone(BUZZER, 2000 + (i * 50), 50);
-    delay(200);
+  if (paso == 1) {
+    lienzo.drawRect(5, 5, 118, 54, OLED_BLANCO);
+    lienzo.drawRect(6, 6, 116, 52, OLED_BLANCO);
   }
-  
-  // Apagar LEDs al terminar animación
-  digitalWrite(LED_VERDE, LOW);
-  digitalWrite(LED_ROJO, LOW);
+  dibujarLector();
+  volcarPantalla();
 }
 
-void mostrarWiFiConectado() {
-  display.clearDisplay();
+void pantallaYaRegistrado(uint8_t paso) {
+  lienzo.clearDisplay();
   
-  // Check grande
+  // Check sin borde: el fichaje ya estaba hecho
   dibujarCheck(44, 5);
   
-  display.setTextSize(2);
-  display.setCursor(25, 32);
-  display.println("CONECTADO");
+  lienzo.setTextSize(2);
+  lienzo.setCursor(22, 35);
+  lienzo.println("YA ESTA");
+  lienzo.setTextSize(1);
+  lienzo.setCursor(22, 54);
+  lienzo.print("fichaje previo");
   
-  display.setTextSize(1);
-  String ip = WiFi.localIP().toString();
-  display.setCursor((128 - (ip.length() * 6)) / 2, 52);
-  display.print(ip);
-  
-  display.display();
+  dibujarLector();
+  volcarPantalla();
+}
+
+void pantallaErrorFichaje(uint8_t paso) {
+  lienzo.clearDisplay();
   
-  // Animación LED verde de éxito
-  for(int i = 0; i < 4; i++) {
-    digitalWrite(LED_VERDE, HIGH);
-    delay(150);
-    digitalWrite(LED_VERDE, LOW);
-    delay(150);
-  }
+  // Símbolo de advertencia
+  lienzo.fillTriangle(64, 10, 50, 35, 78, 35, OLED_BLANCO);
+  lienzo.fillTriangle(64, 15, 55, 32, 73, 32, OLED_NEGRO);
+  lienzo.fillCircle(64, 26, 2, OLED_BLANCO);
+  lienzo.fillRect(62, 18, 4, 6, OLED_BLANCO);
   
-  sonidoConexionWiFi();
+  lienzo.setTextSize(1);
+  lienzo.setCursor(20, 42);
+  lienzo.println("ERROR FICHAJE");
+  lienzo.setCursor(15, 54);
+  lienzo.println("Intente de nuevo");
   
-  // LED verde fijo por 1 segundo
-  digitalWrite(LED_VERDE, HIGH);
-  delay(1000);
-  digitalWrite(LED_VERDE, LOW);
+  dibujarLector();
+  volcarPantalla();
 }
 
-void mostrarErrorWiFi() {
-  display.clearDisplay();
-  
-  // X grande
-  dibujarX(44, 5);
+void pantallaConectando(uint8_t paso) {
+  lienzo.clearDisplay();
   
-  display.setTextSize(2);
-  display.setCursor(5, 32);
-  display.println("SIN CONEXION");
+  // WiFi animado
+  int offset = (paso % 3) * 15;
+  dibujarIconoWiFi(54 + offset - 15, 5, false);
   
-  display.setTextSize(1);
-  display.setCursor(20, 52);
-  display.println("Reiniciando...");
+  lienzo.setTextSize(2);
+  lienzo.setCursor(10, 30);
+  lienzo.println("CONECTANDO");
   
-  display.display();
+  // Barra de progreso
+  int progreso = (paso * 12);
+  lienzo.drawRect(14, 50, 100, 8, OLED_BLANCO);
+  lienzo.fillRect(16, 52, progreso, 4, OLED_BLANCO);
   
-  // Parpadeo rápido LED rojo de error
-  for(int i = 0; i < 6; i++) {
-    digitalWrite(LED_ROJO, HIGH);
-    tone(BUZZER, 400 - (i * 30), 150);
-    delay(200);
-    digitalWrite(LED_ROJO, LOW);
-    delay(200);
-  }
-}
-
-// ==================== FUNCIONES DE DIBUJO ====================
-
-void dibujarIconoWiFi(int x, int y, bool conectado) {
-  if(conectado) {
-    display.fillCircle(x + 10, y + 7, 1, SSD1306_WHITE);
-    display.drawCircle(x + 10, y + 7, 3, SSD1306_WHITE);
-    display.drawCircle(x + 10, y + 7, 5, SSD1306_WHITE);
-    display.drawCircle(x + 10, y + 7, 7, SSD1306_WHITE);
-    display.fillRect(x + 10, y + 7, 1, 1, SSD1306_BLACK);
-  } else {
-    display.drawCircle(x + 10, y + 7, 3, SSD1306_WHITE);
-    display.drawCircle(x + 10, y + 7, 5, SSD1306_WHITE);
-    display.drawLine(x + 4, y + 1, x + 16, y + 13, SSD1306_WHITE);
-  }
+  volcarPantalla();
 }
 
-void dibujarIconoRFID(int x, int y) {
-  display.drawRect(x, y, 20, 7, SSD1306_WHITE);
-  display.fillRect(x + 2, y + 2, 3, 3, SSD1306_WHITE);
-  display.drawLine(x + 8, y + 2, x + 10, y + 2, SSD1306_WHITE);
-  display.drawLine(x + 8, y + 4, x + 12, y + 4, SSD1306_WHITE);
-  display.drawCircle(x + 15, y + 3, 2, SSD1306_WHITE);
-}
-
-void dibujarCheck(int x, int y) {
-  // Check mark grande
-  display.drawLine(x, y + 15, x + 10, y + 25, SSD1306_WHITE);
-  display.drawLine(x + 1, y + 15, x + 11, y + 25, SSD1306_WHITE);
-  display.drawLine(x + 2, y + 15, x + 12, y + 25, SSD1306_WHITE);
+void pantallaWiFiConectado(uint8_t paso) {
+  lienzo.clearDisplay();
+  
+  // Check grande
+  dibujarCheck(44, 5);
   
-  display.drawLine(x + 10, y + 25, x + 35, y, SSD1306_WHITE);
-  display.drawLine(x + 11, y + 25, x + 36, y, SSD1306_WHITE);
-  display.drawLine(x + 12, y + 25, x + 37, y, SSD1306_WHITE);
+  lienzo.setTextSize(2);
+  lienzo.setCursor(25, 32);
+  lienzo.println("CONECTADO");
+  
+  lienzo.setTextSize(1);
+  lienzo.setCursor((128 - (strlen(ipLocal) * 6)) / 2, 52);
+  lienzo.print(ipLocal);
+  
+  volcarPantalla();
 }
 
-void dibujarX(int x, int y) {
+void pantallaSinConexion(uint8_t paso) {
+  lienzo.clearDisplay();
+  
   // X grande
-  display.drawLine(x, y, x + 35, y + 25, SSD1306_WHITE);
-  display.drawLine(x + 1, y, x + 36, y + 25, SSD1306_WHITE);
-  display.drawLine(x + 2, y, x + 37, y + 25, SSD1306_WHITE);
+  dibujarX(44, 5);
+  
+  lienzo.setTextSize(2);
+  lienzo.setCursor(5, 32);
+  lienzo.println("SIN CONEXION");
   
-  display.drawLine(x + 35, y, x, y + 25, SSD1306_WHITE);
-  display.drawLine(x + 36, y, x + 1, y + 25, SSD1306_WHITE);
-  display.drawLine(x + 37, y, x + 2, y + 25, SSD1306_WHITE);
+  lienzo.setTextSize(1);
+  lienzo.setCursor(20, 52);
+  lienzo.println("Reintentando...");
+  
+  volcarPantalla();
 }
 
-void animacionCargando(int ciclos) {
-  for(int c = 0; c < ciclos; c++) {
-    for(int i = 0; i < 8; i++) {
-      int x = 44 + (i * 5);
-      if(i <= c * 3) {
-        display.fillRect(x, 50, 3, 8, SSD1306_WHITE);
-      }
-    }
-    display.display();
-    delay(150);
-  }
-}
+// ==================== ANIMACIONES (LINEAS DE TIEMPO) ====================
 
-// ==================== FUNCIONES SONIDO MEJORADAS ====================
+// Detección: doble destello con pitido y barras de lectura
+const Fotograma fotogramasLeyendo[] = {
+  {  0, HIGH, HIGH, 2500, 60, pantallaLeyendo, 0},
+  { 80, LOW,  LOW,  0,    0,  nullptr,         0},
+  {120, HIGH, HIGH, 2500, 60, nullptr,         0},
+  {200, LOW,  LOW,  0,    0,  pantallaLeyendo, 1},
+  {280, HIGH, SIN_CAMBIO, 0, 0, pantallaLeyendo, 2},
+  {360, LOW,  SIN_CAMBIO, 0, 0, nullptr,       0},
+};
 
-void sonidoAceptacion() {
-  // Melodía de éxito (tres tonos ascendentes armoniosos)
-  int melodia[] = {1047, 1319, 1568}; // Do, Mi, Sol
-  for(int i = 0; i < 3; i++) {
-    tone(BUZZER, melodia[i], 150);
-    delay(180);
-  }
-  noTone(BUZZER);
-}
+// Espera de la red: LEDs alternados y "tic-tac", se repite hasta el resultado
+const Fotograma fotogramasProcesando[] = {
+  {  0, HIGH, LOW,  1500, 60, pantallaProcesando, 0},
+  {200, LOW,  HIGH, 1600, 60, pantallaProcesando, 1},
+  {400, HIGH, LOW,  1700, 60, pantallaProcesando, 2},
+  {600, LOW,  HIGH, 1800, 60, pantallaProcesando, 3},
+};
 
-void sonidoDenegado() {
-  // Sonido de error (dos tonos descendentes)
-  tone(BUZZER, 800, 250);
-  delay(300);
-  tone(BUZZER, 400, 400);
-  delay(450);
-  noTone(BUZZER);
-}
+// Éxito: LED verde fijo y acorde Do-Mi-Sol
+const Fotograma fotogramasPermitido[] = {
+  {  0, HIGH, LOW,        1047, 120, pantallaPermitido, 0},
+  {150, SIN_CAMBIO, SIN_CAMBIO, 1319, 120, nullptr,   0},
+  {300, SIN_CAMBIO, SIN_CAMBIO, 1568, 150, nullptr,   0},
+  {600, LOW,  SIN_CAMBIO, 0,    0,   nullptr,           0},
+};
 
-void sonidoError() {
-  // Sonido de alerta (pulsante)
-  for(int i = 0; i < 3; i++) {
-    tone(BUZZER, 300, 200);
-    delay(250);
-  }
-  noTone(BUZZER);
-}
+// Denegado: borde y LED rojo parpadeando con dos tonos graves
+const Fotograma fotogramasDenegado[] = {
+  {  0, LOW,  HIGH, 800, 200, pantallaDenegado, 1},
+  {150, SIN_CAMBIO, LOW,  0,   0,   pantallaDenegado, 0},
+  {250, SIN_CAMBIO, HIGH, 400, 300, pantallaDenegado, 1},
+  {400, SIN_CAMBIO, LOW,  0,   0,   pantallaDenegado, 0},
+  {500, SIN_CAMBIO, HIGH, 0,   0,   pantallaDenegado, 1},
+  {750, SIN_CAMBIO, LOW,  0,   0,   nullptr,          0},
+};
 
-void sonidoConexionWiFi() {
-  // Melodía de conexión exitosa
-  tone(BUZZER, 1000, 100);
-  delay(120);
-  tone(BUZZER, 1500, 100);
-  delay(120);
-  tone(BUZZER, 2000, 200);
-  delay(220);
-  noTone(BUZZER);
+// Error de fichaje: alternancia rápida y alarma pulsante
+const Fotograma fotogramasErrorFichaje[] = {
+  {  0, LOW,  HIGH, 300, 150, pantallaErrorFichaje, 0},
+  {120, HIGH, LOW,  0,   0,   nullptr, 0},
+  {240, LOW,  HIGH, 300, 150, nullptr, 0},
+  {360, HIGH, LOW,  0,   0,   nullptr, 0},
+  {480, LOW,  HIGH, 300, 150, nullptr, 0},
+  {850, LOW,  LOW,  0,   0,   nullptr, 0},
+};
+
+// Repetición dentro de la ventana antirrebote: un destello y un tono corto
+const Fotograma fotogramasYaRegistrado[] = {
+  {  0, HIGH, LOW,        1568, 80, pantallaYaRegistrado, 0},
+  {300, LOW,  SIN_CAMBIO, 0,    0,  nullptr,              0},
+};
+
+// Arranque: icono WiFi recorriendo la pantalla y barra de progreso, se
+// repite hasta que hay IP
+const Fotograma fotogramasConectando[] = {
+  {   0, HIGH, LOW,  2000, 50, pantallaConectando, 0},
+  { 200, LOW,  HIGH, 2050, 50, pantallaConectando, 1},
+  { 400, HIGH, LOW,  2100, 50, pantallaConectando, 2},
+  { 600, LOW,  HIGH, 2150, 50, pantallaConectando, 3},
+  { 800, HIGH, LOW,  2200, 50, pantallaConectando, 4},
+  {1000, LOW,  HIGH, 2250, 50, pantallaConectando, 5},
+  {1200, HIGH, LOW,  2300, 50, pantallaConectando, 6},
+  {1400, LOW,  HIGH, 2350, 50, pantallaConectando, 7},
+  {1600, HIGH, LOW,  2400, 50, pantallaConectando, 8},
+  {1800, LOW,  HIGH, 2450, 50, pantallaConectando, 9},
+};
+
+// Conectado: cuatro destellos verdes, melodía ascendente y verde fijo 1 s
+const Fotograma fotogramasWiFiConectado[] = {
+  {   0, HIGH, LOW,        0,    0,   pantallaWiFiConectado, 0},
+  { 150, LOW,  SIN_CAMBIO, 0,    0,   nullptr, 0},
+  { 300, HIGH, SIN_CAMBIO, 0,    0,   nullptr, 0},
+  { 450, LOW,  SIN_CAMBIO, 0,    0,   nullptr, 0},
+  { 600, HIGH, SIN_CAMBIO, 0,    0,   nullptr, 0},
+  { 750, LOW,  SIN_CAMBIO, 0,    0,   nullptr, 0},
+  { 900, HIGH, SIN_CAMBIO, 0,    0,   nullptr, 0},
+  {1050, LOW,  SIN_CAMBIO, 0,    0,   nullptr, 0},
+  {1200, SIN_CAMBIO, SIN_CAMBIO, 1000, 100, nullptr, 0},
+  {1320, SIN_CAMBIO, SIN_CAMBIO, 1500, 100, nullptr, 0},
+  {1440, SIN_CAMBIO, SIN_CAMBIO, 2000, 200, nullptr, 0},
+  {1660, HIGH, SIN_CAMBIO, 0,    0,   nullptr, 0},
+  {2660, LOW,  SIN_CAMBIO, 0,    0,   nullptr, 0},
+};
+
+// Sin red al acabar la espera del arranque: LED rojo y tonos descendentes
+const Fotograma fotogramasSinConexion[] = {
+  {   0, LOW, HIGH, 400, 150, pantallaSinConexion, 0},
+  { 200, SIN_CAMBIO, LOW,  0,   0,   nullptr, 0},
+  { 400, SIN_CAMBIO, HIGH, 370, 150, nullptr, 0},
+  { 600, SIN_CAMBIO, LOW,  0,   0,   nullptr, 0},
+  { 800, SIN_CAMBIO, HIGH, 340, 150, nullptr, 0},
+  {1000, SIN_CAMBIO, LOW,  0,   0,   nullptr, 0},
+  {1200, SIN_CAMBIO, HIGH, 310, 150, nullptr, 0},
+  {1400, SIN_CAMBIO, LOW,  0,   0,   nullptr, 0},
+  {1600, SIN_CAMBIO, HIGH, 280, 150, nullptr, 0},
+  {1800, SIN_CAMBIO, LOW,  0,   0,   nullptr, 0},
+  {2000, SIN_CAMBIO, HIGH, 250, 150, nullptr, 0},
+  {2200, SIN_CAMBIO, LOW,  0,   0,   nullptr, 0},
+};
+
+// Latidos de reposo
+const Fotograma fotogramasLatidoLed[] = {
+  { 0, HIGH, SIN_CAMBIO, 0, 0, nullptr, 0},
+  {50, LOW,  SIN_CAMBIO, 0, 0, nullptr, 0},
+};
+
+const Fotograma fotogramasLatidoSonido[] = {
+  { 0, SIN_CAMBIO, SIN_CAMBIO, 3000, 30, nullptr, 0},
+};
+
+#define FOTOGRAMAS(f) f, sizeof(f) / sizeof(f[0])
+
+const LineaTiempo lineaLeyendo        = {FOTOGRAMAS(fotogramasLeyendo),      400, 0,   false, false};
+const LineaTiempo lineaProcesando     = {FOTOGRAMAS(fotogramasProcesando),   800, 0,   true,  false};
+const LineaTiempo lineaPermitido      = {FOTOGRAMAS(fotogramasPermitido),    650, 300, false, true};
+const LineaTiempo lineaDenegado       = {FOTOGRAMAS(fotogramasDenegado),     800, 300, false, true};
+const LineaTiempo lineaErrorFichaje   = {FOTOGRAMAS(fotogramasErrorFichaje), 900, 300, false, true};
+const LineaTiempo lineaYaRegistrado   = {FOTOGRAMAS(fotogramasYaRegistrado), 600, 300, false, true};
+const LineaTiempo lineaConectando     = {FOTOGRAMAS(fotogramasConectando),   2000, 0, true,  false};
+const LineaTiempo lineaWiFiConectado  = {FOTOGRAMAS(fotogramasWiFiConectado), 2700, 0, false, false};
+const LineaTiempo lineaSinConexion    = {FOTOGRAMAS(fotogramasSinConexion),  2400, 0, false, false};
+const LineaTiempo lineaLatidoLed      = {FOTOGRAMAS(fotogramasLatidoLed),    50,  0,   false, false};
+const LineaTiempo lineaLatidoSonido   = {FOTOGRAMAS(fotogramasLatidoSonido), 50,  0,   false, false};
+
+void mostrarLeyendoTarjeta(uint8_t lector) { iniciarAnimacion(&lineaLeyendo, lector); }
+void mostrarProcesando() { iniciarAnimacion(&lineaProcesando); }
+void mostrarAccesoPermitido(uint8_t lector) { iniciarAnimacion(&lineaPermitido, lector); }
+void mostrarAccesoDenegado(uint8_t lector) { iniciarAnimacion(&lineaDenegado, lector); }
+void mostrarErrorFichaje(uint8_t lector) { iniciarAnimacion(&lineaErrorFichaje, lector); }
+void mostrarYaRegistrado(uint8_t lector) { iniciarAnimacion(&lineaYaRegistrado, lector); }
+void mostrarConectandoWiFi() { iniciarAnimacion(&lineaConectando); }
+void mostrarWiFiConectado() { iniciarAnimacion(&lineaWiFiConectado); }
+void mostrarErrorWiFi() { iniciarAnimacion(&lineaSinConexion); }
+void parpadeoActivo() { iniciarAnimacion(&lineaLatidoLed); }
+void sonidoEsperaRFID() { iniciarAnimacion(&lineaLatidoSonido); }
+
+void registrarCiclo() {
+  // Detección de la tarjeta hasta que el lector queda libre de su feedback
+  if (cicloDesdeMs == 0) return;
+  unsigned long ciclo = halMillis() - cicloDesdeMs;
+  cicloDesdeMs = 0;
+  ciclosMedidos++;
+  ciclosSumaMs += ciclo;
+  if (ciclo > cicloMaximoMs) cicloMaximoMs = ciclo;
+  anotarLatencia(ETAPA_CICLO, ciclo * 1000);
+  
+  Serial.print("Ciclo tarjeta: ");
+  Serial.print(ciclo);
+  Serial.print(" ms (media ");
+  Serial.print(ciclosSumaMs / ciclosMedidos);
+  Serial.print(" ms, max ");
+  Serial.print(cicloMaximoMs);
+  Serial.println(" ms)");
 }
 
-void sonidoEsperaRFID() {
-  // Sonido muy sutil de "estoy activo"
-  tone(BUZZER, 3000, 30);
-  delay(50);
-  noTone(BUZZER);
+void arrancarAnimacion(const LineaTiempo* linea, uint8_t canal) {
+  if (animacionActual != nullptr && animacionActual->esResultado) registrarCiclo();
+  if (linea->esResultado) cicloDesdeMs = cicloPendienteMs;
+  
+  // Se apagan los LEDs del lector anterior; pantalla y zumbador son comunes
+  halLed(pinesLedVerde[canalAnimacion], LOW);
+  halLed(pinesLedRojo[canalAnimacion], LOW);
+  halSilencio();
+  
+  canalAnimacion = canal < NUM_LECTORES ? canal : 0;
+  animacionActual = linea;
+  inicioAnimacion = halMillis();
+  siguienteFotograma = 0;
+  animacionActiva = true;
+  avanzarAnimacion();
 }
 
-// ==================== FUNCIONES TELEGRAM ====================
+void iniciarAnimacion(const LineaTiempo* linea, uint8_t canal) {
+  // Si la animación actual aún no cumplió su mínimo, la nueva espera su turno
+  if (animacionActual != nullptr && halMillis() - inicioAnimacion < animacionActual->minimo) {
+    animacionSiguiente = linea;
+    canalSiguiente = canal;
+    return;
+  }
+  animacionSiguiente = nullptr;
+  arrancarAnimacion(linea, canal);
+}
 
-bool notificarTelegram(String uid, String tipo, String nombreEmpleado) {
-  HTTPClient http;
-  String url = "http://" + String(serverIP) + ":" + String(serverPort) + "/api/telegramnotifications/fichaje-invalido";
+void avanzarAnimacion() {
+  if (animacionActual == nullptr) return;
+  unsigned long t = halMillis() - inicioAnimacion;
   
-  Serial.println("ENVIANDO NOTIFICACION TELEGRAM DIRECTA");
+  if (animacionSiguiente != nullptr && t >= animacionActual->minimo) {
+    const LineaTiempo* siguiente = animacionSiguiente;
+    animacionSiguiente = nullptr;
+    arrancarAnimacion(siguiente, canalSiguiente);
+    return;
+  }
+  
+  while (siguienteFotograma < animacionActual->cantidad &&
+         animacionActual->fotogramas[siguienteFotograma].t <= t) {
+    const Fotograma& f = animacionActual->fotogramas[siguienteFotograma++];
+    if (f.ledVerde != SIN_CAMBIO) halLed(pinesLedVerde[canalAnimacion], f.ledVerde);
+    if (f.ledRojo != SIN_CAMBIO) halLed(pinesLedRojo[canalAnimacion], f.ledRojo);
+    if (f.frecuencia > 0) halTono(f.frecuencia, f.duracionTono);
+    if (f.pantalla != nullptr) f.pantalla(f.paso);
+  }
+  
+  if (t >= animacionActual->duracion) {
+    if (animacionActual->repetir) {
+      inicioAnimacion += animacionActual->duracion;
+      siguienteFotograma = 0;
+    } else {
+      terminarAnimacion();
+    }
+  }
+}
+
+void terminarAnimacion() {
+  bool conPantalla = false;
+  for (uint8_t i = 0; i < animacionActual->cantidad; i++) {
+    if (animacionActual->fotogramas[i].pantalla != nullptr) conPantalla = true;
+  }
+  if (animacionActual->esResultado) registrarCiclo();
+  
+  halLed(pinesLedVerde[canalAnimacion], LOW);
+  halLed(pinesLedRojo[canalAnimacion], LOW);
+  animacionActual = nullptr;
+  animacionActiva = false;
+  
+  // Volver al reloj si la animación había tomado la pantalla
+  if (conPantalla) {
+    mostrarPantallaReloj();
+    ultimaActualizacion = halMillis();
+  }
+}
+
+// ==================== SPRITES ====================
+
+// Mapa de bits en el formato de páginas del SSD1306 (cada byte son 8 filas de
+// una columna). Los métodos son constexpr para rasterizar en compilación con
+// los mismos algoritmos que Adafruit_GFX, así que el resultado es idéntico
+template<int W, int H>
+struct Sprite {
+  static constexpr int ancho = W;
+  static constexpr int alto = H;
+  static constexpr int paginas = (H + 7) / 8;
+  uint8_t datos[paginas][W];
+  
+  constexpr Sprite() : datos() {}
+  
+  constexpr void pixel(int x, int y, bool encendido = true) {
+    if (x < 0 || y < 0 || x >= W || y >= H) return;
+    if (encendido) {
+      datos[y / 8][x] |= (1 << (y & 7));
+    } else {
+      datos[y / 8][x] &= ~(1 << (y & 7));
+    }
+  }
+  
+  constexpr void lineaV(int x, int y, int h) {
+    for (int i = 0; i < h; i++) pixel(x, y + i);
+  }
+  
+  constexpr void rect(int x, int y, int w, int h) {
+    for (int i = 0; i < w; i++) {
+      pixel(x + i, y);
+      pixel(x + i, y + h - 1);
+    }
+    for (int i = 0; i < h; i++) {
+      pixel(x, y + i);
+      pixel(x + w - 1, y + i);
+    }
+  }
+  
+  constexpr void rectRelleno(int x, int y, int w, int h, bool encendido = true) {
+    for (int i = 0; i < w; i++) {
+      for (int j = 0; j < h; j++) pixel(x + i, y + j, encendido);
+    }
+  }
   
-  http.begin(url);
-  http.addHeader("Content-Type", "application/json");
-  http.addHeader("User-Agent", "ESP32-RFID-Reader");
-  http.setTimeout(15000);
+  constexpr void linea(int x0, int y0, int x1, int y1) {
+    // Bresenham como Adafruit_GFX::writeLine
+    bool empinada = (y1 > y0 ? y1 - y0 : y0 - y1) > (x1 > x0 ? x1 - x0 : x0 - x1);
+    if (empinada) {
+      int t = x0; x0 = y0; y0 = t;
+      t = x1; x1 = y1; y1 = t;
+    }
+    if (x0 > x1) {
+      int t = x0; x0 = x1; x1 = t;
+      t = y0; y0 = y1; y1 = t;
+    }
+    int dx = x1 - x0;
+    int dy = y1 > y0 ? y1 - y0 : y0 - y1;
+    int error = dx / 2;
+    int paso = y0 < y1 ? 1 : -1;
+    for (; x0 <= x1; x0++) {
+      if (empinada) {
+        pixel(y0, x0);
+      } else {
+        pixel(x0, y0);
+      }
+      error -= dy;
+      if (error < 0) {
+        y0 += paso;
+        error += dx;
+      }
+    }
+  }
   
-  String ipReal = WiFi.localIP().toString();
-  String json = "";
+  constexpr void circulo(int x0, int y0, int r) {
+    // Punto medio como Adafruit_GFX::drawCircle
+    int f = 1 - r, ddx = 1, ddy = -2 * r, x = 0, y = r;
+    pixel(x0, y0 + r);
+    pixel(x0, y0 - r);
+    pixel(x0 + r, y0);
+    pixel(x0 - r, y0);
+    while (x < y) {
+      if (f >= 0) {
+        y--;
+        ddy += 2;
+        f += ddy;
+      }
+      x++;
+      ddx += 2;
+      f += ddx;
+      pixel(x0 + x, y0 + y);
+      pixel(x0 - x, y0 + y);
+      pixel(x0 + x, y0 - y);
+      pixel(x0 - x, y0 - y);
+      pixel(x0 + y, y0 + x);
+      pixel(x0 - y, y0 + x);
+      pixel(x0 + y, y0 - x);
+      pixel(x0 - y, y0 - x);
+    }
+  }
   
-  if (nombreEmpleado != "") {
-    json = "{\"codigoRFID\":\"" + uid + "\",\"ip\":\"" + ipReal + "\",\"tipo\":\"" + tipo + "\",\"nombreEmpleado\":\"" + nombreEmpleado + "\"}";
+  constexpr void circuloRelleno(int x0, int y0, int r) {
+    // Como Adafruit_GFX::fillCircle / fillCircleHelper
+    lineaV(x0, y0 - r, 2 * r + 1);
+    int f = 1 - r, ddx = 1, ddy = -2 * r, x = 0, y = r, px = x, py = y;
+    while (x < y) {
+      if (f >= 0) {
+        y--;
+        ddy += 2;
+        f += ddy;
+      }
+      x++;
+      ddx += 2;
+      f += ddx;
+      if (x < (y + 1)) {
+        lineaV(x0 + x, y0 - y, 2 * y + 1);
+        lineaV(x0 - x, y0 - y, 2 * y + 1);
+      }
+      if (y != py) {
+        lineaV(x0 + py, y0 - px, 2 * px + 1);
+        lineaV(x0 - py, y0 - px, 2 * px + 1);
+        py = y;
+      }
+      px = x;
+    }
+  }
+};
+
+// Trazos de cada icono, escritos una vez para cualquier superficie con
+// pixel/linea/circulo/rect: un Sprite en compilación o la pantalla al medir
+template<class P>
+constexpr void trazarIconoWiFi(P& p, bool conectado) {
+  if (conectado) {
+    p.circuloRelleno(10, 7, 1);
+    p.circulo(10, 7, 3);
+    p.circulo(10, 7, 5);
+    p.circulo(10, 7, 7);
+    p.rectRelleno(10, 7, 1, 1, false);
   } else {
-    json = "{\"codigoRFID\":\"" + uid + "\",\"ip\":\"" + ipReal + "\",\"tipo\":\"" + tipo + "\"}";
+    p.circulo(10, 7, 3);
+    p.circulo(10, 7, 5);
+    p.linea(4, 1, 16, 13);
   }
+}
+
+template<class P>
+constexpr void trazarIconoRFID(P& p) {
+  p.rect(0, 0, 20, 7);
+  p.rectRelleno(2, 2, 3, 3);
+  p.linea(8, 2, 10, 2);
+  p.linea(8, 4, 12, 4);
+  p.circulo(15, 3, 2);
+}
+
+template<class P>
+constexpr void trazarCheck(P& p) {
+  // Check mark grande
+  p.linea(0, 15, 10, 25);
+  p.linea(1, 15, 11, 25);
+  p.linea(2, 15, 12, 25);
   
-  int httpCode = http.POST(json);
-  http.end();
-  return (httpCode == 200);
+  p.linea(10, 25, 35, 0);
+  p.linea(11, 25, 36, 0);
+  p.linea(12, 25, 37, 0);
 }
 
-bool testConexionTelegram() {
-  HTTPClient http;
-  String url = "http://" + String(serverIP) + ":" + String(serverPort) + "/api/telegramnotifications/test";
+template<class P>
+constexpr void trazarX(P& p) {
+  // X grande
+  p.linea(0, 0, 35, 25);
+  p.linea(1, 0, 36, 25);
+  p.linea(2, 0, 37, 25);
+  
+  p.linea(35, 0, 0, 25);
+  p.linea(36, 0, 1, 25);
+  p.linea(37, 0, 2, 25);
+}
+
+template<class S, class F>
+constexpr S rasterizar(F trazar) {
+  S sprite;
+  trazar(sprite);
+  return sprite;
+}
+
+typedef Sprite<18, 15> SpriteWiFi;
+typedef Sprite<20, 7> SpriteRFID;
+typedef Sprite<38, 26> SpriteGrande;
+
+constexpr SpriteWiFi spriteWiFiConectado = rasterizar<SpriteWiFi>([](SpriteWiFi& s) { trazarIconoWiFi(s, true); });
+constexpr SpriteWiFi spriteWiFiDesconectado = rasterizar<SpriteWiFi>([](SpriteWiFi& s) { trazarIconoWiFi(s, false); });
+constexpr SpriteRFID spriteRFID = rasterizar<SpriteRFID>([](SpriteRFID& s) { trazarIconoRFID(s); });
+constexpr SpriteGrande spriteCheck = rasterizar<SpriteGrande>([](SpriteGrande& s) { trazarCheck(s); });
+constexpr SpriteGrande spriteX = rasterizar<SpriteGrande>([](SpriteGrande& s) { trazarX(s); });
+
+// Columnas de la fuente 5x7 de Adafruit_GFX para "0".."9" y ":"
+constexpr uint8_t FUENTE_RELOJ[11][5] = {
+  {0x3E, 0x51, 0x49, 0x45, 0x3E}, {0x00, 0x42, 0x7F, 0x40, 0x00},
+  {0x72, 0x49, 0x49, 0x49, 0x46}, {0x21, 0x41, 0x49, 0x4D, 0x33},
+  {0x18, 0x14, 0x12, 0x7F, 0x10}, {0x27, 0x45, 0x45, 0x45, 0x39},
+  {0x3C, 0x4A, 0x49, 0x49, 0x31}, {0x41, 0x21, 0x11, 0x09, 0x07},
+  {0x36, 0x49, 0x49, 0x49, 0x36}, {0x46, 0x49, 0x49, 0x29, 0x1E},
+  {0x00, 0x00, 0x14, 0x00, 0x00}
+};
+
+#define ESCALA_RELOJ 3
+#define AVANCE_RELOJ (6 * ESCALA_RELOJ)
+typedef Sprite<5 * ESCALA_RELOJ, 7 * ESCALA_RELOJ> SpriteDigito;
+
+// Dígitos del reloj ya escalados x3, como setTextSize(3)
+struct GlifosReloj {
+  SpriteDigito glifos[11];
+  constexpr GlifosReloj() : glifos() {
+    for (int g = 0; g < 11; g++) {
+      for (int columna = 0; columna < 5; columna++) {
+        for (int fila = 0; fila < 7; fila++) {
+          if ((FUENTE_RELOJ[g][columna] >> fila) & 1) {
+            glifos[g].rectRelleno(columna * ESCALA_RELOJ, fila * ESCALA_RELOJ, ESCALA_RELOJ, ESCALA_RELOJ);
+          }
+        }
+      }
+    }
+  }
+};
+
+constexpr GlifosReloj GLIFOS_RELOJ;
+
+// Copia un sprite al framebuffer con OR; y puede no estar alineado a página
+template<class S>
+void dibujarSprite(const S& sprite, int x, int y) {
+  uint8_t* buffer = lienzo.getBuffer();
+  int desplazamiento = y & 7;
+  int paginaBase = (y - desplazamiento) / 8;
+  for (int p = 0; p < S::paginas; p++) {
+    int pagina = paginaBase + p;
+    for (int c = 0; c < S::ancho; c++) {
+      int columna = x + c;
+      if (columna < 0 || columna >= SCREEN_WIDTH) continue;
+      uint8_t bits = sprite.datos[p][c];
+      if (pagina >= 0 && pagina < OLED_PAGINAS) {
+        buffer[pagina * SCREEN_WIDTH + columna] |= bits << desplazamiento;
+      }
+      if (desplazamiento != 0 && pagina + 1 >= 0 && pagina + 1 < OLED_PAGINAS) {
+        buffer[(pagina + 1) * SCREEN_WIDTH + columna] |= bits >> (8 - desplazamiento);
+      }
+    }
+  }
+}
+
+// ==================== FUNCIONES DE DIBUJO ====================
+
+// Dibuja en la pantalla con las primitivas de Adafruit_GFX; solo para medir
+// el coste que tenían los iconos antes de precalcularlos
+struct PincelGFX {
+  int ox;
+  int oy;
+  void pixel(int x, int y, bool encendido = true) { lienzo.drawPixel(ox + x, oy + y, encendido ? OLED_BLANCO : OLED_NEGRO); }
+  void rect(int x, int y, int w, int h) { lienzo.drawRect(ox + x, oy + y, w, h, OLED_BLANCO); }
+  void rectRelleno(int x, int y, int w, int h, bool encendido = true) { lienzo.fillRect(ox + x, oy + y, w, h, encendido ? OLED_BLANCO : OLED_NEGRO); }
+  void linea(int x0, int y0, int x1, int y1) { lienzo.drawLine(ox + x0, oy + y0, ox + x1, oy + y1, OLED_BLANCO); }
+  void circulo(int x0, int y0, int r) { lienzo.drawCircle(ox + x0, oy + y0, r, OLED_BLANCO); }
+  void circuloRelleno(int x0, int y0, int r) { lienzo.fillCircle(ox + x0, oy + y0, r, OLED_BLANCO); }
+};
+
+
+void LienzoOLED::drawPixel(int16_t x, int16_t y, uint16_t color) {
+  if (x < 0 || x >= SCREEN_WIDTH || y < 0 || y >= SCREEN_HEIGHT) return;
+  uint8_t mascara = 1 << (y & 7);
+  uint8_t& b = _buffer[(y / 8) * SCREEN_WIDTH + x];
+  if (color) b |= mascara; else b &= ~mascara;
+}
+
+void LienzoOLED::drawFastHLine(int16_t x, int16_t y, int16_t w, uint16_t color) {
+  if (y < 0 || y >= SCREEN_HEIGHT) return;
+  if (x < 0) { w += x; x = 0; }
+  if (x + w > SCREEN_WIDTH) w = SCREEN_WIDTH - x;
+  uint8_t mascara = 1 << (y & 7);
+  uint8_t* p = _buffer + (y / 8) * SCREEN_WIDTH + x;
+  for (int16_t i = 0; i < w; i++) {
+    if (color) p[i] |= mascara; else p[i] &= ~mascara;
+  }
+}
+
+void LienzoOLED::drawFastVLine(int16_t x, int16_t y, int16_t h, uint16_t color) {
+  if (x < 0 || x >= SCREEN_WIDTH) return;
+  if (y < 0) { h += y; y = 0; }
+  if (y + h > SCREEN_HEIGHT) h = SCREEN_HEIGHT - y;
+  // Un byte por página en lugar de un bit por píxel
+  while (h > 0) {
+    int16_t filas = min<int16_t>(8 - (y & 7), h);
+    uint8_t mascara = ((1 << filas) - 1) << (y & 7);
+    uint8_t& b = _buffer[(y / 8) * SCREEN_WIDTH + x];
+    if (color) b |= mascara; else b &= ~mascara;
+    y += filas;
+    h -= filas;
+  }
+}
+
+void LienzoOLED::fillScreen(uint16_t color) {
+  memset(_buffer, color ? 0xFF : 0x00, sizeof(_buffer));
+}
+
+void dibujarIconoWiFi(int x, int y, bool conectado) {
+  if (MEDIR_PANTALLAS && dibujoPrimitivas) {
+    PincelGFX pincel = {x, y};
+    trazarIconoWiFi(pincel, conectado);
+    return;
+  }
+  dibujarSprite(conectado ? spriteWiFiConectado : spriteWiFiDesconectado, x, y);
+}
+
+void dibujarIconoRFID(int x, int y) {
+  if (MEDIR_PANTALLAS && dibujoPrimitivas) {
+    PincelGFX pincel = {x, y};
+    trazarIconoRFID(pincel);
+    return;
+  }
+  dibujarSprite(spriteRFID, x, y);
+}
+
+void dibujarCheck(int x, int y) {
+  if (MEDIR_PANTALLAS && dibujoPrimitivas) {
+    PincelGFX pincel = {x, y};
+    trazarCheck(pincel);
+    return;
+  }
+  dibujarSprite(spriteCheck, x, y);
+}
+
+void dibujarX(int x, int y) {
+  if (MEDIR_PANTALLAS && dibujoPrimitivas) {
+    PincelGFX pincel = {x, y};
+    trazarX(pincel);
+    return;
+  }
+  dibujarSprite(spriteX, x, y);
+}
+
+void dibujarLector() {
+  // La pantalla es común: con varios lectores el resultado dice de cuál es
+  if (NUM_LECTORES < 2) return;
+  lienzo.setTextSize(1);
+  lienzo.setCursor(9, 9);
+  lienzo.print("L");
+  lienzo.print(canalAnimacion);
+}
+
+void dibujarHora(const char* hora, int y) {
+  // Centrada con el mismo avance que la fuente a tamaño 3
+  int x = (SCREEN_WIDTH - (int)strlen(hora) * AVANCE_RELOJ) / 2;
+  if (MEDIR_PANTALLAS && dibujoPrimitivas) {
+    lienzo.setTextSize(ESCALA_RELOJ);
+    lienzo.setCursor(x, y);
+    lienzo.print(hora);
+    return;
+  }
+  for (const char* c = hora; *c != '\0'; c++, x += AVANCE_RELOJ) {
+    if (*c >= '0' && *c <= '9') {
+      dibujarSprite(GLIFOS_RELOJ.glifos[*c - '0'], x, y);
+    } else if (*c == ':') {
+      dibujarSprite(GLIFOS_RELOJ.glifos[10], x, y);
+    }
+  }
+}
+
+// Sustituye a display.display(): por cada página de 8 filas envía solo el
+// rango de columnas que difiere de la sombra
+void volcarPantalla() {
+  unsigned long inicio = halMicros();
+  const uint8_t* buffer = lienzo.getBuffer();
+  size_t enviados = 0;
+  bool correcto = true;
+  
+  for (uint8_t pagina = 0; pagina < OLED_PAGINAS; pagina++) {
+    const uint8_t* nueva = buffer + pagina * SCREEN_WIDTH;
+    uint8_t* sombra = sombraOLED + pagina * SCREEN_WIDTH;
+    int desde = 0;
+    int hasta = SCREEN_WIDTH - 1;
+    if (sombraValida) {
+      while (desde < SCREEN_WIDTH && nueva[desde] == sombra[desde]) desde++;
+      if (desde == SCREEN_WIDTH) continue;
+      while (nueva[hasta] == sombra[hasta]) hasta--;
+    }
+    
+    if (!halEnviarPantalla(pagina, desde, hasta, nueva + desde)) {
+      correcto = false;
+      break;
+    }
+    memcpy(sombra + desde, nueva + desde, hasta - desde + 1);
+    enviados += hasta - desde + 1;
+  }
+  
+  // Tras un fallo del bus no se sabe qué quedó en la pantalla: la próxima vez completa
+  sombraValida = correcto;
+  
+  ultimoVolcadoBytes = enviados;
+  ultimoVolcadoUs = halMicros() - inicio;
+  volcadosOLED++;
+  bytesOLED += enviados;
+  microsOLED += ultimoVolcadoUs;
+}
+
+// Cada pantalla de las animaciones mostrar* dibujada de las dos formas, con
+// el reloj real: en el build nativo halMicros() es virtual y no avanza
+struct PantallaMedida {
+  const char* nombre;
+  void (*dibujar)(uint8_t paso);
+};
+
+void pantallaRelojMedida(uint8_t paso) {
+  struct tm hora = {};
+  hora.tm_hour = 12;
+  hora.tm_min = 34;
+  hora.tm_mday = 5;
+  hora.tm_year = 126;
+  pantallaReloj(hora);
+}
+
+uint32_t medirPantalla(void (*dibujar)(uint8_t paso), int repeticiones) {
+  unsigned long inicio = halMicrosReales();
+  for (int i = 0; i < repeticiones; i++) dibujar(0);
+  return halMicrosReales() - inicio;
+}
+
+void medirPantallas() {
+  const int repeticiones = 200;
+  static const PantallaMedida pantallas[] = {
+    {"reloj", pantallaRelojMedida},
+    {"leyendo", pantallaLeyendo},
+    {"procesando", pantallaProcesando},
+    {"permitido", pantallaPermitido},
+    {"denegado", pantallaDenegado},
+    {"ya_registrado", pantallaYaRegistrado},
+    {"error", pantallaErrorFichaje},
+    {"conectando", pantallaConectando},
+    {"wifi_conectado", pantallaWiFiConectado},
+    {"sin_conexion", pantallaSinConexion},
+  };
+  static uint8_t primitivas[sizeof(sombraOLED)];
+  const int numPantallas = sizeof(pantallas) / sizeof(pantallas[0]);
+  int iguales = 0;
+  
+  Serial.println("Pantallas: primitivas us -> sprites us (dibujo + volcado incremental)");
+  for (const PantallaMedida& p : pantallas) {
+    dibujoPrimitivas = true;
+    uint32_t antes = medirPantalla(p.dibujar, repeticiones);
+    memcpy(primitivas, lienzo.getBuffer(), sizeof(primitivas));
+    dibujoPrimitivas = false;
+    uint32_t despues = medirPantalla(p.dibujar, repeticiones);
+    
+    Serial.print("pantalla ");
+    Serial.print(p.nombre);
+    Serial.print(": ");
+    Serial.print(antes / (float)repeticiones, 2);
+    Serial.print(" -> ");
+    Serial.println(despues / (float)repeticiones, 2);
+    // Los sprites se rasterizan con los mismos algoritmos: el resultado no puede cambiar
+    if (memcmp(primitivas, lienzo.getBuffer(), sizeof(primitivas)) == 0) {
+      iguales++;
+    } else {
+      Serial.print("AVISO: la pantalla ");
+      Serial.print(p.nombre);
+      Serial.println(" sale distinta con sprites");
+    }
+  }
+  Serial.print("Pantallas iguales con sprites: ");
+  Serial.print(iguales);
+  Serial.print("/");
+  Serial.println(numPantallas);
+  lienzo.clearDisplay();
+}
+
+// ==================== FUNCIONES TELEGRAM ====================
+
+bool notificarTelegram(const Uid& uid, uint8_t tipo, const char* nombreEmpleado) {
+  Serial.println("ENVIANDO NOTIFICACION TELEGRAM DIRECTA");
   
-  http.begin(url);
-  http.addHeader("Content-Type", "application/json");
-  http.addHeader("User-Agent", "ESP32-RFID-Reader");
-  http.setTimeout(10000);
+  if (formatoBinario) {
+    uint8_t carga[80];
+    size_t largo = msgpackNotificacion(carga, sizeof(carga), uid, tipo, nombreEmpleado);
+    int httpCode = postBinarioBackend(rutaNotificacion, carga, largo, NOTIF_TIMEOUT_MS);
+    if (largo > 0 && !rechazaBinario(httpCode)) return (httpCode == 200);
+  }
   
-  String ipReal = WiFi.localIP().toString();
-  String json = "{\"mensaje\":\"Test desde ESP32 físico\",\"ip\":\"" + ipReal + "\"}";
+  char uidHex[UID_HEX_MAX];
+  uid.aHex(uidHex);
+  char json[192];
+  size_t largo = jsonNotificacion(json, sizeof(json), uidHex, nombresNotificacion[tipo], nombreEmpleado);
+  if (largo == 0) return false;
   
-  int httpCode = http.POST(json);
-  http.end();
+  int httpCode = postJSONBackend(rutaNotificacion, json, largo, NOTIF_TIMEOUT_MS);
   return (httpCode == 200);
 }
 
-// ==================== FUNCIONES RFID ====================
+void encolarNotificacion(const Uid& uid, uint8_t tipo) {
+  unsigned long ahora = halMillis();
+  notifEncoladas++;
+  
+  // Mismo UID y tipo ya en cola: se acumula en el mismo evento
+  for (int i = 0; i < notificacionesEnCola; i++) {
+    Notificacion& n = colaNotificaciones[i];
+    if (n.tipo == tipo && n.uid == uid) {
+      if (n.cantidad < 0xFFFF) n.cantidad++;
+      notifFusionadas++;
+      return;
+    }
+  }
+  
+  // Ya avisado hace poco: no repetir
+  for (int i = 0; i < NOTIF_CAPACIDAD; i++) {
+    const Notificacion& n = notificacionesRecientes[i];
+    if (n.cantidad > 0 && n.tipo == tipo && n.uid == uid &&
+        ahora - n.primeraMs < NOTIF_VENTANA_DEDUP_MS) {
+      notifDeduplicadas++;
+      return;
+    }
+  }
+  
+  if (notificacionesEnCola >= NOTIF_CAPACIDAD) {
+    notifDescartadas++;
+    return;
+  }
+  
+  Notificacion& n = colaNotificaciones[notificacionesEnCola++];
+  n.uid = uid;
+  n.tipo = tipo;
+  n.cantidad = 1;
+  n.primeraMs = ahora;
+}
 
-String leerUID() {
-  String uid = "";
-  for (byte i = 0; i < mfrc522.uid.size; i++) {
-    uid += String(mfrc522.uid.uidByte[i] < 0x10 ? "0" : "");
-    uid += String(mfrc522.uid.uidByte[i], HEX);
+void retirarNotificaciones(int cantidad) {
+  // Lo enviado sale de la cola y entra en la ventana de deduplicación
+  unsigned long ahora = halMillis();
+  for (int i = 0; i < cantidad; i++) {
+    notificacionesRecientes[indiceRecientes] = colaNotificaciones[i];
+    notificacionesRecientes[indiceRecientes].primeraMs = ahora;
+    indiceRecientes = (indiceRecientes + 1) % NOTIF_CAPACIDAD;
   }
-  uid.toUpperCase();
-  return uid;
+  notificacionesEnCola -= cantidad;
+  memmove(&colaNotificaciones[0], &colaNotificaciones[cantidad], notificacionesEnCola * sizeof(Notificacion));
 }
 
-void procesarTarjeta(String uid) {
-  // Feedback visual y sonoro de detección más dramático
-  for(int i = 0; i < 2; i++) {
-    digitalWrite(LED_VERDE, HIGH);
-    digitalWrite(LED_ROJO, HIGH);
-    tone(BUZZER, 2500, 100);
-    delay(120);
-    digitalWrite(LED_VERDE, LOW);
-    digitalWrite(LED_ROJO, LOW);
-    delay(120);
+void enviarNotificaciones() {
+  // Cubeta de tokens: NOTIF_RAFAGA seguidos y luego uno cada NOTIF_INTERVALO_MS
+  unsigned long ahora = halMillis();
+  while (tokensNotificacion < NOTIF_RAFAGA && ahora - ultimaRecargaNotifMs >= NOTIF_INTERVALO_MS) {
+    tokensNotificacion++;
+    ultimaRecargaNotifMs += NOTIF_INTERVALO_MS;
   }
+  if (tokensNotificacion == NOTIF_RAFAGA) ultimaRecargaNotifMs = ahora;
   
-  bool tarjetaValida = verificarTarjeta(uid);
+  if (notificacionesEnCola == 0 || tokensNotificacion == 0) return;
+  if (ahora - colaNotificaciones[0].primeraMs < NOTIF_AGRUPAR_MS) return;
+  if (!halRedConectada()) return;
   
-  if (tarjetaValida) {
-    Serial.println("Tarjeta valida, registrando fichaje...");
-    mostrarProcesando();
-    
-    if (registrarFichaje(uid)) {
-      Serial.println("Fichaje registrado exitosamente!");
-      notificarTelegram(uid, "VALIDO", "Empleado Verificado");
-      
-      mostrarAccesoPermitido();
-      sonidoAceptacion();
-      
-      delay(1200);  // Reducido de 2000ms a 1200ms
-    } else {
-      Serial.println("Error al registrar fichaje");
-      notificarTelegram(uid, "ERROR", "");
-      
-      mostrarErrorFichaje();
-      sonidoError();
-      
-      delay(1500);  // Reducido de 2000ms a 1500ms
+  // Varios eventos (o uno repetido) van juntos en un resumen; si el backend
+  // no lo admite se avisa del más antiguo y el resto espera su token. Cada
+  // envío espera como mucho NOTIF_TIMEOUT_MS: una tarjeta que llegue mientras
+  // tanto no queda detrás de un Telegram lento, y lo no enviado se reintenta
+  // desde la cola con el siguiente token
+  tokensNotificacion--;
+  Cronometro envio;
+  envio.iniciar();
+  bool resumen = resumenDisponible && (notificacionesEnCola > 1 || colaNotificaciones[0].cantidad > 1);
+  bool enviado;
+  if (resumen) {
+    enviado = enviarResumen();
+    if (enviado) {
+      notifResumenes++;
+      retirarNotificaciones(notificacionesEnCola);
     }
   } else {
-    Serial.println("Tarjeta no valida o no registrada");
-    notificarTelegram(uid, "INVALIDO", "");
-    
-    mostrarAccesoDenegado();
-    sonidoDenegado();
-    enviarACaptura(uid);
+    const Notificacion& n = colaNotificaciones[0];
+    const char* nombre = (n.tipo == NOTIF_VALIDO) ? "Empleado Verificado" : nullptr;
+    enviado = notificarTelegram(n.uid, n.tipo, nombre);
+    if (enviado) retirarNotificaciones(1);
+  }
+  anotarLatencia(ETAPA_NOTIFICACION, envio.transcurridoUs());
+  
+  if (enviado) {
+    notifEnviadas++;
+  } else {
+    notifFallidas++;
+  }
+  
+  Serial.print("Notificaciones: ");
+  Serial.print(notificacionesEnCola);
+  Serial.print(" en cola, ");
+  Serial.print(notifEnviadas);
+  Serial.print(" enviadas (");
+  Serial.print(notifResumenes);
+  Serial.print(" resumenes), ");
+  Serial.print(notifFusionadas);
+  Serial.print(" fusionadas, ");
+  Serial.print(notifDeduplicadas);
+  Serial.print(" duplicadas, ");
+  Serial.print(notifDescartadas);
+  Serial.print(" descartadas, ");
+  Serial.print(notifFallidas);
+  Serial.println(" fallidas");
+}
+
+bool enviarResumen() {
+  // Un solo mensaje con todos los eventos acumulados en la cola
+  uint8_t carga[64 + NOTIF_CAPACIDAD * 80];
+  int httpCode = -1;
+  bool enviarJson = !formatoBinario;
+  
+  if (formatoBinario) {
+    // [ip, [[uid, tipo, cantidad], ...]]
+    EscritorMsgPack mp(carga, sizeof(carga));
+    mp.array(2);
+    mp.binario(ipLocalBytes, 4);
+    mp.array(notificacionesEnCola);
+    for (int i = 0; i < notificacionesEnCola; i++) {
+      const Notificacion& n = colaNotificaciones[i];
+      mp.array(3);
+      mp.binario(n.uid.bytes, n.uid.longitud);
+      mp.entero(n.tipo);
+      mp.entero(n.cantidad);
+    }
+    size_t largo = mp.terminar();
+    httpCode = postBinarioBackend(rutaResumen, carga, largo, NOTIF_TIMEOUT_MS);
+    enviarJson = (largo == 0 || rechazaBinario(httpCode));
+  }
+  
+  if (enviarJson) {
+    char* json = (char*)carga;
+    size_t largo = snprintf(json, sizeof(carga), "{\"ip\":\"%s\",\"eventos\":[", ipLocal);
+    for (int i = 0; i < notificacionesEnCola; i++) {
+      const Notificacion& n = colaNotificaciones[i];
+      char uidHex[UID_HEX_MAX];
+      n.uid.aHex(uidHex);
+      largo += snprintf(json + largo, sizeof(carga) - largo, "%s{\"codigoRFID\":\"%s\",\"tipo\":\"%s\",\"cantidad\":%u}",
+                        i > 0 ? "," : "", uidHex, nombresNotificacion[n.tipo], (unsigned)n.cantidad);
+      if (largo >= sizeof(carga)) return false;
+    }
+    largo += snprintf(json + largo, sizeof(carga) - largo, "]}");
+    if (largo >= sizeof(carga)) return false;
     
-    delay(1200);  // Reducido de 2000ms a 1200ms
+    httpCode = postJSONBackend(rutaResumen, json, largo, NOTIF_TIMEOUT_MS);
+  }
+  
+  if (httpCode == 404 || httpCode == 405) {
+    Serial.println("Backend sin resumen de notificaciones, se envian por separado");
+    resumenDisponible = false;
   }
+  return (httpCode == 200);
 }
 
-void enviarACaptura(String uid) {
-  HTTPClient http;
-  String url = "http://" + String(serverIP) + ":" + String(serverPort) + "/api/Rfid/capture/unknown";
+bool testConexionTelegram() {
+  const char* mensaje = "Test desde ESP32 físico";
+  
+  if (formatoBinario) {
+    // [ip, mensaje]
+    uint8_t carga[48];
+    EscritorMsgPack mp(carga, sizeof(carga));
+    mp.array(2);
+    mp.binario(ipLocalBytes, 4);
+    mp.texto(mensaje);
+    size_t largo = mp.terminar();
+    int httpCode = postBinarioBackend(rutaTestTelegram, carga, largo, NOTIF_TIMEOUT_MS);
+    if (largo > 0 && !rechazaBinario(httpCode)) return (httpCode == 200);
+  }
   
-  http.begin(url);
-  http.addHeader("Content-Type", "application/json");
-  http.addHeader("User-Agent", "ESP32-RFID-Reader");
-  http.setTimeout(8000);
+  char json[96];
+  size_t largo = snprintf(json, sizeof(json), "{\"mensaje\":\"%s\",\"ip\":\"%s\"}", mensaje, ipLocal);
   
-  String json = "{\"codigoRfid\":\"" + uid + "\"}";
-  http.POST(json);
-  http.end();
+  int httpCode = postJSONBackend(rutaTestTelegram, json, largo, NOTIF_TIMEOUT_MS);
+  return (httpCode == 200);
 }
 
-bool verificarTarjeta(String uid) {
-  HTTPClient http;
-  String url = "http://" + String(serverIP) + ":" + String(serverPort) + "/api/rfid/verificar/" + uid;
+// ==================== FUNCIONES RFID ====================
+
+// Se ejecuta en la tarea de red: solo red y lista blanca, nada de pantalla ni sonido
+int procesarTarjeta(const EventoTarjeta& evento) {
+  size_t reservasInicio = COMPROBAR_HEAP ? halReservasTarea() : 0;
+  char uid[UID_HEX_MAX];
+  evento.uid.aHex(uid);
   
-  http.begin(url);
-  http.addHeader("User-Agent", "ESP32-RFID-Reader");
-  http.setTimeout(10000);
+  // El lector ya responde los repetidos; aquí solo llegan los que se
+  // repitieron mientras el primero seguía en cola
+  int anterior = consultarToqueReciente(evento.uid, evento.lector, evento.detectadaMs);
+  if (anterior >= 0) {
+    Serial.print("Tarjeta ");
+    Serial.print(uid);
+    Serial.println(" repetida, se responde sin consultar");
+    return (anterior == RESULTADO_PERMITIDO) ? RESULTADO_YA_REGISTRADO : anterior;
+  }
+  antirreboteFallos++;
   
-  int httpCode = http.GET();
+  // Primero la lista blanca local; si no la conoce decide el backend
+  Cronometro etapa;
+  etapa.iniciar();
+  int local = consultarListaBlanca(evento.uid.bytes, evento.uid.longitud);
+  uint32_t listaUs = etapa.transcurridoUs();
+  anotarLatencia(ETAPA_LISTA, listaUs);
   
-  if (httpCode == 200) {
-    String respuesta = http.getString();
-    
-    if (respuesta.indexOf("\"valida\":true") >= 0) {
-      http.end();
-      return true;
-    } else if (respuesta.indexOf("\"valida\":false") >= 0) {
-      http.end();
-      return false;
+  // Hasta aquí no hay red de por medio, así que el heap no debería moverse
+  if (COMPROBAR_HEAP && halReservasTarea() != reservasInicio) {
+    tarjetasConAsignaciones++;
+    Serial.println("AVISO: la ruta de la tarjeta reservo memoria dinamica");
+  }
+
+  // Con la suscripción al día la lista está completa: una desconocida es una
+  // tarjeta sin alta y no hace falta preguntar al backend
+  bool denegadaLocal = (local == LISTA_DESCONOCIDA && listaAlDia());
+  Serial.print("Lista blanca local: ");
+  Serial.print(local == LISTA_VALIDA ? "valida" : (local == LISTA_DESCONOCIDA ? "desconocida" : "no disponible"));
+  if (denegadaLocal) Serial.print(", al dia");
+  Serial.print(" (");
+  Serial.print(listaUs);
+  Serial.println(" us)");
+  
+  char nombre[32] = "";
+  bool tarjetaValida = (local == LISTA_VALIDA);
+  if (local == LISTA_VALIDA || denegadaLocal) verificacionesEvitadas++;
+  
+  // La decide el backend: con la transacción única verifica, registra,
+  // captura y notifica en la misma petición; si no, una llamada por paso
+  int resultado = -1;
+  bool sinBackend = false;
+  if (!tarjetaValida && !denegadaLocal && toqueDisponible && estadoCorte == CORTE_CERRADO) {
+    etapa.iniciar();
+    resultado = transaccionToque(evento, instanteUnix(marcarInstante(evento.detectadaMs), true), nombre, sizeof(nombre));
+    anotarLatencia(ETAPA_TOQUE, etapa.transcurridoUs());
+  }
+  if (resultado < 0 && !tarjetaValida && !denegadaLocal) {
+    etapa.iniciar();
+    tarjetaValida = verificarTarjeta(uid, nombre, sizeof(nombre), evento.lector);
+    anotarLatencia(ETAPA_VERIFICAR, etapa.transcurridoUs());
+    // No respondió (o no a tiempo): no se sabe si la tarjeta es válida
+    sinBackend = !tarjetaValida && ultimaPeticionFallida;
+  }
+  
+  if (resultado >= 0) {
+    toquesUnicos++;
+    Serial.print("Toque resuelto por el backend en una peticion: ");
+    Serial.print(resultado == RESULTADO_PERMITIDO ? "permitido" : "denegado");
+    if (nombre[0] != '\0') {
+      Serial.print(" (");
+      Serial.print(nombre);
+      Serial.print(")");
     }
+    Serial.println();
+  } else if (sinBackend) {
+    // Decisión local, denegar por defecto: sin backend no se sabe si la
+    // tarjeta es válida y abrir a una desconocida no es aceptable. Es un
+    // error, que no se recuerda, así que repetir la tarjeta reintenta. El aviso
+    // y la captura esperan a que vuelva el backend para darla de alta
+    decisionesSinBackend++;
+    Serial.println(estadoCorte == CORTE_ABIERTO ? "Tarjeta desconocida con el backend en corte"
+                                                : "Tarjeta desconocida sin respuesta del backend a tiempo");
+    encolarNotificacion(evento.uid, NOTIF_ERROR);
+    encolarCaptura(evento.uid, evento.lector);
+    resultado = RESULTADO_ERROR_FICHAJE;
+  } else if (tarjetaValida) {
+    Serial.print("Tarjeta valida");
+    if (nombre[0] != '\0') {
+      Serial.print(" (");
+      Serial.print(nombre);
+      Serial.print(")");
+    }
+    Serial.println(", registrando fichaje...");
     
-    DynamicJsonDocument doc(1024);
-    DeserializationError error = deserializeJson(doc, respuesta);
-    
-    if (!error && doc.containsKey("valida")) {
-      bool valida = doc["valida"];
-      http.end();
-      return valida;
+    // El fichaje queda confirmado en cuanto está en el diario; la subida es aparte
+    etapa.iniciar();
+    uint32_t secuencia;
+    bool enDiario = anotarFichaje(evento, secuencia);
+    bool registrado = enDiario ||
+      registrarFichaje(evento.uid, 0, instanteUnix(marcarInstante(evento.detectadaMs), true), evento.lector);
+    anotarLatencia(ETAPA_FICHAJE, etapa.transcurridoUs());
+    if (enDiario) {
+      Serial.print("Fichaje #");
+      Serial.print(secuencia);
+      Serial.print(" guardado en diario (");
+      Serial.print(fichajesPendientes());
+      Serial.println(" pendientes)");
+      encolarNotificacion(evento.uid, NOTIF_VALIDO);
+      resultado = RESULTADO_PERMITIDO;
+    } else if (registrado) {
+      Serial.println("Fichaje registrado exitosamente!");
+      encolarNotificacion(evento.uid, NOTIF_VALIDO);
+      resultado = RESULTADO_PERMITIDO;
+    } else {
+      Serial.println("Error al registrar fichaje");
+      encolarNotificacion(evento.uid, NOTIF_ERROR);
+      resultado = RESULTADO_ERROR_FICHAJE;
+    }
+  } else {
+    Serial.println("Tarjeta no valida o no registrada");
+    encolarNotificacion(evento.uid, NOTIF_INVALIDO);
+    if (denegadaLocal) {
+      // Decidida sin red: la captura sale de fondo y la tarjeta no la espera
+      encolarCaptura(evento.uid, evento.lector);
+    } else {
+      etapa.iniciar();
+      if (!enviarACaptura(evento.uid, evento.lector)) encolarCaptura(evento.uid, evento.lector);
+      anotarLatencia(ETAPA_CAPTURA, etapa.transcurridoUs());
     }
+    resultado = RESULTADO_DENEGADO;
   }
   
-  http.end();
-  return false;
+  // Los errores no se recuerdan: repetir la tarjeta debe reintentar
+  if (resultado != RESULTADO_ERROR_FICHAJE) {
+    recordarToque(evento.uid, evento.lector, resultado, evento.detectadaMs);
+  }
+  
+  Serial.print("Backend: ");
+  Serial.print(peticionesBackend);
+  Serial.print(" peticiones, ");
+  Serial.print(reutilizacionesBackend);
+  Serial.print(" por conexion reutilizada (ultima: ");
+  Serial.print(ultimaPeticionReutilizada ? "si" : "no");
+  Serial.print("), ");
+  Serial.print(reconexionesBackend);
+  Serial.println(" conexiones abiertas");
+  
+  return resultado;
 }
 
-bool registrarFichaje(String uid) {
-  HTTPClient http;
-  String url = "http://" + String(serverIP) + ":" + String(serverPort) + "/api/fichajes/rfid";
-  
-  http.begin(url);
-  http.addHeader("Content-Type", "application/json");
-  http.addHeader("User-Agent", "ESP32-RFID-Reader");
-  http.setTimeout(10000);
+// -1 si el UID no se ha resuelto en ese lector dentro de la ventana; si no, su
+// resultado. La misma tarjeta en otra puerta es un paso distinto
+int consultarToqueReciente(const Uid& uid, uint8_t lector, uint32_t ahoraMs) {
+  int resultado = -1;
+  portENTER_CRITICAL(&antirreboteMux);
+  for (int i = 0; i < toquesEnCache; i++) {
+    ToqueReciente& t = toquesRecientes[i];
+    if (!(t.uid == uid) || t.lector != lector) continue;
+    
+    if (ahoraMs - t.resueltoMs >= ANTIRREBOTE_VENTANA_MS) {
+      // Caducado: fuera de la caché, se procesa como nuevo
+      memmove(&toquesRecientes[i], &toquesRecientes[i + 1], (toquesEnCache - i - 1) * sizeof(ToqueReciente));
+      toquesEnCache--;
+      break;
+    }
+    
+    // Pasa al frente sin renovar el tiempo: la ventana cuenta desde el fichaje real
+    ToqueReciente encontrado = t;
+    memmove(&toquesRecientes[1], &toquesRecientes[0], i * sizeof(ToqueReciente));
+    toquesRecientes[0] = encontrado;
+    antirreboteAciertos++;
+    resultado = encontrado.resultado;
+    break;
+  }
+  portEXIT_CRITICAL(&antirreboteMux);
+  return resultado;
+}
+
+void recordarToque(const Uid& uid, uint8_t lector, uint8_t resultado, uint32_t ahoraMs) {
+  // Al frente; si está llena se pierde el menos reciente
+  portENTER_CRITICAL(&antirreboteMux);
+  if (toquesEnCache < ANTIRREBOTE_CAPACIDAD) toquesEnCache++;
+  memmove(&toquesRecientes[1], &toquesRecientes[0], (toquesEnCache - 1) * sizeof(ToqueReciente));
+  toquesRecientes[0].uid = uid;
+  toquesRecientes[0].lector = lector;
+  toquesRecientes[0].resultado = resultado;
+  toquesRecientes[0].resueltoMs = ahoraMs;
+  portEXIT_CRITICAL(&antirreboteMux);
+}
+
+// Se ejecuta en loop(): feedback del resultado que publicó la tarea de red
+void mostrarResultado(const ResultadoEvento& resultado) {
+  char uidHex[UID_HEX_MAX];
+  resultado.evento.uid.aHex(uidHex);
+  Serial.print("Resultado ");
+  Serial.print(uidHex);
+  if (NUM_LECTORES > 1) {
+    Serial.print(" (lector ");
+    Serial.print(resultado.evento.lector);
+    Serial.print(")");
+  }
+  Serial.print(" en ");
+  Serial.print(resultado.resueltaMs - resultado.evento.detectadaMs);
+  Serial.println(" ms");
   
-  String ipReal = WiFi.localIP().toString();
-  String json = "{\"codigoRFID\":\"" + uid + "\",\"ip\":\"" + ipReal + "\"}";
+  marcarHito(HITO_PRIMERA_TARJETA);
+  uint32_t feedbackMs = halMillis() - resultado.evento.detectadaMs;
+  anotarLatencia(ETAPA_FEEDBACK, feedbackMs * 1000);
+  if (BANCO_PRUEBAS && estadoBanco == BANCO_EN_CURSO && muestrasFeedbackN < BANCO_MAX_TOQUES) {
+    muestrasFeedback[muestrasFeedbackN++] = feedbackMs;
+    ultimoFeedbackBancoMs = halMillis();
+  }
   
-  int httpCode = http.POST(json);
-  http.end();
+  cicloPendienteMs = resultado.evento.detectadaMs;
+  uint8_t lector = resultado.evento.lector;
+  if (resultado.resultado == RESULTADO_PERMITIDO) {
+    mostrarAccesoPermitido(lector);
+  } else if (resultado.resultado == RESULTADO_ERROR_FICHAJE) {
+    mostrarErrorFichaje(lector);
+  } else if (resultado.resultado == RESULTADO_YA_REGISTRADO) {
+    mostrarYaRegistrado(lector);
+  } else {
+    mostrarAccesoDenegado(lector);
+  }
+}
+
+bool enviarACaptura(const Uid& uid, uint8_t lector, uint32_t timeoutMs) {
+  if (formatoBinario) {
+    uint8_t carga[16];
+    size_t largo = msgpackCaptura(carga, sizeof(carga), uid, lector);
+    int httpCode = postBinarioBackend(rutaCaptura, carga, largo, timeoutMs);
+    if (largo > 0 && !rechazaBinario(httpCode)) return httpCode >= 200 && httpCode < 300;
+  }
   
-  return (httpCode == 200);
+  char uidHex[UID_HEX_MAX];
+  uid.aHex(uidHex);
+  char json[64];
+  size_t largo = jsonCaptura(json, sizeof(json), uidHex, lector);
+  if (largo == 0) return false;
+  int httpCode = postJSONBackend(rutaCaptura, json, largo, timeoutMs);
+  return httpCode >= 200 && httpCode < 300;
 }
 
-// ==================== FUNCIONES WIFI ====================
+void encolarCaptura(const Uid& uid, uint8_t lector) {
+  for (int i = 0; i < capturasEnCola; i++) {
+    if (capturasPendientes[i].uid == uid) return;
+  }
+  if (capturasEnCola >= CAPTURA_CAPACIDAD) {
+    capturasDescartadas++;
+    return;
+  }
+  capturasPendientes[capturasEnCola].uid = uid;
+  capturasPendientes[capturasEnCola].lector = lector;
+  capturasEnCola++;
+}
 
-void conectarWiFi() {
-  mostrarConectandoWiFi();
+// Tarea de red, sin tarjetas en cola y con el corte cerrado: de una en una,
+// en orden, y se para en el primer fallo
+void enviarCapturasPendientes() {
+  int enviadas = 0;
+  while (enviadas < capturasEnCola && tarjetasEnCola() == 0 && estadoCorte == CORTE_CERRADO) {
+    const CapturaPendiente& c = capturasPendientes[enviadas];
+    if (!enviarACaptura(c.uid, c.lector, FONDO_TIMEOUT_MS)) break;
+    enviadas++;
+  }
+  if (enviadas == 0) return;
+  capturasEnCola -= enviadas;
+  memmove(&capturasPendientes[0], &capturasPendientes[enviadas], capturasEnCola * sizeof(CapturaPendiente));
+  Serial.print("Capturas pendientes enviadas: ");
+  Serial.print(enviadas);
+  Serial.print(", quedan ");
+  Serial.println(capturasEnCola);
+}
+
+bool verificarTarjeta(const char* uidHex, char* nombreEmpleado, size_t maximoNombre, uint8_t lector) {
+  char ruta[64];
+  if (NUM_LECTORES > 1) {
+    snprintf(ruta, sizeof(ruta), "%s%s?lector=%u", rutaVerificar, uidHex, lector);
+  } else {
+    snprintf(ruta, sizeof(ruta), "%s%s", rutaVerificar, uidHex);
+  }
   
-  Serial.println("Conectando a WiFi...");
-  WiFi.begin(ssid, password);
+  int httpCode = peticionBackend("GET", ruta, nullptr, nullptr, 0, 10000);
   
-  int intentos = 0;
-  while (WiFi.status() != WL_CONNECTED && intentos < 30) {
-    delay(500);
-    intentos++;
+  if (httpCode != 200) {
+    finalizarPeticionBackend();
+    return false;
   }
   
-  if (WiFi.status() == WL_CONNECTED) {
-    Serial.println("WiFi Conectado!");
-    Serial.print("IP: ");
-    Serial.println(WiFi.localIP());
-    mostrarWiFiConectado();
+  // Se parsea directamente del socket; el filtro descarta el resto de campos
+  // sin guardarlos y la lectura termina al cerrar el objeto raíz
+  static StaticJsonDocument<JSON_OBJECT_SIZE(2)> filtro;
+  if (filtro.isNull()) {
+    filtro["valida"] = true;
+    filtro["nombreEmpleado"] = true;
+  }
+  
+  // Con el modo binario el backend puede contestar en MessagePack (mismo mapa)
+  StaticJsonDocument<VERIFICAR_DOC_BYTES> doc;
+  DeserializationError error = respuestaBinaria
+    ? deserializeMsgPack(doc, cuerpoRespuesta, DeserializationOption::Filter(filtro), DeserializationOption::NestingLimit(4))
+    : deserializeJson(doc, cuerpoRespuesta, DeserializationOption::Filter(filtro), DeserializationOption::NestingLimit(4));
+  size_t leidos = cuerpoRespuesta.leidos();
+  finalizarPeticionBackend();
+  
+  verificacionMemoria = doc.memoryUsage();
+  if (verificacionMemoria > verificacionMemoriaMax) verificacionMemoriaMax = verificacionMemoria;
+  Serial.print("Verificacion: ");
+  Serial.print(leidos);
+  Serial.print(" bytes leidos, documento ");
+  Serial.print(verificacionMemoria);
+  Serial.print("/");
+  Serial.print(doc.capacity());
+  Serial.print(" bytes (max ");
+  Serial.print(verificacionMemoriaMax);
+  Serial.println(")");
+  
+  // Sin memoria solo falta lo que no cabía (el nombre): valida puede estar ya leído
+  if (error && error != DeserializationError::NoMemory) {
+    Serial.print("Respuesta de verificacion invalida: ");
+    Serial.println(error.c_str());
+    return false;
+  }
+  
+  const char* nombre = doc["nombreEmpleado"];
+  if (nombreEmpleado != nullptr && maximoNombre > 0) {
+    snprintf(nombreEmpleado, maximoNombre, "%s", nombre != nullptr ? nombre : "");
+  }
+  
+  return doc["valida"] | false;
+}
+
+// Sin la ruta se sabe en el arranque y la primera tarjeta ya va por separado.
+// Un 405 solo dice que no atiende OPTIONS: lo confirma el primer toque
+void negociarToque() {
+  if (!toqueDisponible) return;
+  int httpCode = peticionBackend("OPTIONS", rutaToque, nullptr, nullptr, 0, 5000);
+  finalizarPeticionBackend();
+  if (httpCode == 404) {
+    toqueDisponible = false;
+    Serial.println("Backend sin transaccion de toque, se verifica y ficha por separado");
+  } else if (httpCode >= 200 && httpCode < 300) {
+    Serial.println("Backend con transaccion de toque");
+  }
+}
+
+// El cuerpo es el de un fichaje sin secuencia; el instante del toque permite
+// al backend descartar la repetición si la respuesta se perdió y la tarjeta
+// siguió por separado. -1 si hay que seguir por separado
+int transaccionToque(const EventoTarjeta& evento, uint32_t instante, char* nombreEmpleado, size_t maximoNombre) {
+  int httpCode = -1;
+  bool enviarJson = true;
+  if (formatoBinario) {
+    uint8_t carga[40];
+    size_t largo = msgpackFichaje(carga, sizeof(carga), evento.uid, 0, instante, evento.lector);
+    if (largo > 0) {
+      httpCode = peticionBackend("POST", rutaToque, TIPO_MSGPACK, carga, largo, 10000);
+      enviarJson = rechazaBinario(httpCode);
+    }
+  }
+  if (enviarJson) {
+    char uidHex[UID_HEX_MAX];
+    evento.uid.aHex(uidHex);
+    char json[128];
+    size_t largo = jsonFichaje(json, sizeof(json), uidHex, 0, instante, evento.lector);
+    if (largo == 0) return -1;
+    httpCode = peticionBackend("POST", rutaToque, TIPO_JSON, (const uint8_t*)json, largo, 10000);
+  }
+  
+  if (httpCode == 404 || httpCode == 405) {
+    finalizarPeticionBackend();
+    Serial.println("Backend sin transaccion de toque, se verifica y ficha por separado");
+    toqueDisponible = false;
+    return -1;
+  }
+  if (httpCode != 200) {
+    finalizarPeticionBackend();
+    toquesPorSeparado++;
+    return -1;
+  }
+  
+  // Mismo tratamiento que /verificar: del socket, solo los campos que se usan
+  static StaticJsonDocument<JSON_OBJECT_SIZE(2)> filtro;
+  if (filtro.isNull()) {
+    filtro["resultado"] = true;
+    filtro["nombreEmpleado"] = true;
+  }
+  
+  StaticJsonDocument<VERIFICAR_DOC_BYTES> doc;
+  DeserializationError error = respuestaBinaria
+    ? deserializeMsgPack(doc, cuerpoRespuesta, DeserializationOption::Filter(filtro), DeserializationOption::NestingLimit(4))
+    : deserializeJson(doc, cuerpoRespuesta, DeserializationOption::Filter(filtro), DeserializationOption::NestingLimit(4));
+  finalizarPeticionBackend();
+  
+  const char* resultado = doc["resultado"];
+  if ((error && error != DeserializationError::NoMemory) || resultado == nullptr) {
+    Serial.println("Respuesta de toque invalida, se sigue por separado");
+    toquesPorSeparado++;
+    return -1;
+  }
+  
+  const char* nombre = doc["nombreEmpleado"];
+  if (nombreEmpleado != nullptr && maximoNombre > 0) {
+    snprintf(nombreEmpleado, maximoNombre, "%s", nombre != nullptr ? nombre : "");
+  }
+  
+  // Cualquier otro resultado (el backend no pudo registrar) sigue por
+  // separado, que deja el fichaje en el diario
+  if (strcmp(resultado, "permitido") == 0) return RESULTADO_PERMITIDO;
+  if (strcmp(resultado, "denegado") == 0) return RESULTADO_DENEGADO;
+  toquesPorSeparado++;
+  return -1;
+}
+
+bool registrarFichaje(const Uid& uid, uint32_t secuencia, uint32_t instante, uint8_t lector) {
+  if (formatoBinario) {
+    uint8_t carga[40];
+    size_t largo = msgpackFichaje(carga, sizeof(carga), uid, secuencia, instante, lector);
+    int httpCode = postBinarioBackend(rutaFichaje, carga, largo, FONDO_TIMEOUT_MS);
+    if (largo > 0 && !rechazaBinario(httpCode)) return (httpCode == 200);
+  }
+  
+  char uidHex[UID_HEX_MAX];
+  uid.aHex(uidHex);
+  char json[128];
+  size_t largo = jsonFichaje(json, sizeof(json), uidHex, secuencia, instante, lector);
+  if (largo == 0) return false;
+  
+  int httpCode = postJSONBackend(rutaFichaje, json, largo, FONDO_TIMEOUT_MS);
+  
+  return (httpCode == 200);
+}
+
+size_t jsonFichaje(char* destino, size_t maximo, const char* uidHex, uint32_t secuencia, uint32_t instante, uint8_t lector) {
+  // La secuencia permite al backend descartar reenvíos del diario; el instante
+  // (segundos Unix del toque) solo si se conoce; el lector solo viaja si hay
+  // más de uno, así una placa de una puerta no cambia
+  char extra[72] = "";
+  int n = 0;
+  if (secuencia > 0) n += snprintf(extra + n, sizeof(extra) - n, ",\"secuencia\":%lu", (unsigned long)secuencia);
+  if (instante > 0) n += snprintf(extra + n, sizeof(extra) - n, ",\"instante\":%lu", (unsigned long)instante);
+  if (NUM_LECTORES > 1) snprintf(extra + n, sizeof(extra) - n, ",\"lector\":%u", lector);
+  int largo = snprintf(destino, maximo, "{\"codigoRFID\":\"%s\",\"ip\":\"%s\"%s}", uidHex, ipLocal, extra);
+  return (largo > 0 && (size_t)largo < maximo) ? largo : 0;
+}
+
+size_t jsonNotificacion(char* destino, size_t maximo, const char* uidHex, const char* tipo, const char* nombreEmpleado) {
+  int largo;
+  if (nombreEmpleado != nullptr && nombreEmpleado[0] != '\0') {
+    largo = snprintf(destino, maximo, "{\"codigoRFID\":\"%s\",\"ip\":\"%s\",\"tipo\":\"%s\",\"nombreEmpleado\":\"%s\"}",
+                     uidHex, ipLocal, tipo, nombreEmpleado);
+  } else {
+    largo = snprintf(destino, maximo, "{\"codigoRFID\":\"%s\",\"ip\":\"%s\",\"tipo\":\"%s\"}", uidHex, ipLocal, tipo);
+  }
+  return (largo > 0 && (size_t)largo < maximo) ? largo : 0;
+}
+
+size_t jsonCaptura(char* destino, size_t maximo, const char* uidHex, uint8_t lector) {
+  int largo;
+  if (NUM_LECTORES > 1) {
+    largo = snprintf(destino, maximo, "{\"codigoRfid\":\"%s\",\"lector\":%u}", uidHex, lector);
+  } else {
+    largo = snprintf(destino, maximo, "{\"codigoRfid\":\"%s\"}", uidHex);
+  }
+  return (largo > 0 && (size_t)largo < maximo) ? largo : 0;
+}
+
+// Formato binario: arrays posicionales con el UID en crudo (bin), la IP
+// empaquetada en 4 bytes y el tipo de evento como entero (ver README)
+
+size_t msgpackFichaje(uint8_t* destino, size_t maximo, const Uid& uid, uint32_t secuencia, uint32_t instante, uint8_t lector) {
+  // [uid, ip, secuencia, instante o nil] y lector al final con varios lectores
+  EscritorMsgPack mp(destino, maximo);
+  mp.array(NUM_LECTORES > 1 ? 5 : 4);
+  mp.binario(uid.bytes, uid.longitud);
+  mp.binario(ipLocalBytes, 4);
+  mp.entero(secuencia);
+  if (instante > 0) {
+    mp.entero(instante);
+  } else {
+    mp.nulo();
+  }
+  if (NUM_LECTORES > 1) mp.entero(lector);
+  return mp.terminar();
+}
+
+size_t msgpackNotificacion(uint8_t* destino, size_t maximo, const Uid& uid, uint8_t tipo, const char* nombreEmpleado) {
+  // [uid, ip, tipo, nombre o nil]
+  EscritorMsgPack mp(destino, maximo);
+  mp.array(4);
+  mp.binario(uid.bytes, uid.longitud);
+  mp.binario(ipLocalBytes, 4);
+  mp.entero(tipo);
+  if (nombreEmpleado != nullptr && nombreEmpleado[0] != '\0') {
+    mp.texto(nombreEmpleado);
+  } else {
+    mp.nulo();
+  }
+  return mp.terminar();
+}
+
+size_t msgpackCaptura(uint8_t* destino, size_t maximo, const Uid& uid, uint8_t lector) {
+  // [uid] o [uid, lector]
+  EscritorMsgPack mp(destino, maximo);
+  mp.array(NUM_LECTORES > 1 ? 2 : 1);
+  mp.binario(uid.bytes, uid.longitud);
+  if (NUM_LECTORES > 1) mp.entero(lector);
+  return mp.terminar();
+}
+
+void compararFormatos() {
+  // Codifica los payloads más frecuentes y una respuesta de /verificar en
+  // ambos formatos para comparar tamaño en el aire y coste en la CPU
+  const int repeticiones = 200;
+  Uid uid;
+  const uint8_t ejemplo[7] = {0x04, 0xA2, 0x3B, 0x91, 0x6C, 0x5E, 0x80};
+  uid.asignar(ejemplo, sizeof(ejemplo));
+  char uidHex[UID_HEX_MAX];
+  char json[192];
+  uint8_t carga[80];
+  size_t largoJson = 0;
+  size_t largoBinario = 0;
+  
+  Serial.println("Payload: JSON bytes / us por codificacion -> MessagePack bytes / us");
+  
+  for (int caso = 0; caso < 3; caso++) {
+    unsigned long inicio = halMicros();
+    for (int i = 0; i < repeticiones; i++) {
+      uid.aHex(uidHex);
+      if (caso == 0) largoJson = jsonFichaje(json, sizeof(json), uidHex, 123456, 1760000000);
+      else if (caso == 1) largoJson = jsonNotificacion(json, sizeof(json), uidHex, nombresNotificacion[NOTIF_VALIDO], "Empleado Verificado");
+      else largoJson = jsonCaptura(json, sizeof(json), uidHex);
+    }
+    unsigned long tiempoJson = halMicros() - inicio;
+    
+    inicio = halMicros();
+    for (int i = 0; i < repeticiones; i++) {
+      if (caso == 0) largoBinario = msgpackFichaje(carga, sizeof(carga), uid, 123456, 1760000000);
+      else if (caso == 1) largoBinario = msgpackNotificacion(carga, sizeof(carga), uid, NOTIF_VALIDO, "Empleado Verificado");
+      else largoBinario = msgpackCaptura(carga, sizeof(carga), uid);
+    }
+    unsigned long tiempoBinario = halMicros() - inicio;
+    
+    const char* nombres[3] = {"fichaje", "notificacion", "captura"};
+    imprimirComparacion(nombres[caso], largoJson, tiempoJson / (float)repeticiones,
+                        largoBinario, tiempoBinario / (float)repeticiones);
+  }
+  
+  // Respuesta de /verificar: {"valida":true,"nombreEmpleado":"Empleado Verificado"}
+  const char respuestaJson[] = "{\"valida\":true,\"nombreEmpleado\":\"Empleado Verificado\"}";
+  EscritorMsgPack mp(carga, sizeof(carga));
+  mp.byte(0x82);
+  mp.texto("valida");
+  mp.byte(0xC3);
+  mp.texto("nombreEmpleado");
+  mp.texto("Empleado Verificado");
+  size_t largoRespuesta = mp.terminar();
+  
+  StaticJsonDocument<VERIFICAR_DOC_BYTES> doc;
+  unsigned long inicio = halMicros();
+  for (int i = 0; i < repeticiones; i++) deserializeJson(doc, respuestaJson, sizeof(respuestaJson) - 1);
+  unsigned long tiempoJson = halMicros() - inicio;
+  inicio = halMicros();
+  for (int i = 0; i < repeticiones; i++) deserializeMsgPack(doc, carga, largoRespuesta);
+  unsigned long tiempoBinario = halMicros() - inicio;
+  
+  imprimirComparacion("verificar (lectura)", sizeof(respuestaJson) - 1, tiempoJson / (float)repeticiones,
+                      largoRespuesta, tiempoBinario / (float)repeticiones);
+  Serial.print("Formato activo: ");
+  Serial.println(formatoBinario ? "MessagePack" : "JSON");
+}
+
+void imprimirComparacion(const char* payload, size_t largoJson, float usJson, size_t largoBinario, float usBinario) {
+  Serial.print(payload);
+  Serial.print(": ");
+  Serial.print(largoJson);
+  Serial.print(" / ");
+  Serial.print(usJson, 2);
+  Serial.print(" -> ");
+  Serial.print(largoBinario);
+  Serial.print(" / ");
+  Serial.println(usBinario, 2);
+}
+
+size_t bloquesHeap() {
+  // Bloques reservados en todo el heap, de todas las tareas: solo vale como
+  // tendencia (telemetría), no para afirmar que una tarea no reservó nada
+  multi_heap_info_t info;
+  heap_caps_get_info(&info, MALLOC_CAP_DEFAULT);
+  return info.allocated_blocks;
+}
+
+// ==================== TAREA DE RED ====================
+
+void tareaRed(void* parametro) {
+  // Arranque en segundo plano: el lector ya acepta tarjetas y se van encolando.
+  // Solo en builds de medición: retrasa la espera de red
+  if (MEDIR_FORMATOS) compararFormatos();
+  esperarRedArranque();
+  atenderTarjetas();
+  comprobarBackendArranque();
+  unsigned long ultimaLista = halMillis();
+  unsigned long ultimaMuestra = halMillis();
+  tomarMuestraMemoria();
+  
+  for (;;) {
+    // Despierta al llegar una tarjeta, cuando toca subir un lote o cada
+    // segundo para tareas de fondo
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(esperaHastaSubida()));
+    
+    atenderTarjetas();
+    
+    // Entre cada paso de fondo se atienden las tarjetas que llegaron durante
+    // el anterior: ninguna espera más que una petición de fondo
+    
+    // Subir fichajes del diario cuando el backend responde
+    subirDiario();
+    atenderTarjetas();
+    
+    // Notificaciones después de lo urgente, con límite de ritmo; con el
+    // backend caído esperan en cola en lugar de ocupar la tarea de red
+    if (tarjetasEnCola() == 0 && estadoCorte == CORTE_CERRADO) enviarNotificaciones();
+    atenderTarjetas();
+    
+    // Capturas de tarjetas que se denegaron sin backend
+    enviarCapturasPendientes();
+    atenderTarjetas();
+    
+    // Con el corte abierto, comprobar de vez en cuando si el backend volvió
+    probarBackend();
+    atenderTarjetas();
+    
+    // Cambios de la lista blanca: el backend los empuja por el long-poll
+    atenderSuscripcionLista();
+    atenderTarjetas();
+    
+    // Sin suscripción, consultar la versión de la lista periódicamente; con
+    // el corte abierto se espera a que cierre
+    if (!suscripcionDisponible && estadoCorte == CORTE_CERRADO && halMillis() - ultimaLista > INTERVALO_LISTA_MS) {
+      actualizarListaBlanca();
+      ultimaLista = halMillis();
+      atenderTarjetas();
+    }
+    
+    if (halMillis() - ultimaMuestra >= MEMORIA_INTERVALO_MS) {
+      tomarMuestraMemoria();
+      ultimaMuestra = halMillis();
+    }
+  }
+}
+
+void esperarRedArranque() {
+  // Sin red no se puede verificar en el backend: las tarjetas esperan en la
+  // cola un tiempo acotado y después se atienden con lista blanca y diario
+  uint32_t inicio = halMillis();
+  while (!halRedConectada() && halMillis() - inicio < ARRANQUE_ESPERA_RED_MS) {
+    vTaskDelay(pdMS_TO_TICKS(20));
+  }
+  if (!halRedConectada()) {
+    Serial.println("Arranque sin red, las tarjetas se atienden en local");
+  }
+}
+
+void comprobarBackendArranque() {
+  // Descargar la lista blanca si el backend tiene una versión más nueva
+  actualizarListaBlanca();
+  
+  // Transacción única de toque o la secuencia verificar + fichaje de siempre
+  negociarToque();
+  
+  // Test inicial de Telegram
+  Serial.println("Realizando test inicial de Telegram...");
+  if (testConexionTelegram()) {
+    Serial.println("Test Telegram exitoso");
+  } else {
+    Serial.println("Test Telegram falló");
+  }
+  marcarHito(HITO_BACKEND);
+}
+
+void atenderTarjetas() {
+  // Por turnos, una tarjeta de cada lector por vuelta: ninguna puerta espera
+  // a que se vacíe la cola de otra
+  EventoTarjeta evento;
+  bool quedan = true;
+  while (quedan) {
+    quedan = false;
+    for (uint8_t l = 0; l < NUM_LECTORES; l++) {
+      if (!colasTarjetas[l].desencolar(evento)) continue;
+      quedan = true;
+      atenderTarjeta(evento);
+    }
+  }
+}
+
+size_t tarjetasEnCola() {
+  size_t total = 0;
+  for (uint8_t l = 0; l < NUM_LECTORES; l++) total += colasTarjetas[l].ocupacion();
+  return total;
+}
+
+void atenderTarjeta(const EventoTarjeta& evento) {
+  uint32_t esperaMs = halMillis() - evento.detectadaMs;
+  anotarLatencia(ETAPA_COLA, esperaMs * 1000);
+  if (BANCO_PRUEBAS && estadoBanco == BANCO_EN_CURSO && muestrasColaN < BANCO_MAX_TOQUES) {
+    muestrasCola[muestrasColaN++] = esperaMs;
+  }
+  
+  size_t bloquesAntes = bloquesHeap();
+  
+  // Toda la red de la tarjeta comparte un plazo que corre desde la detección:
+  // la espera en cola también cuenta. Cada petición dispone de lo que queda y,
+  // agotado, las siguientes se cancelan sin enviarse
+  plazoHastaMs = evento.detectadaMs + PLAZO_TOQUE_MS;
+  plazoActivo = true;
+  
+  ResultadoEvento resultado;
+  resultado.evento = evento;
+  resultado.resultado = procesarTarjeta(evento);
+  resultado.resueltaMs = halMillis();
+  
+  plazoActivo = false;
+  if ((int32_t)(resultado.resueltaMs - plazoHastaMs) >= 0) plazosVencidos++;
+  
+  int16_t bloques = (int32_t)bloquesHeap() - (int32_t)bloquesAntes;
+  toquesMedidos++;
+  toquesIntervalo++;
+  bloquesToqueSuma += bloques;
+  if (bloques > bloquesToqueMax) bloquesToqueMax = bloques;
+  anotarLatencia(ETAPA_RESUELTA, (resultado.resueltaMs - evento.detectadaMs) * 1000);
+  
+  // Si loop() no da abasto se descarta el feedback, el fichaje ya está hecho
+  if (!colaResultados.encolar(resultado)) {
+    Serial.println("Cola de resultados llena");
+  }
+}
+
+void marcarHito(uint8_t hito) {
+  if (hitosArranque[hito] != 0) return;
+  hitosArranque[hito] = halMillis();
+  Serial.print("Arranque: ");
+  Serial.print(nombresHito[hito]);
+  Serial.print(" a los ");
+  Serial.print(hitosArranque[hito]);
+  Serial.println(" ms del encendido");
+}
+
+// ==================== TAREA DEL LECTOR ====================
+
+// Con IRQ el RC522 emite REQA por su cuenta y solo molesta a la CPU cuando una
+// tarjeta contesta; sin IRQ se sondea con PICC_IsNewCardPresent. Con varios
+// lectores cada vuelta los atiende a todos, empezando por uno distinto cada
+// vez, así que ninguno queda sin sondear más de una vuelta
+void tareaLector(void* parametro) {
+  if (deteccionIrq) halConfigurarIrqLector();
+  unsigned long ultimoInforme = halMillis();
+  marcarHito(HITO_LECTOR);
+  
+  for (;;) {
+    // Durante el banco las tarjetas salen de la traza, no del RC522
+    if (BANCO_PRUEBAS && estadoBanco == BANCO_EN_CURSO && !trazaInyectada) {
+      reproducirTraza();
+      // La pausa del banco no cuenta como hueco de sondeo
+      for (uint8_t l = 0; l < NUM_LECTORES; l++) estadisticasLector[l].ultimoSondeoMs = 0;
+      vTaskDelay(1);
+      continue;
+    }
+    
+    if (deteccionIrq) {
+      for (uint8_t l = 0; l < NUM_LECTORES; l++) {
+        halArmarREQA(l);
+        marcarSondeo(l);
+      }
+      armadosREQA++;
+      // Todos comparten la notificación: se mira qué lector levantó RxIRq
+      bool interrupcion = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(INTERVALO_REQA_MS)) > 0;
+      uint32_t detectadaUs = interrupcion ? irqLectorMicros : halMicros();
+      if (interrupcion) {
+        irqLector++;
+        irqPerdidasSeguidas = 0;
+      }
+      for (uint8_t i = 0; i < NUM_LECTORES; i++) {
+        uint8_t l = (turnoLector + i) % NUM_LECTORES;
+        if (!halRespuestaLector(l)) continue;
+        // Hubo respuesta pero no interrupción: la línea IRQ no funciona
+        if (!interrupcion) {
+          irqPerdidas++;
+          irqPerdidasSeguidas++;
+        }
+        leerTarjeta(l, detectadaUs);
+      }
+      // Una interrupción suelta que se pierde (ruido, carrera con el
+      // rearme) no cuenta: solo una línea que nunca baja
+      if (irqPerdidasSeguidas >= IRQ_PERDIDAS_MAX) {
+        Serial.println("La IRQ del lector no responde, se pasa a sondeo");
+        halDesactivarIrqLector();
+        deteccionIrq = false;
+      }
+      for (uint8_t l = 0; l < NUM_LECTORES; l++) halLimpiarIrqLector(l);
+      // Las transacciones de la lectura también levantan la IRQ
+      ulTaskNotifyTake(pdTRUE, 0);
+    } else {
+      sondeosLector++;
+      for (uint8_t i = 0; i < NUM_LECTORES; i++) {
+        uint8_t l = (turnoLector + i) % NUM_LECTORES;
+        marcarSondeo(l);
+        uint32_t inicio = halMicros();
+        if (halHayTarjetaNueva(l)) {
+          leerTarjeta(l, inicio);
+        }
+      }
+      vTaskDelay(pdMS_TO_TICKS(INTERVALO_SONDEO_MS));
+    }
+    turnoLector = (turnoLector + 1) % NUM_LECTORES;
+    
+    if (halMillis() - ultimoInforme > INTERVALO_INFORME_LECTOR_MS) {
+      informeLector();
+      ultimoInforme = halMillis();
+    }
+  }
+}
+
+void IRAM_ATTR interrupcionLector() {
+  irqLectorMicros = halMicros();
+  BaseType_t despertar = pdFALSE;
+  vTaskNotifyGiveFromISR(tareaLectorHandle, &despertar);
+  if (despertar) portYIELD_FROM_ISR();
+}
+
+bool leerTarjeta(uint8_t lector, uint32_t detectadaUs) {
+  // Solo se copia el UID; la verificación ocurre en la tarea de red
+  size_t reservasInicio = COMPROBAR_HEAP ? halReservasTarea() : 0;
+  EventoTarjeta evento;
+  if (!halLeerUID(lector, evento.uid)) return false;
+  evento.detectadaMs = halMillis();
+  evento.lector = lector;
+  uint32_t deteccionUs = halMicros() - detectadaUs;
+  
+  EstadisticasLector& e = estadisticasLector[lector];
+  e.lecturas++;
+  e.deteccionSumaUs += deteccionUs;
+  if (deteccionUs > e.deteccionMaximoUs) e.deteccionMaximoUs = deteccionUs;
+  anotarLatencia(ETAPA_LECTURA, deteccionUs);
+  
+  bool repetida = responderRepetida(evento);
+  if (!repetida && !publicarLectura(evento)) return false;
+  
+  if (COMPROBAR_HEAP && halReservasTarea() != reservasInicio) {
+    Serial.println("AVISO: la lectura de la tarjeta reservo memoria dinamica");
+  }
+  
+  char uidHex[UID_HEX_MAX];
+  evento.uid.aHex(uidHex);
+  Serial.print("Tarjeta detectada: ");
+  Serial.print(uidHex);
+  if (NUM_LECTORES > 1) {
+    Serial.print(" en lector ");
+    Serial.print(lector);
+  }
+  Serial.print(" (deteccion -> UID ");
+  Serial.print(deteccionUs);
+  Serial.print(" us)");
+  Serial.println(repetida ? ", repetida: se responde sin consultar" : "");
+  return true;
+}
+
+// Toque repetido dentro de la ventana: se responde desde el lector, sin pasar
+// por la cola de la tarea de red ni esperar a lo que esté haciendo
+bool responderRepetida(const EventoTarjeta& evento) {
+  int anterior = consultarToqueReciente(evento.uid, evento.lector, evento.detectadaMs);
+  if (anterior < 0) return false;
+  ResultadoEvento resultado;
+  resultado.evento = evento;
+  resultado.resultado = (anterior == RESULTADO_PERMITIDO) ? RESULTADO_YA_REGISTRADO : anterior;
+  resultado.resueltaMs = halMillis();
+  // Sin hueco, que la resuelva la tarea de red como las demás
+  if (!colaRepetidas.encolar(resultado)) return false;
+  ultimoLector = evento.lector;
+  lecturasNuevas++;
+  return true;
+}
+
+bool publicarLectura(const EventoTarjeta& evento) {
+  // Si el resultado llega a loop() antes que este aviso, tarjetasEnCurso baja
+  // a -1 un instante y el aviso lo devuelve a 0
+  if (!colasTarjetas[evento.lector].encolar(evento)) {
+    tarjetasDescartadas++;
+    lecturasDescartadas++;
+    Serial.print("Cola del lector ");
+    Serial.print(evento.lector);
+    Serial.println(" llena, lectura descartada");
+    return false;
+  }
+  ultimoLector = evento.lector;
+  lecturasNuevas++;
+  xTaskNotifyGive(tareaRedHandle);
+  return true;
+}
+
+void informeLector() {
+  Serial.print("Lector (");
+  Serial.print(deteccionIrq ? "IRQ" : "sondeo");
+  Serial.print("): ");
+  Serial.print(armadosREQA);
+  Serial.print(" REQA, ");
+  Serial.print(sondeosLector);
+  Serial.print(" sondeos, ");
+  Serial.print(irqLector);
+  Serial.print(" interrupciones, ");
+  Serial.print(irqPerdidas);
+  Serial.print(" perdidas; antirrebote: ");
+  Serial.print(antirreboteAciertos);
+  Serial.print(" repetidas sin consultar, ");
+  Serial.print(antirreboteFallos);
+  Serial.println(" a la red");
+  
+  for (uint8_t l = 0; l < NUM_LECTORES; l++) {
+    const EstadisticasLector& e = estadisticasLector[l];
+    Serial.print("  Lector ");
+    Serial.print(l);
+    Serial.print(": ");
+    Serial.print(e.lecturas);
+    Serial.print(" lecturas, deteccion -> UID media ");
+    Serial.print(e.lecturas ? e.deteccionSumaUs / e.lecturas : 0);
+    Serial.print(" us, max ");
+    Serial.print(e.deteccionMaximoUs);
+    Serial.print(" us; hueco de sondeo max ");
+    Serial.print(e.huecoMaximoMs);
+    Serial.print(" ms (");
+    Serial.print(e.huecosExcedidos);
+    Serial.print(" > ");
+    Serial.print(SONDEO_HUECO_MAX_MS);
+    Serial.println(" ms)");
+  }
+}
+
+void marcarSondeo(uint8_t lector) {
+  // Tiempo entre dos oportunidades de detectar en el mismo lector
+  EstadisticasLector& e = estadisticasLector[lector];
+  uint32_t ahora = halMillis();
+  if (e.ultimoSondeoMs != 0) {
+    uint32_t hueco = ahora - e.ultimoSondeoMs;
+    if (hueco > e.huecoMaximoMs) e.huecoMaximoMs = hueco;
+    if (hueco > SONDEO_HUECO_MAX_MS) e.huecosExcedidos++;
+  }
+  e.ultimoSondeoMs = ahora;
+}
+
+// ==================== DIARIO DE FICHAJES ====================
+
+void rutaSegmento(char* ruta, size_t maximo, uint32_t segmento) {
+  snprintf(ruta, maximo, DIARIO_DIR "/%08lu.seg", (unsigned long)segmento);
+}
+
+uint32_t crcRegistro(const RegistroDiario& r) {
+  return esp_crc32_le(0, (const uint8_t*)&r, offsetof(RegistroDiario, crc));
+}
+
+bool leerRegistro(File& archivo, RegistroDiario& r) {
+  // Un registro incompleto o con CRC erróneo marca el final útil del segmento
+  if (archivo.read((uint8_t*)&r, sizeof(r)) != sizeof(r)) return false;
+  return r.marca == DIARIO_MARCA && r.crc == crcRegistro(r);
+}
+
+bool escribirRegistro(RegistroDiario& r) {
+  r.marca = DIARIO_MARCA;
+  r.crc = crcRegistro(r);
+  if (archivoDiario.write((const uint8_t*)&r, sizeof(r)) != sizeof(r)) return false;
+  archivoDiario.flush();
+  return true;
+}
+
+bool abrirSegmento(uint32_t segmento) {
+  // Cada segmento empieza con el estado del diario, así sobrevive aunque
+  // se hayan borrado todos los anteriores
+  char ruta[32];
+  rutaSegmento(ruta, sizeof(ruta), segmento);
+  if (archivoDiario) archivoDiario.close();
+  archivoDiario = halAbrirArchivo(ruta, FILE_APPEND, true);
+  if (!archivoDiario) return false;
+  segmentoEscritura = segmento;
+  
+  RegistroDiario inicio;
+  memset(&inicio, 0, sizeof(inicio));
+  inicio.tipo = REGISTRO_INICIO;
+  inicio.secuencia = diarioSecuencia;
+  inicio.confirmado = diarioConfirmado;
+  return escribirRegistro(inicio);
+}
+
+bool iniciarDiario() {
+  if (!halMontarArchivos()) return false;
+  if (!halExisteArchivo(DIARIO_DIR)) halCrearDirectorio(DIARIO_DIR);
+  
+  // Rango de segmentos presentes
+  uint32_t primero = 0;
+  uint32_t ultimo = 0;
+  File dir = halAbrirArchivo(DIARIO_DIR, FILE_READ);
+  for (File f = dir.openNextFile(); f; f = dir.openNextFile()) {
+    uint32_t n = strtoul(f.name(), nullptr, 10);
+    if (n == 0) continue;
+    if (primero == 0 || n < primero) primero = n;
+    if (n > ultimo) ultimo = n;
+  }
+  dir.close();
+  
+  // Reconstruir secuencia y confirmaciones recorriendo los registros válidos
+  for (uint32_t seg = primero; seg != 0 && seg <= ultimo; seg++) {
+    char ruta[32];
+    rutaSegmento(ruta, sizeof(ruta), seg);
+    File archivo = halAbrirArchivo(ruta, FILE_READ);
+    if (!archivo) continue;
+    RegistroDiario r;
+    while (leerRegistro(archivo, r)) {
+      if (r.tipo == REGISTRO_INICIO) {
+        if (r.secuencia > diarioSecuencia) diarioSecuencia = r.secuencia;
+        if (r.confirmado > diarioConfirmado) diarioConfirmado = r.confirmado;
+      } else if (r.tipo == REGISTRO_FICHAJE && r.secuencia > diarioSecuencia) {
+        diarioSecuencia = r.secuencia;
+      } else if (r.tipo == REGISTRO_CONFIRMACION && r.secuencia > diarioConfirmado) {
+        diarioConfirmado = r.secuencia;
+      }
+    }
+    archivo.close();
+  }
+  
+  // Los instantes relativos al arranque solo valen para lo escrito desde ahora
+  secuenciaArranque = diarioSecuencia;
+  
+  // Nunca se escribe detrás de una cola posiblemente cortada: segmento nuevo
+  segmentoLectura = (primero != 0) ? primero : ultimo + 1;
+  offsetLectura = 0;
+  if (!abrirSegmento(ultimo + 1)) return false;
+  
+  diarioDisponible = true;
+  pendienteDesdeMs = halMillis() - LOTE_INTERVALO_MS;
+  Serial.print("Diario: ");
+  Serial.print(fichajesPendientes());
+  Serial.print(" fichajes pendientes, secuencia ");
+  Serial.println(diarioSecuencia);
+  return true;
+}
+
+// Los registros anteriores a los lectores múltiples tienen 0 arriba: lector 0
+uint8_t longitudRegistro(const RegistroDiario& r) {
+  return r.longitud & 0x0F;
+}
+
+uint8_t lectorRegistro(const RegistroDiario& r) {
+  return r.longitud >> 4;
+}
+
+uint32_t fichajesPendientes() {
+  return diarioSecuencia - diarioConfirmado;
+}
+
+bool anotarFichaje(const EventoTarjeta& evento, uint32_t& secuencia) {
+  if (!diarioDisponible) return false;
+  
+  // Segmento lleno: rotar, salvo que el diario ya ocupe su máximo
+  if (archivoDiario.size() + sizeof(RegistroDiario) > DIARIO_SEGMENTO_BYTES) {
+    if (segmentoEscritura + 1 - segmentoLectura >= DIARIO_MAX_SEGMENTOS) return false;
+    if (!abrirSegmento(segmentoEscritura + 1)) return false;
+  }
+  
+  // El primer pendiente marca la edad del lote
+  if (fichajesPendientes() == 0) pendienteDesdeMs = halMillis();
+  
+  RegistroDiario r;
+  memset(&r, 0, sizeof(r));
+  r.tipo = REGISTRO_FICHAJE;
+  r.longitud = evento.uid.longitud | (evento.lector << 4);
+  r.secuencia = diarioSecuencia + 1;
+  r.instante = marcarInstante(evento.detectadaMs);
+  memcpy(r.uid, evento.uid.bytes, evento.uid.longitud);
+  if (!escribirRegistro(r)) return false;
+  
+  diarioSecuencia = r.secuencia;
+  secuencia = r.secuencia;
+  return true;
+}
+
+bool confirmarFichaje(uint32_t secuencia) {
+  RegistroDiario r;
+  memset(&r, 0, sizeof(r));
+  r.tipo = REGISTRO_CONFIRMACION;
+  r.secuencia = secuencia;
+  if (!escribirRegistro(r)) return false;
+  diarioConfirmado = secuencia;
+  return true;
+}
+
+int recogerPendientes(RegistroDiario* lote, CursorDiario* finales, int maximo) {
+  // Lee por delante del cursor sin moverlo; finales[i] es la posición tras lote[i]
+  CursorDiario cursor = {segmentoLectura, offsetLectura};
+  File archivo;
+  uint32_t abierto = 0;
+  int cantidad = 0;
+  
+  while (cantidad < maximo) {
+    if (abierto != cursor.segmento) {
+      char ruta[32];
+      rutaSegmento(ruta, sizeof(ruta), cursor.segmento);
+      if (archivo) archivo.close();
+      archivo = halAbrirArchivo(ruta, FILE_READ);
+      if (archivo) archivo.seek(cursor.offset);
+      abierto = cursor.segmento;
+    }
+    
+    RegistroDiario r;
+    if (!archivo || !leerRegistro(archivo, r)) {
+      if (cursor.segmento >= segmentoEscritura) break;
+      cursor.segmento++;
+      cursor.offset = 0;
+      continue;
+    }
+    cursor.offset += sizeof(RegistroDiario);
+    
+    if (r.tipo == REGISTRO_FICHAJE && r.secuencia > diarioConfirmado) {
+      lote[cantidad] = r;
+      finales[cantidad] = cursor;
+      cantidad++;
+    }
+  }
+  
+  if (archivo) archivo.close();
+  return cantidad;
+}
+
+void avanzarLectura(const CursorDiario& hasta) {
+  // Los segmentos que el cursor deja atrás están confirmados por completo
+  while (segmentoLectura < hasta.segmento) {
+    char ruta[32];
+    rutaSegmento(ruta, sizeof(ruta), segmentoLectura);
+    halBorrarArchivo(ruta);
+    segmentoLectura++;
+  }
+  offsetLectura = hasta.offset;
+}
+
+unsigned long esperaHastaSubida() {
+  // ms hasta que toque la siguiente subida, como mucho 1 s
+  if (!diarioDisponible || fichajesPendientes() == 0 || estadoCorte == CORTE_ABIERTO) return 1000;
+  unsigned long ahora = halMillis();
+  if ((long)(ahora - proximaSubidaMs) < 0) {
+    unsigned long resto = proximaSubidaMs - ahora;
+    return resto < 1000 ? resto : 1000;
+  }
+  if (fichajesPendientes() >= LOTE_MAX_FICHAJES) return 0;
+  unsigned long edad = ahora - pendienteDesdeMs;
+  if (edad >= LOTE_INTERVALO_MS) return 0;
+  unsigned long resto = LOTE_INTERVALO_MS - edad;
+  return resto < 1000 ? resto : 1000;
+}
+
+bool subirDiario() {
+  // Reenvía en orden los fichajes aún no confirmados; false si el backend falla
+  if (!diarioDisponible || fichajesPendientes() == 0) return true;
+  if ((long)(halMillis() - proximaSubidaMs) < 0) return false;
+  // Con el corte abierto el lote solo ocuparía la tarea de red hasta su timeout
+  if (!halRedConectada() || estadoCorte == CORTE_ABIERTO) return false;
+  
+  // Se sube cuando el lote está lleno o el pendiente más antiguo cumple el intervalo
+  if (fichajesPendientes() < LOTE_MAX_FICHAJES && halMillis() - pendienteDesdeMs < LOTE_INTERVALO_MS) return true;
+  
+  RegistroDiario lote[LOTE_MAX_FICHAJES];
+  CursorDiario finales[LOTE_MAX_FICHAJES];
+  int cantidad = recogerPendientes(lote, finales, LOTE_MAX_FICHAJES);
+  
+  if (cantidad == 0) {
+    // Secuencias sin registro legible (segmento dañado): no se pueden reenviar
+    Serial.print("Diario: ");
+    Serial.print(fichajesPendientes());
+    Serial.println(" fichajes ilegibles descartados");
+    confirmarFichaje(diarioSecuencia);
+    return true;
+  }
+  
+  int aceptados = loteDisponible ? enviarLote(lote, cantidad) : enviarIndividual(lote, cantidad);
+  
+  // Las confirmaciones son acumulativas: solo avanza el prefijo aceptado
+  if (aceptados > 0) {
+    if (!confirmarFichaje(lote[aceptados - 1].secuencia)) return false;
+    avanzarLectura(finales[aceptados - 1]);
+    fichajesSubidos += aceptados;
+  }
+  
+  Serial.print("Diario: ");
+  Serial.print(aceptados);
+  Serial.print("/");
+  Serial.print(cantidad);
+  Serial.print(" fichajes subidos, ");
+  Serial.print(fichajesPendientes());
+  Serial.print(" pendientes, ");
+  Serial.print(fichajesSubidos > 0 ? (float)peticionesSubida / fichajesSubidos : 0.0f, 2);
+  Serial.println(" peticiones por fichaje");
+  
+  if (aceptados < cantidad && peticionCedida) {
+    // Se dejó por una tarjeta: sigue en cuanto esté atendida, sin espera
+    Serial.println("Subida del diario cedida a una tarjeta");
+    return false;
+  }
+  if (aceptados < cantidad) {
+    // Espera exponencial mientras el backend no acepta el resto
+    Serial.print("Subida del diario incompleta, reintento en ");
+    Serial.print(esperaSubidaMs);
+    Serial.println(" ms");
+    proximaSubidaMs = halMillis() + esperaSubidaMs;
+    esperaSubidaMs = esperaSubidaMs * 2 > REINTENTO_SUBIDA_MAX_MS ? REINTENTO_SUBIDA_MAX_MS : esperaSubidaMs * 2;
+    return false;
+  }
+  
+  esperaSubidaMs = REINTENTO_SUBIDA_MIN_MS;
+  return true;
+}
+
+int enviarLote(const RegistroDiario* lote, int cantidad) {
+  // Devuelve cuántos fichajes consecutivos desde el primero aceptó el backend
+  uint8_t carga[48 + LOTE_MAX_FICHAJES * 100];
+  int httpCode = -1;
+  
+  if (formatoBinario) {
+    // [ip, [[uid, secuencia, instante o nil], ...]]; con varios lectores, lector al final
+    EscritorMsgPack mp(carga, sizeof(carga));
+    mp.array(2);
+    mp.binario(ipLocalBytes, 4);
+    mp.array(cantidad);
+    for (int i = 0; i < cantidad; i++) {
+      uint32_t instante = instanteUnix(lote[i].instante, lote[i].secuencia > secuenciaArranque);
+      mp.array(NUM_LECTORES > 1 ? 4 : 3);
+      mp.binario(lote[i].uid, longitudRegistro(lote[i]));
+      mp.entero(lote[i].secuencia);
+      if (instante > 0) {
+        mp.entero(instante);
+      } else {
+        mp.nulo();
+      }
+      if (NUM_LECTORES > 1) mp.entero(lectorRegistro(lote[i]));
+    }
+    size_t largo = mp.terminar();
+    if (largo == 0) return 0;
+    httpCode = peticionBackend("POST", rutaFichajeLote, TIPO_MSGPACK, carga, largo, FONDO_TIMEOUT_MS);
+    peticionesSubida++;
+    if (httpCode == HTTP_FORMATO_NO_ACEPTADO) {
+      finalizarPeticionBackend();
+      rechazaBinario(httpCode);
+    }
+  }
+  
+  if (!formatoBinario) {
+    char* json = (char*)carga;
+    size_t largo = snprintf(json, sizeof(carga), "{\"ip\":\"%s\",\"fichajes\":[", ipLocal);
+    for (int i = 0; i < cantidad; i++) {
+      Uid uid;
+      uid.asignar(lote[i].uid, longitudRegistro(lote[i]));
+      char uidHex[UID_HEX_MAX];
+      uid.aHex(uidHex);
+      largo += snprintf(json + largo, sizeof(carga) - largo, "%s{\"codigoRFID\":\"%s\",\"secuencia\":%lu",
+                        i > 0 ? "," : "", uidHex, (unsigned long)lote[i].secuencia);
+      uint32_t instante = instanteUnix(lote[i].instante, lote[i].secuencia > secuenciaArranque);
+      if (instante > 0 && largo < sizeof(carga)) {
+        largo += snprintf(json + largo, sizeof(carga) - largo, ",\"instante\":%lu", (unsigned long)instante);
+      }
+      if (NUM_LECTORES > 1 && largo < sizeof(carga)) {
+        largo += snprintf(json + largo, sizeof(carga) - largo, ",\"lector\":%u", lectorRegistro(lote[i]));
+      }
+      if (largo < sizeof(carga)) largo += snprintf(json + largo, sizeof(carga) - largo, "}");
+      if (largo >= sizeof(carga)) return 0;
+    }
+    largo += snprintf(json + largo, sizeof(carga) - largo, "]}");
+    if (largo >= sizeof(carga)) return 0;
+    
+    httpCode = peticionBackend("POST", rutaFichajeLote, TIPO_JSON, carga, largo, FONDO_TIMEOUT_MS);
+    peticionesSubida++;
+  }
+  
+  if (httpCode == 404 || httpCode == 405) {
+    finalizarPeticionBackend();
+    Serial.println("Backend sin endpoint de lotes, se sube fichaje a fichaje");
+    loteDisponible = false;
+    return enviarIndividual(lote, cantidad);
+  }
+  if (httpCode != 200) {
+    finalizarPeticionBackend();
+    return 0;
+  }
+  
+  // {"resultados":[{"secuencia":N,"ok":true}, ...]}, en JSON o MessagePack
+  StaticJsonDocument<JSON_ARRAY_SIZE(LOTE_MAX_FICHAJES) + LOTE_MAX_FICHAJES * JSON_OBJECT_SIZE(2) + 64> doc;
+  DeserializationError error = respuestaBinaria ? deserializeMsgPack(doc, cuerpoRespuesta)
+                                                : deserializeJson(doc, cuerpoRespuesta);
+  finalizarPeticionBackend();
+  if (error) return 0;
+  
+  bool aceptado[LOTE_MAX_FICHAJES] = {false};
+  for (JsonVariant item : doc["resultados"].as<JsonArray>()) {
+    // Las secuencias pendientes son consecutivas, así que el índice es directo
+    uint32_t secuencia = item["secuencia"];
+    uint32_t indice = secuencia - lote[0].secuencia;
+    if (secuencia >= lote[0].secuencia && indice < (uint32_t)cantidad) {
+      aceptado[indice] = item["ok"];
+    }
+  }
+  
+  int aceptados = 0;
+  while (aceptados < cantidad && aceptado[aceptados]) aceptados++;
+  return aceptados;
+}
+
+int enviarIndividual(const RegistroDiario* lote, int cantidad) {
+  int aceptados = 0;
+  while (aceptados < cantidad) {
+    peticionesSubida++;
+    Uid uid;
+    uid.asignar(lote[aceptados].uid, longitudRegistro(lote[aceptados]));
+    uint32_t instante = instanteUnix(lote[aceptados].instante, lote[aceptados].secuencia > secuenciaArranque);
+    if (!registrarFichaje(uid, lote[aceptados].secuencia, instante, lectorRegistro(lote[aceptados]))) break;
+    aceptados++;
+    // Una tarjeta nueva pasa delante; el resto sale en la próxima subida
+    if (tarjetasEnCola() > 0) break;
+  }
+  return aceptados;
+}
+
+// ==================== LISTA BLANCA LOCAL ====================
+
+uint32_t hashEntradaLista(const EntradaLista& e) {
+  // FNV-1a de 32 bits sobre la entrada completa (longitud + UID rellenado)
+  const uint8_t* p = (const uint8_t*)&e;
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < sizeof(EntradaLista); i++) {
+    h ^= p[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+bool bloomPuedeContener(const uint8_t* bloom, const EntradaLista& e) {
+  // Doble hash: bit_i = h1 + i * h2 (el backend genera el filtro igual)
+  uint32_t h1 = hashEntradaLista(e);
+  uint32_t h2 = ((h1 >> 17) | (h1 << 15)) | 1;
+  for (uint32_t i = 0; i < LISTA_BLOOM_HASHES; i++) {
+    uint32_t bit = (h1 + i * h2) % (LISTA_BLOOM_BYTES * 8);
+    if (!(bloom[bit >> 3] & (1 << (bit & 7)))) return false;
+  }
+  return true;
+}
+
+bool listaValida(size_t tamanoParticion, const CabeceraLista* cab) {
+  if (cab->magic != LISTA_MAGIC) return false;
+  size_t tamano = sizeof(CabeceraLista) + (size_t)cab->cantidad * sizeof(EntradaLista);
+  if (tamano > tamanoParticion) return false;
+  // El bloom es el último campo de la cabecera, así que bloom + entradas son contiguos
+  uint32_t crc = esp_crc32_le(0, cab->bloom, LISTA_BLOOM_BYTES + cab->cantidad * sizeof(EntradaLista));
+  return crc == cab->crc;
+}
+
+void cargarListaBlanca() {
+  listaActiva = -1;
+  
+  for (int i = 0; i < 2; i++) {
+    // El mapeo se mantiene toda la vida del programa
+    mapasLista[i] = (const CabeceraLista*)halMapearLista(i, tamanosLista[i]);
+    if (!mapasLista[i]) continue;
+    
+    if (listaValida(tamanosLista[i], mapasLista[i]) &&
+        (listaActiva < 0 || mapasLista[i]->version > mapasLista[listaActiva]->version)) {
+      listaActiva = i;
+    }
+  }
+  
+  if (listaActiva >= 0) {
+    Serial.print("Lista blanca v");
+    Serial.print(mapasLista[listaActiva]->version);
+    Serial.print(" cargada: ");
+    Serial.print(mapasLista[listaActiva]->cantidad);
+    Serial.println(" tarjetas");
+  } else {
+    Serial.println("Sin lista blanca local, se verificara contra el backend");
+  }
+}
+
+int consultarListaBlanca(const byte* uid, byte longitud) {
+  int activa = listaActiva;
+  if (activa < 0 || longitud == 0 || longitud > LISTA_UID_MAX) return LISTA_NO_DISPONIBLE;
+  
+  const CabeceraLista* cab = mapasLista[activa];
+  EntradaLista clave;
+  memset(&clave, 0, sizeof(clave));
+  clave.longitud = longitud;
+  memcpy(clave.uid, uid, longitud);
+  
+  // La mayoría de tarjetas ajenas se descartan aquí sin tocar la tabla
+  if (!bloomPuedeContener(cab->bloom, clave)) return LISTA_DESCONOCIDA;
+  
+  // Búsqueda binaria directamente sobre la flash mapeada
+  const EntradaLista* entradas = (const EntradaLista*)(cab + 1);
+  uint32_t bajo = 0;
+  uint32_t alto = cab->cantidad;
+  while (bajo < alto) {
+    uint32_t medio = bajo + (alto - bajo) / 2;
+    int cmp = memcmp(&entradas[medio], &clave, sizeof(EntradaLista));
+    if (cmp == 0) return LISTA_VALIDA;
+    if (cmp < 0) {
+      bajo = medio + 1;
+    } else {
+      alto = medio;
+    }
+  }
+  return LISTA_DESCONOCIDA;
+}
+
+bool instalarListaBlanca(Stream& origen) {
+  // Siempre se escribe en la partición inactiva; la activa sigue sirviendo consultas
+  int destino = (listaActiva == 0) ? 1 : 0;
+  if (!mapasLista[destino]) return false;
+  
+  CabeceraLista cab;
+  if (origen.readBytes((char*)&cab, sizeof(cab)) != sizeof(cab)) return false;
+  if (cab.magic != LISTA_MAGIC) return false;
+  size_t tamano = sizeof(cab) + (size_t)cab.cantidad * sizeof(EntradaLista);
+  if (tamano > tamanosLista[destino]) return false;
+  if (!halBorrarLista(destino, tamano)) return false;
+  
+  // Primero las entradas; la cabecera con el magic va al final, así una
+  // escritura interrumpida deja la partición inválida y no a medias
+  EntradaLista bloque[23];
+  EntradaLista anterior;
+  memset(&anterior, 0, sizeof(anterior));
+  uint32_t crc = esp_crc32_le(0, cab.bloom, LISTA_BLOOM_BYTES);
+  size_t offset = sizeof(cab);
+  uint32_t restantes = cab.cantidad;
+  
+  while (restantes > 0) {
+    uint32_t n = restantes < 23 ? restantes : 23;
+    size_t bytes = n * sizeof(EntradaLista);
+    if (origen.readBytes((char*)bloque, bytes) != bytes) return false;
+    
+    // La búsqueda binaria exige orden estricto
+    for (uint32_t i = 0; i < n; i++) {
+      if (memcmp(&bloque[i], &anterior, sizeof(EntradaLista)) <= 0) return false;
+      anterior = bloque[i];
+    }
+    
+    crc = esp_crc32_le(crc, (const uint8_t*)bloque, bytes);
+    if (!halEscribirLista(destino, offset, bloque, bytes)) return false;
+    offset += bytes;
+    restantes -= n;
+  }
+  
+  if (crc != cab.crc) return false;
+  if (!halEscribirLista(destino, 0, &cab, sizeof(cab))) return false;
+  if (!listaValida(tamanosLista[destino], mapasLista[destino])) return false;
+  
+  listaActiva = destino;
+  Serial.print("Lista blanca v");
+  Serial.print(cab.version);
+  Serial.print(" instalada: ");
+  Serial.print(cab.cantidad);
+  Serial.println(" tarjetas");
+  return true;
+}
+
+bool actualizarListaBlanca() {
+  // Con el corte abierto la descarga esperaría en balde: la prueba del corte
+  // dice cuándo vuelve el backend
+  if (!halRedConectada() || estadoCorte == CORTE_ABIERTO) return false;
+  
+  char ruta[64];
+  snprintf(ruta, sizeof(ruta), "%s?version=%lu", rutaListaBlanca, (unsigned long)versionListaLocal());
+  
+  // 304 si la versión local ya es la última
+  int httpCode = peticionBackend("GET", ruta, nullptr, nullptr, 0, FONDO_TIMEOUT_MS);
+  bool instalada = false;
+  if (httpCode == 200) {
+    instalada = instalarListaBlanca(cuerpoRespuesta);
+    if (!instalada) Serial.println("Lista blanca descargada invalida, se conserva la actual");
+    sincronizacionesCompletas++;
+    bytesCompletas += cuerpoRespuesta.leidos();
+  }
+  if (httpCode == 304 || instalada) listaConfirmadaMs = halMillis();
+  
+  finalizarPeticionBackend();
+  return instalada;
+}
+
+uint32_t versionListaLocal() {
+  int activa = listaActiva;
+  return (activa >= 0) ? mapasLista[activa]->version : 0;
+}
+
+bool listaAlDia() {
+  // El long-poll sigue abierto y el backend confirmó la versión hace poco
+  return estadoSuscripcion == SUSCRIPCION_ESPERANDO && listaConfirmadaMs != 0 &&
+         halMillis() - listaConfirmadaMs < LISTA_VIGENCIA_MS;
+}
+
+void bloomAgregar(uint8_t* bloom, const EntradaLista& e) {
+  // Mismos bits que bloomPuedeContener
+  uint32_t h1 = hashEntradaLista(e);
+  uint32_t h2 = ((h1 >> 17) | (h1 << 15)) | 1;
+  for (uint32_t i = 0; i < LISTA_BLOOM_HASHES; i++) {
+    uint32_t bit = (h1 + i * h2) % (LISTA_BLOOM_BYTES * 8);
+    bloom[bit >> 3] |= 1 << (bit & 7);
+  }
+}
+
+// e entra con la operación anterior (de ahí salen los bytes comunes) y sale con la nueva
+bool leerOperacionDelta(Stream& origen, EntradaLista& e, bool& baja, uint32_t& crc, uint32_t& bytes) {
+  uint8_t control;
+  if (origen.readBytes((char*)&control, 1) != 1) return false;
+  baja = (control & 0x80) != 0;
+  uint8_t comun = (control >> 4) & 0x07;
+  uint8_t longitud = control & 0x0F;
+  if (longitud == 0 || longitud > LISTA_UID_MAX || comun > longitud) return false;
+  if (comun > 0 && longitud != e.longitud) return false;
+  
+  uint8_t resto = longitud - comun;
+  if (origen.readBytes((char*)e.uid + comun, resto) != resto) return false;
+  memset(e.uid + longitud, 0, LISTA_UID_MAX - longitud);
+  e.longitud = longitud;
+  crc = esp_crc32_le(crc, &control, 1);
+  crc = esp_crc32_le(crc, e.uid + comun, resto);
+  bytes += 1 + resto;
+  return true;
+}
+
+size_t codificarOperacionDelta(uint8_t* destino, const EntradaLista& anterior, const EntradaLista& e, bool baja) {
+  uint8_t comun = 0;
+  if (anterior.longitud == e.longitud) {
+    while (comun < 7 && comun < e.longitud - 1 && anterior.uid[comun] == e.uid[comun]) comun++;
+  }
+  destino[0] = (baja ? 0x80 : 0) | (comun << 4) | e.longitud;
+  memcpy(destino + 1, e.uid + comun, e.longitud - comun);
+  return 1 + e.longitud - comun;
+}
+
+bool aplicarDeltaLista(Stream& origen) {
+  CabeceraDelta delta;
+  if (origen.readBytes((char*)&delta, sizeof(delta)) != sizeof(delta)) return false;
+  if (delta.magic != LISTA_MAGIC_DELTA) return false;
+  
+  // Solo vale sobre la versión exacta que hay en flash
+  int activa = listaActiva;
+  const CabeceraLista* base = (activa >= 0) ? mapasLista[activa] : nullptr;
+  uint32_t cantidadBase = base ? base->cantidad : 0;
+  if (delta.versionBase != versionListaLocal() || delta.version <= delta.versionBase) return false;
+  
+  // Como la descarga completa: se escribe la partición inactiva y la cabecera al final
+  int destino = (activa == 0) ? 1 : 0;
+  if (!mapasLista[destino]) return false;
+  size_t tamano = sizeof(CabeceraLista) + (size_t)(cantidadBase + delta.altas) * sizeof(EntradaLista);
+  if (tamano > tamanosLista[destino]) return false;
+  if (!halBorrarLista(destino, tamano)) return false;
+  
+  CabeceraLista cab;
+  cab.magic = LISTA_MAGIC;
+  cab.version = delta.version;
+  if (base) {
+    memcpy(cab.bloom, base->bloom, LISTA_BLOOM_BYTES);
+  } else {
+    memset(cab.bloom, 0, LISTA_BLOOM_BYTES);
+  }
+  
+  // Fusión en un solo recorrido: lista y operaciones van en el mismo orden,
+  // así que ninguna de las dos tiene que caber en memoria
+  const EntradaLista* entradas = base ? (const EntradaLista*)(base + 1) : nullptr;
+  uint32_t siguiente = 0;
+  EntradaLista bloque[23];
+  uint32_t enBloque = 0;
+  uint32_t cantidad = 0;
+  size_t offset = sizeof(CabeceraLista);
+  EntradaLista op;
+  EntradaLista anterior;
+  memset(&op, 0, sizeof(op));
+  uint32_t crc = 0;
+  uint32_t bytes = 0;
+  uint32_t altas = 0;
+  
+  for (uint32_t n = 0; n <= delta.operaciones; n++) {
+    bool ultima = (n == delta.operaciones);
+    bool baja = false;
+    if (!ultima) {
+      anterior = op;
+      if (!leerOperacionDelta(origen, op, baja, crc, bytes)) return false;
+      if (n > 0 && memcmp(&op, &anterior, sizeof(EntradaLista)) <= 0) return false;
+    }
+    
+    // Lo que va antes de la operación (o todo lo que queda) se copia tal cual
+    while (siguiente < cantidadBase &&
+           (ultima || memcmp(&entradas[siguiente], &op, sizeof(EntradaLista)) < 0)) {
+      bloque[enBloque++] = entradas[siguiente++];
+      if (enBloque == 23 || siguiente == cantidadBase) {
+        if (!halEscribirLista(destino, offset, bloque, enBloque * sizeof(EntradaLista))) return false;
+        offset += enBloque * sizeof(EntradaLista);
+        cantidad += enBloque;
+        enBloque = 0;
+      }
+    }
+    if (ultima) break;
+    
+    // Alta de algo que ya está o baja de algo que no: las versiones divergen
+    bool existe = siguiente < cantidadBase && memcmp(&entradas[siguiente], &op, sizeof(EntradaLista)) == 0;
+    if (existe != baja) return false;
+    if (baja) {
+      siguiente++;
+      continue;
+    }
+    bloomAgregar(cab.bloom, op);
+    altas++;
+    bloque[enBloque++] = op;
+    if (enBloque == 23) {
+      if (!halEscribirLista(destino, offset, bloque, enBloque * sizeof(EntradaLista))) return false;
+      offset += enBloque * sizeof(EntradaLista);
+      cantidad += enBloque;
+      enBloque = 0;
+    }
+  }
+  if (enBloque > 0) {
+    if (!halEscribirLista(destino, offset, bloque, enBloque * sizeof(EntradaLista))) return false;
+    cantidad += enBloque;
+  }
+  if (crc != delta.crc || bytes != delta.bytes || altas != delta.altas) return false;
+  
+  // Las bajas dejan sus bits en el bloom: solo cuesta alguna búsqueda binaria de más.
+  // El CRC se calcula sobre lo que quedó en flash, que así queda comprobado
+  cab.cantidad = cantidad;
+  cab.crc = esp_crc32_le(esp_crc32_le(0, cab.bloom, LISTA_BLOOM_BYTES),
+                         (const uint8_t*)(mapasLista[destino] + 1), cantidad * sizeof(EntradaLista));
+  if (!halEscribirLista(destino, 0, &cab, sizeof(cab))) return false;
+  if (!listaValida(tamanosLista[destino], mapasLista[destino])) return false;
+  
+  listaActiva = destino;
+  Serial.print("Lista blanca v");
+  Serial.print(delta.versionBase);
+  Serial.print(" -> v");
+  Serial.print(delta.version);
+  Serial.print(" por delta: +");
+  Serial.print(altas);
+  Serial.print(" -");
+  Serial.print(delta.operaciones - altas);
+  Serial.print(", ");
+  Serial.print(cantidad);
+  Serial.println(" tarjetas");
+  return true;
+}
+
+// ==================== SUSCRIPCION A LA LISTA BLANCA ====================
+
+// Tarea de red: abre el long-poll, y cuando el backend contesta aplica el
+// delta y vuelve a abrirlo. Mientras espera no bloquea nada
+void atenderSuscripcionLista() {
+  if (!suscripcionDisponible) return;
+  Client& cliente = BANCO_PRUEBAS ? (Client&)clienteCambiosSimulado : halSocket(SOCKET_CAMBIOS);
+  
+  if (!halRedConectada()) {
+    if (estadoSuscripcion == SUSCRIPCION_ESPERANDO) cliente.stop();
+    estadoSuscripcion = SUSCRIPCION_INACTIVA;
+    return;
+  }
+  
+  if (estadoSuscripcion == SUSCRIPCION_INACTIVA) {
+    if ((long)(halMillis() - proximaSuscripcionMs) >= 0) abrirSuscripcionLista();
+    return;
+  }
+  
+  // El backend simulado "retiene" la respuesta igual que el real
+  bool lista = BANCO_PRUEBAS ? halMillis() - suscripcionDesdeMs >= BANCO_LISTA_INTERVALO_MS
+                             : cliente.available() > 0;
+  if (lista) {
+    procesarCambiosLista();
+  } else if (!cliente.connected() || halMillis() - suscripcionDesdeMs > LISTA_ESPERA_S * 1000UL + 10000) {
+    // Conexión caída o el backend no contesta ni al agotar su espera
+    cliente.stop();
+    estadoSuscripcion = SUSCRIPCION_INACTIVA;
+    proximaSuscripcionMs = halMillis() + REINTENTO_SUSCRIPCION_MS;
+  }
+}
+
+void abrirSuscripcionLista() {
+  uint32_t version = versionListaLocal();
+  suscripcionDesdeMs = halMillis();
+  proximaSuscripcionMs = halMillis() + REINTENTO_SUSCRIPCION_MS;
+  
+  if (BANCO_PRUEBAS) {
+    cambiosSimulados(version);
+    estadoSuscripcion = SUSCRIPCION_ESPERANDO;
+    return;
+  }
+  
+  // Socket propio: el del backend sigue libre para las tarjetas
+  Client& socket = halSocket(SOCKET_CAMBIOS);
+  if (!socket.connected()) {
+    socket.stop();
+    if (!halConectarSocket(SOCKET_CAMBIOS, 2000)) return;
+  }
+  char peticion[256];
+  int largo = snprintf(peticion, sizeof(peticion), "GET %s?version=%lu&espera=%d HTTP/1.1\r\n%s\r\n",
+                       rutaCambiosLista, (unsigned long)version, LISTA_ESPERA_S, cabecerasComunes);
+  if (largo >= (int)sizeof(peticion) ||
+      socket.write((const uint8_t*)peticion, largo) != (size_t)largo) {
+    socket.stop();
+    return;
+  }
+  estadoSuscripcion = SUSCRIPCION_ESPERANDO;
+}
+
+void procesarCambiosLista() {
+  Client& cliente = BANCO_PRUEBAS ? (Client&)clienteCambiosSimulado : halSocket(SOCKET_CAMBIOS);
+  estadoSuscripcion = SUSCRIPCION_INACTIVA;
+  proximaSuscripcionMs = halMillis() + REINTENTO_SUSCRIPCION_MS;
+  
+  // Ya hay bytes: el resto de la respuesta llega enseguida
+  unsigned long hasta = halMillis() + FONDO_TIMEOUT_MS;
+  CabecerasHTTP c;
+  if (!leerCabecerasHTTP(cliente, hasta, false, c)) {
+    cliente.stop();
+    return;
+  }
+  cuerpoCambios.iniciar(&cliente, c.longitud, c.chunked, hasta);
+  
+  bool completa = false;
+  if (c.codigo == 304) {
+    // Se agotó la espera sin cambios: la versión local sigue siendo la última
+    listaConfirmadaMs = halMillis();
+    proximaSuscripcionMs = halMillis();
+  } else if (c.codigo == 200) {
+    Cronometro aplicar;
+    aplicar.iniciar();
+    if (aplicarDeltaLista(cuerpoCambios)) {
+      uint32_t us = aplicar.transcurridoUs();
+      anotarLatencia(ETAPA_DELTA_LISTA, us);
+      sincronizacionesDelta++;
+      bytesDelta += cuerpoCambios.leidos();
+      listaConfirmadaMs = halMillis();
+      proximaSuscripcionMs = halMillis();
+      Serial.print("Delta de lista: ");
+      Serial.print(cuerpoCambios.leidos());
+      Serial.print(" bytes, aplicado en ");
+      Serial.print(us);
+      Serial.println(" us");
+    } else {
+      Serial.println("Delta de lista no aplicable, se pide la lista completa");
+      completa = true;
+    }
+  } else if (c.codigo == 409) {
+    // El backend ya no guarda cambios desde nuestra versión
+    completa = true;
+  } else if (c.codigo == 404 || c.codigo == 405) {
+    Serial.println("Backend sin suscripcion a la lista, se consulta periodicamente");
+    suscripcionDisponible = false;
+  }
+  
+  cuerpoCambios.descartar();
+  if (c.cerrar || cuerpoCambios.error()) cliente.stop();
+  
+  // Si tampoco llega la completa se espera antes de volver a suscribirse
+  if (completa && actualizarListaBlanca()) proximaSuscripcionMs = halMillis();
+}
+
+// ==================== CONEXION BACKEND ====================
+
+int leerLineaHTTP(Client& cliente, char* buffer, size_t maximo, unsigned long hasta) {
+  // Lee hasta '\n' descartando '\r'; las líneas demasiado largas se truncan
+  size_t n = 0;
+  while (true) {
+    while (!cliente.available()) {
+      if (!cliente.connected() || (long)(halMillis() - hasta) >= 0 || cederPeticion()) return -1;
+      halEsperar(1);
+    }
+    int c = cliente.read();
+    if (c == '\n') break;
+    if (c != '\r' && n + 1 < maximo) buffer[n++] = (char)c;
+  }
+  buffer[n] = '\0';
+  return (int)n;
+}
+
+void CuerpoHTTP::iniciar(Client* cliente, long longitud, bool chunked, unsigned long hasta) {
+  _cliente = cliente;
+  _chunked = chunked;
+  _enChunk = false;
+  _restante = chunked ? 0 : longitud;
+  _fin = false;
+  _error = false;
+  _hasta = hasta;
+  _leidos = 0;
+  // read() ya espera hasta el plazo de la petición; readBytes no debe esperar más
+  setTimeout(0);
+}
+
+bool CuerpoHTTP::esperarDatos() {
+  while (!_cliente->available()) {
+    if (!_cliente->connected() || (long)(halMillis() - _hasta) >= 0 || cederPeticion()) return false;
+    halEsperar(1);
+  }
+  return true;
+}
+
+// Fuera del plazo de una tarjeta, la espera de una respuesta se abandona en
+// cuanto hay una en cola: la petición de fondo se repite después y la tarjeta
+// no espera a que termine
+bool cederPeticion() {
+  if (plazoActivo || tarjetasEnCola() == 0) return false;
+  if (!peticionCedida) peticionesCedidas++;
+  peticionCedida = true;
+  return true;
+}
+
+bool CuerpoHTTP::prepararDatos() {
+  // true si hay bytes del cuerpo pendientes de leer
+  if (_fin) return false;
+  if (_restante != 0) return true;
+  if (!_chunked) {
+    _fin = true;
+    return false;
+  }
+  
+  // Cabecera de chunk: "<tamaño hex>[;ext]"; el anterior termina en CRLF
+  char linea[24];
+  if (_enChunk && leerLineaHTTP(*_cliente, linea, sizeof(linea), _hasta) < 0) {
+    _error = _fin = true;
+    return false;
+  }
+  if (leerLineaHTTP(*_cliente, linea, sizeof(linea), _hasta) < 0) {
+    _error = _fin = true;
+    return false;
+  }
+  _enChunk = true;
+  _restante = strtol(linea, nullptr, 16);
+  if (_restante > 0) return true;
+  
+  // Último chunk: saltar trailers hasta la línea vacía
+  while (true) {
+    int n = leerLineaHTTP(*_cliente, linea, sizeof(linea), _hasta);
+    if (n < 0) _error = true;
+    if (n <= 0) break;
+  }
+  _fin = true;
+  return false;
+}
+
+int CuerpoHTTP::available() {
+  if (_fin || (_chunked && _restante == 0)) return 0;
+  int n = _cliente->available();
+  if (_restante > 0 && n > _restante) n = _restante;
+  return n;
+}
+
+int CuerpoHTTP::read() {
+  if (!prepararDatos()) return -1;
+  if (!esperarDatos()) {
+    // Sin longitud conocida el cierre del servidor marca el final del cuerpo
+    _error = (_restante >= 0) || _cliente->connected();
+    _fin = true;
+    return -1;
+  }
+  if (_restante > 0) _restante--;
+  _leidos++;
+  return _cliente->read();
+}
+
+int CuerpoHTTP::peek() {
+  if (!prepararDatos() || !esperarDatos()) return -1;
+  return _cliente->peek();
+}
+
+void CuerpoHTTP::descartar() {
+  while (read() >= 0) {}
+}
+
+// -1 sin conexión, 0 conexión nueva, 1 conexión reutilizada
+int abrirConexionBackend(uint32_t timeoutMs) {
+  Client& socket = halSocket(SOCKET_PETICIONES);
+  // Un socket inactivo demasiado tiempo probablemente ya lo cerró el servidor
+  if (socket.connected() && halMillis() - ultimoUsoBackend > BACKEND_INACTIVIDAD_MS) {
+    socket.stop();
+  }
+  
+  // Bytes pendientes fuera de una respuesta: el flujo está desincronizado
+  if (socket.connected() && socket.available()) {
+    socket.stop();
+  }
+  
+  if (socket.connected()) return 1;
+  
+  socket.stop();
+  if (!halConectarSocket(SOCKET_PETICIONES, timeoutMs)) return -1;
+  reconexionesBackend++;
+  return 0;
+}
+
+int peticionBackend(const char* metodo, const char* ruta, const char* tipoContenido, const uint8_t* cuerpo, size_t longitudCuerpo, uint32_t timeoutMs) {
+  finalizarPeticionBackend();
+  ultimaPeticionFallida = true;
+  peticionCedida = false;
+  
+  // Dentro de una tarjeta el timeout nunca pasa de lo que queda de su plazo
+  timeoutMs = plazoPeticion(timeoutMs);
+  if (timeoutMs == 0) return -1;
+  
+  // Sin WiFi no se sabe nada del backend: no cuenta para el corte
+  if (!BANCO_PRUEBAS && !halRedConectada()) return -1;
+  
+  int codigo = BANCO_PRUEBAS ? peticionSimulada(ruta, tipoContenido, cuerpo, longitudCuerpo, timeoutMs)
+                             : enviarPeticionBackend(metodo, ruta, tipoContenido, cuerpo, longitudCuerpo, timeoutMs);
+  // Cedida a una tarjeta no dice nada del backend: no cuenta para el corte
+  if (!peticionCedida) anotarRespuestaBackend(codigo);
+  return codigo;
+}
+
+int enviarPeticionBackend(const char* metodo, const char* ruta, const char* tipoContenido, const uint8_t* cuerpo, size_t longitudCuerpo, uint32_t timeoutMs) {
+  Client& socket = halSocket(SOCKET_PETICIONES);
+  char cabeceras[320];
+  int largo = snprintf(cabeceras, sizeof(cabeceras), "%s %s HTTP/1.1\r\n%s", metodo, ruta, cabecerasComunes);
+  if (tipoContenido != nullptr) {
+    largo += snprintf(cabeceras + largo, sizeof(cabeceras) - largo,
+      "Content-Type: %s\r\nContent-Length: %u\r\n", tipoContenido, (unsigned)longitudCuerpo);
+  }
+  if (formatoBinario) {
+    largo += snprintf(cabeceras + largo, sizeof(cabeceras) - largo, "Accept: " TIPO_MSGPACK ", " TIPO_JSON "\r\n");
+  }
+  largo += snprintf(cabeceras + largo, sizeof(cabeceras) - largo, "\r\n");
+  if (largo >= (int)sizeof(cabeceras)) return -1;
+  
+  // Si un socket reutilizado resulta estar medio abierto se reintenta una vez en
+  // limpio, con lo que quede del mismo timeout: el reintento no lo duplica
+  unsigned long limite = halMillis() + timeoutMs;
+  for (int intento = 0; intento < 2; intento++) {
+    if (intento > 0) {
+      long restante = (long)(limite - halMillis());
+      timeoutMs = restante > 0 ? plazoPeticion(restante) : 0;
+    }
+    if (timeoutMs == 0) return -1;
+    unsigned long hasta = halMillis() + timeoutMs;
+    int conexion = abrirConexionBackend(plazoActivo || timeoutMs < FONDO_CONEXION_MS ? timeoutMs : FONDO_CONEXION_MS);
+    if (conexion < 0) return -1;
+    bool reutilizada = (conexion == 1);
+    
+    bool enviado = socket.write((const uint8_t*)cabeceras, largo) == (size_t)largo;
+    if (enviado && longitudCuerpo > 0) {
+      enviado = socket.write(cuerpo, longitudCuerpo) == longitudCuerpo;
+    }
+    
+    CabecerasHTTP c;
+    if (!enviado || !leerCabecerasHTTP(socket, hasta, strcmp(metodo, "HEAD") == 0, c)) {
+      socket.stop();
+      if (reutilizada && !peticionCedida) continue;
+      return -1;
+    }
+    
+    cuerpoRespuesta.iniciar(&socket, c.longitud, c.chunked, hasta);
+    peticionEnCurso = true;
+    cerrarTrasPeticion = c.cerrar;
+    respuestaBinaria = c.binaria;
+    ultimaPeticionReutilizada = reutilizada;
+    peticionesBackend++;
+    if (reutilizada) reutilizacionesBackend++;
+    return c.codigo;
+  }
+  return -1;
+}
+
+// Timeout de una petición: dentro de una tarjeta, lo que quede del plazo, y 0
+// (no se envía) si queda menos de PLAZO_MIN_PETICION_MS o el corte está abierto
+uint32_t plazoPeticion(uint32_t timeoutMs) {
+  if (!plazoActivo) return timeoutMs;
+  int32_t restante = plazoHastaMs - halMillis();
+  if (estadoCorte == CORTE_ABIERTO || restante < PLAZO_MIN_PETICION_MS) {
+    peticionesCanceladas++;
+    return 0;
+  }
+  return (uint32_t)restante < timeoutMs ? restante : timeoutMs;
+}
+
+// Cualquier respuesta del backend, aunque sea un 4xx, dice que está vivo
+void anotarRespuestaBackend(int codigo) {
+  ultimaPeticionFallida = (codigo < 0 || codigo >= 500);
+  if (!ultimaPeticionFallida) {
+    fallosSeguidos = 0;
+    if (estadoCorte == CORTE_ABIERTO) {
+      estadoCorte = CORTE_CERRADO;
+      esperaCorteMs = CORTE_ESPERA_MIN_MS;
+      Serial.println("Backend recuperado, las tarjetas vuelven a consultarlo");
+    }
+    return;
+  }
+  
+  if (fallosSeguidos < 255) fallosSeguidos++;
+  if (estadoCorte == CORTE_CERRADO && fallosSeguidos >= CORTE_FALLOS) {
+    estadoCorte = CORTE_ABIERTO;
+    aperturasCorte++;
+    pruebaCorteMs = halMillis() + esperaCorteMs;
+    Serial.print("Backend sin respuesta ");
+    Serial.print(fallosSeguidos);
+    Serial.println(" veces seguidas, las tarjetas se deciden en local");
+  }
+}
+
+// Con el corte abierto ninguna tarjeta lo prueba: lo hace la tarea de red
+// entre tarjetas, con una espera que se dobla mientras siga caído
+void probarBackend() {
+  if (estadoCorte != CORTE_ABIERTO || (int32_t)(halMillis() - pruebaCorteMs) < 0) return;
+  peticionBackend("HEAD", rutaListaBlanca, nullptr, nullptr, 0, FONDO_TIMEOUT_MS);
+  finalizarPeticionBackend();
+  if (estadoCorte == CORTE_ABIERTO) {
+    esperaCorteMs = esperaCorteMs * 2 < CORTE_ESPERA_MAX_MS ? esperaCorteMs * 2 : CORTE_ESPERA_MAX_MS;
+    pruebaCorteMs = halMillis() + esperaCorteMs;
+  }
+}
+
+bool leerCabecerasHTTP(Client& cliente, unsigned long hasta, bool sinCuerpo, CabecerasHTTP& c) {
+  // Línea de estado: "HTTP/1.x 200 OK"
+  char linea[96];
+  int largo = leerLineaHTTP(cliente, linea, sizeof(linea), hasta);
+  if (largo < 0) return false;
+  
+  // Cualquier otra cosa es un flujo que no se entiende: se trata como fallo
+  // y el llamador cierra el socket
+  if (largo < 12 || strncmp(linea, "HTTP/1.", 7) != 0 || (linea[7] != '0' && linea[7] != '1') || linea[8] != ' ' ||
+      !isdigit((unsigned char)linea[9]) || !isdigit((unsigned char)linea[10]) || !isdigit((unsigned char)linea[11])) {
+    return false;
+  }
+  c.codigo = atoi(linea + 9);
+  c.cerrar = (linea[7] == '0');
+  c.longitud = -1;
+  c.chunked = false;
+  c.binaria = false;
+  
+  while (true) {
+    int n = leerLineaHTTP(cliente, linea, sizeof(linea), hasta);
+    if (n < 0) return false;
+    if (n == 0) break;
+    if (strncasecmp(linea, "Content-Length:", 15) == 0) {
+      c.longitud = atol(linea + 15);
+    } else if (strncasecmp(linea, "Transfer-Encoding:", 18) == 0) {
+      c.chunked = strstr(linea + 18, "chunked") != nullptr;
+    } else if (strncasecmp(linea, "Connection:", 11) == 0) {
+      c.cerrar = strstr(linea + 11, "close") != nullptr;
+    } else if (strncasecmp(linea, "Content-Type:", 13) == 0) {
+      c.binaria = strstr(linea + 13, "msgpack") != nullptr;
+    }
+  }
+  
+  // 204/304 y respuestas a HEAD no llevan cuerpo
+  if (c.codigo == 204 || c.codigo == 304 || sinCuerpo) {
+    c.longitud = 0;
+    c.chunked = false;
+  }
+  if (c.longitud < 0 && !c.chunked) c.cerrar = true;
+  return true;
+}
+
+void finalizarPeticionBackend() {
+  if (!peticionEnCurso) return;
+  peticionEnCurso = false;
+  
+  // Consumir lo que quede del cuerpo para que el socket quede listo para la siguiente
+  cuerpoRespuesta.descartar();
+  if (cerrarTrasPeticion || cuerpoRespuesta.error()) {
+    halSocket(SOCKET_PETICIONES).stop();
+  }
+  ultimoUsoBackend = halMillis();
+}
+
+int postJSONBackend(const char* ruta, const char* json, size_t largo, uint32_t timeoutMs) {
+  int codigo = peticionBackend("POST", ruta, TIPO_JSON, (const uint8_t*)json, largo, timeoutMs);
+  finalizarPeticionBackend();
+  return codigo;
+}
+
+int postBinarioBackend(const char* ruta, const uint8_t* datos, size_t largo, uint32_t timeoutMs) {
+  if (largo == 0) return -1;
+  int codigo = peticionBackend("POST", ruta, TIPO_MSGPACK, datos, largo, timeoutMs);
+  finalizarPeticionBackend();
+  return codigo;
+}
+
+bool rechazaBinario(int httpCode) {
+  // 415: el backend no entiende MessagePack; todo vuelve a JSON
+  if (httpCode != HTTP_FORMATO_NO_ACEPTADO) return false;
+  Serial.println("Backend sin formato binario, se vuelve a JSON");
+  formatoBinario = false;
+  return true;
+}
+
+void prepararConexionBackend() {
+  snprintf(cabecerasComunes, sizeof(cabecerasComunes),
+    "Host: %s:%d\r\nUser-Agent: ESP32-RFID-Reader\r\nConnection: keep-alive\r\n", serverIP, serverPort);
+}
+
+void actualizarIPLocal() {
+  // Primer octeto en el byte bajo, como IPAddress
+  uint32_t ip = halIPLocal();
+  for (int i = 0; i < 4; i++) ipLocalBytes[i] = (ip >> (8 * i)) & 0xFF;
+  snprintf(ipLocal, sizeof(ipLocal), "%u.%u.%u.%u", ipLocalBytes[0], ipLocalBytes[1], ipLocalBytes[2], ipLocalBytes[3]);
+}
+
+// ==================== FUNCIONES WIFI ====================
+
+void iniciarWiFi() {
+  // La reconexión la lleva vigilarWiFi(), con la red guardada
+  halIniciarWiFi(eventoWiFi);
+  cargarRedGuardada();
+  
+  // Sin bloquear: vigilarWiFi() reintenta desde loop() como tras una caída
+  Serial.println("Conectando a WiFi...");
+  caidaWiFiMs = halMillis();
+  wifiCaido = true;
+  iniciarConexionWiFi(true);
+}
+
+void iniciarConexionWiFi(bool usarRedGuardada) {
+  // Con BSSID y canal conocidos no hay escaneo: asociación directa
+  intentoConCache = usarRedGuardada && redGuardadaValida;
+  aplicarDireccion(intentoConCache);
+  if (intentoConCache) {
+    halConectarWiFi(ssid, password, redGuardada.canal, redGuardada.bssid);
+  } else {
+    halConectarWiFi(ssid, password, 0, nullptr);
+  }
+  ultimoIntentoWiFiMs = halMillis();
+  avisosAlIntentar = avisosCaidaWiFi;
+  esperaIntentoWiFiMs = intentoConCache ? REINTENTO_WIFI_MS : REINTENTO_WIFI_ESCANEO_MS;
+}
+
+void aplicarDireccion(bool usarConcesion) {
+  IPAddress ip, puerta, mascara, dns;
+  if (ipFija[0] != '\0' && ip.fromString(ipFija) && puerta.fromString(puertaEnlaceFija) &&
+      mascara.fromString(mascaraFija)) {
+    if (!dns.fromString(dnsFijo)) dns = puerta;
+    halConfigurarDireccion(ip, puerta, mascara, dns);
+    concesionEnUso = false;
+  } else if (REUTILIZAR_CONCESION && usarConcesion && redGuardada.ip != 0) {
+    // Misma IP que la última vez sin esperar al DHCP
+    halConfigurarDireccion(redGuardada.ip, redGuardada.puerta, redGuardada.mascara, redGuardada.dns);
+    concesionEnUso = true;
+  } else {
+    // Todo a 0.0.0.0 vuelve a activar el DHCP
+    halConfigurarDireccion(0, 0, 0, 0);
+    concesionEnUso = false;
+  }
+}
+
+// Tarea de eventos WiFi: solo anota, sin NVS ni Serial
+void eventoWiFi(uint8_t evento) {
+  if (evento == RED_ASOCIADA) {
+    wifiAsociado = true;
+  } else if (evento == RED_CAIDA) {
+    wifiAsociado = false;
+    avisosCaidaWiFi++;
+    if (!wifiCaido) {
+      caidaWiFiMs = halMillis();
+      wifiCaido = true;
+    }
+  } else if (evento == RED_CON_IP) {
+    // La caída se da por terminada aquí y no en loop(): una que llegue
+    // mientras loop() registra esta conexión vuelve a subir wifiCaido
+    conexionWiFiMs = halMillis();
+    duracionCaidaMs = conexionWiFiMs - caidaWiFiMs;
+    conexionTrasCaida = wifiCaido;
+    wifiCaido = false;
+    wifiConexionNueva = true;
+  }
+}
+
+void vigilarWiFi() {
+  if (wifiConexionNueva) {
+    wifiConexionNueva = false;
+    bool primera = !wifiConectadoAlgunaVez;
+    registrarConexionWiFi(conexionTrasCaida && !primera);
+    // Sin tarjetas en curso se celebra la primera conexión
+    if (primera && tarjetasEnCurso <= 0) mostrarWiFiConectado();
+  }
+  
+  // Acabó la espera del arranque sin red
+  if (!wifiConectadoAlgunaVez && !avisoSinRedMostrado && halMillis() > ARRANQUE_ESPERA_RED_MS) {
+    avisoSinRedMostrado = true;
+    Serial.println("Error WiFi!");
+    if (tarjetasEnCurso <= 0) mostrarErrorWiFi();
+  }
+  
+  if (!wifiCaido || halWiFiConectada()) return;
+  // Un intento fallido (AP que no contesta, clave rechazada) lo avisa el
+  // driver enseguida y se repite ya. Sin aviso, el intento dura hasta
+  // asociarse o agotar su espera: cortarlo antes interrumpe el handshake
+  // WPA2. Ya asociado, se deja terminar al DHCP
+  uint32_t espera = esperaIntentoWiFiMs;
+  if (wifiAsociado) {
+    espera = ESPERA_DHCP_MS;
+  } else if (avisosCaidaWiFi != avisosAlIntentar) {
+    espera = REINTENTO_WIFI_MIN_MS;
+  }
+  if (halMillis() - ultimoIntentoWiFiMs < espera) return;
+  
+  // Con la red guardada mientras tanto (el AP reinicia en el mismo canal) y
+  // cada ESCANEO_WIFI_CADA_MS uno con escaneo por si cambió
+  uint32_t desde = (int32_t)(ultimoEscaneoWiFiMs - caidaWiFiMs) > 0 ? ultimoEscaneoWiFiMs : caidaWiFiMs;
+  bool conCache = halMillis() - desde < ESCANEO_WIFI_CADA_MS;
+  if (!conCache) ultimoEscaneoWiFiMs = halMillis();
+  halDesconectarWiFi();
+  iniciarConexionWiFi(conCache);
+}
+
+void registrarConexionWiFi(bool reconexion) {
+  if (reconexion) {
+    uint32_t duracion = duracionCaidaMs;
+    reconexionesWiFi++;
+    if (duracion > reconexionMaximaMs) reconexionMaximaMs = duracion;
+    anotarLatencia(ETAPA_RECONEXION, duracion * 1000);
+    
+    Serial.print("WiFi reconectado en ");
+    Serial.print(duracion);
+    Serial.print(" ms (");
+    Serial.print(intentoConCache ? "red guardada" : "escaneo");
+    Serial.print(ipFija[0] != '\0' ? ", IP fija" : concesionEnUso ? ", IP guardada" : "");
+    Serial.print("); ");
+    Serial.print(reconexionesWiFi);
+    Serial.print(" reconexiones, max ");
+    Serial.print(reconexionMaximaMs);
+    Serial.println(" ms");
+  }
+  actualizarIPLocal();
+  if (!wifiConectadoAlgunaVez) {
+    wifiConectadoAlgunaVez = true;
+    marcarHito(HITO_WIFI);
+    Serial.print("IP: ");
+    Serial.println(ipLocal);
+  }
+  guardarRed();
+}
+
+void cargarRedGuardada() {
+  redGuardadaValida = halLeerAjustes("wifi", "red", &redGuardada, sizeof(redGuardada));
+}
+
+void guardarRed() {
+  RedGuardada actual;
+  if (!halLeerRed(actual)) return;
+  
+  RedGuardada nueva = redGuardada;
+  memcpy(nueva.bssid, actual.bssid, sizeof(nueva.bssid));
+  nueva.canal = actual.canal;
+  // Solo se guarda lo que dio el DHCP; con IP fija no hay concesión
+  if (ipFija[0] != '\0') {
+    nueva.ip = 0;
+  } else if (!concesionEnUso) {
+    nueva.ip = actual.ip;
+    nueva.puerta = actual.puerta;
+    nueva.mascara = actual.mascara;
+    nueva.dns = actual.dns;
+  }
+  
+  // La NVS solo se escribe si algo cambió
+  if (redGuardadaValida && memcmp(&nueva, &redGuardada, sizeof(nueva)) == 0) return;
+  redGuardada = nueva;
+  redGuardadaValida = true;
+  halGuardarAjustes("wifi", "red", &redGuardada, sizeof(redGuardada));
+}
+
+// ==================== BANCO DE PRUEBAS ====================
+
+// Reproduce una traza de toques por el mismo camino que el lector (cola de
+// tarjetas, tarea de red, loop()) contra un backend simulado, y falla si el
+// rendimiento queda fuera de los umbrales BANCO_*
+void iniciarBanco() {
+  if (estadoBanco != BANCO_PARADO) {
+    Serial.println("El banco ya esta en curso");
+    return;
+  }
+  if (toquesTraza == 0) generarTrazaSintetica();
+  
+  muestrasColaN = 0;
+  muestrasFeedbackN = 0;
+  siguienteToque = 0;
+  trazaInyectada = false;
+  inicioBancoMs = halMillis();
+  ultimoFeedbackBancoMs = inicioBancoMs;
+  
+  Serial.print("Banco: ");
+  Serial.print(toquesTraza);
+  Serial.print(" toques en ");
+  Serial.print(trazaBanco[toquesTraza - 1].ms / 1000.0, 1);
+  Serial.println(" s de traza");
+  estadoBanco = BANCO_EN_CURSO;
+}
+
+void generarTrazaSintetica() {
+  // Determinista: la misma traza en cada ejecución para poder comparar
+  uint32_t semilla = 0xB5297A4D;
+  uint32_t ms = 0;
+  int total = BANCO_TOQUES_NORMALES + BANCO_TOQUES_RAFAGA;
+  if (total > BANCO_MAX_TOQUES) total = BANCO_MAX_TOQUES;
+  
+  for (int i = 0; i < total; i++) {
+    uint32_t intervalo = (i < BANCO_TOQUES_NORMALES) ? BANCO_INTERVALO_NORMAL_MS : BANCO_INTERVALO_RAFAGA_MS;
+    ms += intervalo / 2 + aleatorioBanco(semilla) % intervalo;
+    ToqueTraza& t = trazaBanco[i];
+    t.ms = ms;
+    
+    // 5 % repite la tarjeta anterior (antirrebote), 10 % desconocidas (E0...)
+    uint32_t r = aleatorioBanco(semilla) % 100;
+    if (r < 5 && i > 0) {
+      t.uid = trazaBanco[i - 1].uid;
+    } else {
+      uint8_t bytes[4] = {(uint8_t)(r < 15 ? 0xE0 : 0xB0), 0x5C, (uint8_t)(i >> 8), (uint8_t)i};
+      t.uid.asignar(bytes, 4);
+    }
+    // Repartidos entre los lectores; el repetido cae en otro si hay varios
+    t.lector = i % NUM_LECTORES;
+  }
+  toquesTraza = total;
+}
+
+// Tarea del lector: publica los toques cuyo momento ya llegó
+void reproducirTraza() {
+  uint32_t transcurrido = halMillis() - inicioBancoMs;
+  while (siguienteToque < toquesTraza && trazaBanco[siguienteToque].ms <= transcurrido) {
+    EventoTarjeta evento;
+    evento.uid = trazaBanco[siguienteToque].uid;
+    evento.detectadaMs = halMillis();
+    evento.lector = trazaBanco[siguienteToque].lector;
+    publicarLectura(evento);
+    siguienteToque++;
+  }
+  if (siguienteToque == toquesTraza) trazaInyectada = true;
+}
+
+void comprobarFinBanco() {
+  // Terminado cuando la traza entera salió y no queda ninguna tarjeta en vuelo
+  if (estadoBanco != BANCO_EN_CURSO || !trazaInyectada) return;
+  if (tarjetasEnCurso > 0 || lecturasNuevas.load() > 0) return;
+  estadoBanco = BANCO_PARADO;
+  informeBanco();
+}
+
+void informeBanco() {
+  uint32_t duracionMs = ultimoFeedbackBancoMs - inicioBancoMs;
+  float toquesMinuto = duracionMs > 0 ? muestrasFeedbackN * 60000.0 / duracionMs : 0;
+  int descartadas = toquesTraza - muestrasFeedbackN;
+  uint32_t colaP50 = percentil(muestrasCola, muestrasColaN, 50);
+  uint32_t colaP99 = percentil(muestrasCola, muestrasColaN, 99);
+  uint32_t feedbackP50 = percentil(muestrasFeedback, muestrasFeedbackN, 50);
+  uint32_t feedbackP99 = percentil(muestrasFeedback, muestrasFeedbackN, 99);
+  
+  Serial.print("Banco: ");
+  Serial.print(muestrasFeedbackN);
+  Serial.print(" toques en ");
+  Serial.print(duracionMs / 1000.0, 1);
+  Serial.print(" s -> ");
+  Serial.print(toquesMinuto, 1);
+  Serial.print(" toques/min, ");
+  Serial.print(descartadas);
+  Serial.println(" descartados");
+  Serial.print("Espera en cola: p50 ");
+  Serial.print(colaP50);
+  Serial.print(" ms, p99 ");
+  Serial.print(colaP99);
+  Serial.println(" ms");
+  Serial.print("Tarjeta -> feedback: p50 ");
+  Serial.print(feedbackP50);
+  Serial.print(" ms, p99 ");
+  Serial.print(feedbackP99);
+  Serial.println(" ms");
+  
+  // Una línea fija para que un script del monitor serie decida
+  if (toquesMinuto < BANCO_MIN_TOQUES_MIN) {
+    Serial.println("BANCO FALLA: toques/min por debajo del umbral");
+  } else if (colaP99 > BANCO_MAX_COLA_P99_MS) {
+    Serial.println("BANCO FALLA: p99 de espera en cola por encima del umbral");
+  } else if (feedbackP99 > BANCO_MAX_FEEDBACK_P99_MS) {
+    Serial.println("BANCO FALLA: p99 tarjeta -> feedback por encima del umbral");
+  } else if (descartadas > 0) {
+    Serial.println("BANCO FALLA: se descartaron toques");
   } else {
-    Serial.println("Error WiFi!");
-    mostrarErrorWiFi();
+    Serial.println("BANCO OK");
+  }
+}
+
+// Ordena las muestras en el sitio; n <= BANCO_MAX_TOQUES
+uint32_t percentil(uint32_t* muestras, int n, int porcentaje) {
+  if (n == 0) return 0;
+  for (int i = 1; i < n; i++) {
+    uint32_t valor = muestras[i];
+    int j = i - 1;
+    while (j >= 0 && muestras[j] > valor) {
+      muestras[j + 1] = muestras[j];
+      j--;
+    }
+    muestras[j + 1] = valor;
+  }
+  int indice = (n * porcentaje + 99) / 100 - 1;
+  return muestras[indice < 0 ? 0 : indice];
+}
+
+uint32_t aleatorioBanco(uint32_t& estado) {
+  // xorshift32: reproducible y sin depender del generador del sistema
+  estado ^= estado << 13;
+  estado ^= estado >> 17;
+  estado ^= estado << 5;
+  return estado;
+}
+
+// Sustituye a la red en peticionBackend: latencia, errores y timeouts según
+// BANCO_*, y respuestas mínimas de cada ruta del backend real. Solo habla
+// JSON (contesta 415 a MessagePack)
+int peticionSimulada(const char* ruta, const char* tipoContenido, const uint8_t* cuerpo, size_t longitudCuerpo, uint32_t timeoutMs) {
+  static char respuesta[64 + LOTE_MAX_FICHAJES * 32];
+  static uint8_t imagenLista[BANCO_PRUEBAS ? sizeof(CabeceraLista) + (BANCO_MAX_TOQUES + 4 * BANCO_LISTA_CAMBIOS) * sizeof(EntradaLista) : 1];
+  const char* datos = respuesta;
+  
+  int suerte = aleatorioBanco(semillaBackendSimulado) % 100;
+  if (suerte < BANCO_TIMEOUTS_PCT) {
+    halEsperar(timeoutMs);
+    return -1;
+  }
+  halEsperar(BANCO_LATENCIA_MS - BANCO_JITTER_MS + aleatorioBanco(semillaBackendSimulado) % (2 * BANCO_JITTER_MS + 1));
+  
+  int codigo = 200;
+  int largo = 0;
+  if (suerte < BANCO_TIMEOUTS_PCT + BANCO_ERRORES_PCT) {
+    codigo = 500;
+  } else if (tipoContenido != nullptr && strcmp(tipoContenido, TIPO_MSGPACK) == 0) {
+    codigo = HTTP_FORMATO_NO_ACEPTADO;
+  } else if (strncmp(ruta, rutaVerificar, strlen(rutaVerificar)) == 0) {
+    // Las tarjetas E0... no están dadas de alta
+    bool valida = strncmp(ruta + strlen(rutaVerificar), "E0", 2) != 0;
+    largo = snprintf(respuesta, sizeof(respuesta), valida ? "{\"valida\":true,\"nombreEmpleado\":\"Banco\"}"
+                                                           : "{\"valida\":false}");
+  } else if (strcmp(ruta, rutaToque) == 0) {
+    // Mismo criterio que /verificar; sin cuerpo es la negociación del arranque
+    bool valida = cuerpo == nullptr || memmem(cuerpo, longitudCuerpo, "\"codigoRFID\":\"E0", 16) == nullptr;
+    largo = snprintf(respuesta, sizeof(respuesta), valida ? "{\"resultado\":\"permitido\",\"nombreEmpleado\":\"Banco\"}"
+                                                           : "{\"resultado\":\"denegado\"}");
+  } else if (strcmp(ruta, rutaFichajeLote) == 0) {
+    // Acepta todas las secuencias del lote
+    largo = snprintf(respuesta, sizeof(respuesta), "{\"resultados\":[");
+    const char* p = (const char*)cuerpo;
+    const char* fin = p + longitudCuerpo;
+    bool primero = true;
+    while ((p = (const char*)memmem(p, fin - p, "\"secuencia\":", 12)) != nullptr) {
+      p += 12;
+      largo += snprintf(respuesta + largo, sizeof(respuesta) - largo, "%s{\"secuencia\":%lu,\"ok\":true}",
+                        primero ? "" : ",", strtoul(p, nullptr, 10));
+      primero = false;
+    }
+    largo += snprintf(respuesta + largo, sizeof(respuesta) - largo, "]}");
+    if (largo >= (int)sizeof(respuesta)) codigo = 500;
+  } else if (strncmp(ruta, rutaListaBlanca, strlen(rutaListaBlanca)) == 0) {
+    // Lista completa de la versión en curso, salvo que ya sea la del lector
+    const char* version = strstr(ruta, "version=");
+    if (version != nullptr && strtoul(version + 8, nullptr, 10) == versionListaSimulada) {
+      codigo = 304;
+    } else {
+      largo = listaSimulada(imagenLista, sizeof(imagenLista));
+      datos = (const char*)imagenLista;
+      if (largo == 0) codigo = 500;
+    }
+  }
+  if (codigo != 200) largo = 0;
+  
+  clienteSimulado.cargar(datos, largo);
+  cuerpoRespuesta.iniciar(&clienteSimulado, largo, false, halMillis() + timeoutMs);
+  peticionEnCurso = true;
+  cerrarTrasPeticion = false;
+  respuestaBinaria = false;
+  peticionesBackend++;
+  return codigo;
+}
+
+EntradaLista entradaSimulada(uint8_t prefijo, uint32_t k) {
+  EntradaLista e;
+  memset(&e, 0, sizeof(e));
+  e.longitud = 4;
+  e.uid[0] = prefijo;
+  e.uid[1] = 0x5C;
+  e.uid[2] = k >> 8;
+  e.uid[3] = k;
+  return e;
+}
+
+// Lista del backend simulado en la versión v: las tarjetas B05C... de la traza
+// (fijas) y una ventana de 4 * BANCO_LISTA_CAMBIOS tarjetas C05C... que avanza
+// BANCO_LISTA_CAMBIOS por versión: cada delta son esas altas y esas bajas
+size_t listaSimulada(uint8_t* destino, size_t maximo) {
+  CabeceraLista cab;
+  memset(&cab, 0, sizeof(cab));
+  cab.magic = LISTA_MAGIC;
+  cab.version = versionListaSimulada;
+  cab.cantidad = BANCO_MAX_TOQUES + 4 * BANCO_LISTA_CAMBIOS;
+  size_t largo = sizeof(cab) + cab.cantidad * sizeof(EntradaLista);
+  if (largo > maximo) return 0;
+  
+  EntradaLista* entradas = (EntradaLista*)(destino + sizeof(cab));
+  uint32_t desde = (versionListaSimulada - 1) * BANCO_LISTA_CAMBIOS;
+  for (uint32_t i = 0; i < cab.cantidad; i++) {
+    entradas[i] = (i < BANCO_MAX_TOQUES) ? entradaSimulada(0xB0, i) : entradaSimulada(0xC0, desde + i - BANCO_MAX_TOQUES);
+    bloomAgregar(cab.bloom, entradas[i]);
+  }
+  cab.crc = esp_crc32_le(esp_crc32_le(0, cab.bloom, LISTA_BLOOM_BYTES), (const uint8_t*)entradas,
+                         cab.cantidad * sizeof(EntradaLista));
+  memcpy(destino, &cab, sizeof(cab));
+  return largo;
+}
+
+// Contestación al long-poll: una versión nueva por suscripción. Cada
+// BANCO_LISTA_SALTO versiones el backend se salta una y, como no guarda ese
+// delta, contesta 409 para forzar la lista completa
+void cambiosSimulados(uint32_t version) {
+  static uint8_t cuerpo[sizeof(CabeceraDelta) + 2 * BANCO_LISTA_CAMBIOS * (1 + LISTA_UID_MAX)];
+  static char respuesta[64 + sizeof(cuerpo)];
+  size_t largoCuerpo = 0;
+  int codigo = 409;
+  
+  if (version == versionListaSimulada) {
+    bool salto = (versionListaSimulada % BANCO_LISTA_SALTO == 0);
+    versionListaSimulada += salto ? 2 : 1;
+    if (!salto) codigo = 200;
+  }
+  
+  if (codigo == 200) {
+    CabeceraDelta delta;
+    delta.magic = LISTA_MAGIC_DELTA;
+    delta.versionBase = version;
+    delta.version = version + 1;
+    delta.operaciones = 2 * BANCO_LISTA_CAMBIOS;
+    delta.altas = BANCO_LISTA_CAMBIOS;
+    largoCuerpo = sizeof(delta);
+    
+    EntradaLista anterior;
+    memset(&anterior, 0, sizeof(anterior));
+    uint32_t desde = (version - 1) * BANCO_LISTA_CAMBIOS;
+    for (uint32_t i = 0; i < delta.operaciones; i++) {
+      bool baja = i < BANCO_LISTA_CAMBIOS;
+      uint32_t k = baja ? desde + i : desde + 3 * BANCO_LISTA_CAMBIOS + i;
+      EntradaLista e = entradaSimulada(0xC0, k);
+      largoCuerpo += codificarOperacionDelta(cuerpo + largoCuerpo, anterior, e, baja);
+      anterior = e;
+    }
+    delta.bytes = largoCuerpo - sizeof(delta);
+    delta.crc = esp_crc32_le(0, cuerpo + sizeof(delta), delta.bytes);
+    memcpy(cuerpo, &delta, sizeof(delta));
+  }
+  
+  int largo = snprintf(respuesta, 64, "HTTP/1.1 %d %s\r\nContent-Length: %u\r\n\r\n",
+                       codigo, codigo == 200 ? "OK" : "Conflict", (unsigned)largoCuerpo);
+  memcpy(respuesta + largo, cuerpo, largoCuerpo);
+  clienteCambiosSimulado.cargar(respuesta, largo + largoCuerpo);
+}
+
+// ==================== RELOJ DE FICHAJES ====================
+
+// esp_timer no se detiene ni salta con NTP; la hora de cada toque se deriva de
+// él con la última sincronización y la deriva medida entre sincronizaciones,
+// así que sigue siendo buena sin WiFi y no depende de cuándo se sube el fichaje
+
+void iniciarReloj() {
+  // Tras un reinicio en caliente el RTC conserva la hora: sirve de ancla
+  // provisional hasta el primer NTP
+  struct timeval ahora;
+  halHoraSistema(ahora);
+  if ((unsigned long)ahora.tv_sec > EPOCA_RELOJ) {
+    portENTER_CRITICAL(&relojMux);
+    reloj.fuente = RELOJ_RTC;
+    reloj.anclaMonoUs = halRelojUs();
+    reloj.anclaUnixUs = (int64_t)ahora.tv_sec * 1000000 + ahora.tv_usec;
+    portEXIT_CRITICAL(&relojMux);
+    Serial.println("Reloj: hora del RTC hasta la primera sincronizacion NTP");
+  }
+  halIniciarNTP(sincronizacionNTP);
+}
+
+// Aviso de SNTP (tarea de lwIP) con la hora recién recibida
+void sincronizacionNTP(struct timeval* tv) {
+  int64_t monoUs = halRelojUs();
+  int64_t unixUs = (int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+  bool midioDeriva = false;
+  
+  portENTER_CRITICAL(&relojMux);
+  if (reloj.fuente == RELOJ_NTP) {
+    int64_t transcurrido = monoUs - reloj.anclaMonoUs;
+    reloj.ultimoErrorUs = reloj.anclaUnixUs + transcurrido + transcurrido / 1000 * reloj.derivaPpb / 1000000 - unixUs;
+    
+    // La deriva se mide sobre intervalos largos: en uno corto domina el jitter de NTP
+    int64_t intervalo = monoUs - reloj.baseMonoUs;
+    if (intervalo >= (int64_t)RELOJ_MIN_DERIVA_MS * 1000) {
+      int64_t diferencia = (unixUs - reloj.baseUnixUs) - intervalo;
+      if (diferencia < intervalo / 1000000 * RELOJ_MAX_DERIVA_PPM &&
+          diferencia > -intervalo / 1000000 * RELOJ_MAX_DERIVA_PPM) {
+        int32_t medida = diferencia * 1000000 / (intervalo / 1000);
+        reloj.derivaPpb = reloj.derivaMedida ? reloj.derivaPpb + (medida - reloj.derivaPpb) / 4 : medida;
+        reloj.derivaMedida = true;
+        midioDeriva = true;
+      }
+      reloj.baseMonoUs = monoUs;
+      reloj.baseUnixUs = unixUs;
+    }
+  } else {
+    reloj.baseMonoUs = monoUs;
+    reloj.baseUnixUs = unixUs;
+  }
+  uint8_t fuenteAnterior = reloj.fuente;
+  reloj.fuente = RELOJ_NTP;
+  reloj.anclaMonoUs = monoUs;
+  reloj.anclaUnixUs = unixUs;
+  reloj.sincronizaciones++;
+  int64_t errorUs = reloj.ultimoErrorUs;
+  int32_t derivaPpb = reloj.derivaPpb;
+  portEXIT_CRITICAL(&relojMux);
+  
+  Serial.print("Reloj: NTP");
+  if (fuenteAnterior == RELOJ_NTP) {
+    Serial.print(", error de la prediccion ");
+    Serial.print((long)(errorUs / 1000));
+    Serial.print(" ms");
+  }
+  if (midioDeriva) {
+    Serial.print(", deriva ");
+    Serial.print(derivaPpb / 1000.0, 2);
+    Serial.print(" ppm");
+  }
+  Serial.println();
+}
+
+bool relojAUnix(int64_t monoUs, int64_t& unixUs) {
+  portENTER_CRITICAL(&relojMux);
+  EstadoReloj r = reloj;
+  portEXIT_CRITICAL(&relojMux);
+  if (r.fuente == RELOJ_SIN_HORA) return false;
+  
+  int64_t transcurrido = monoUs - r.anclaMonoUs;
+  unixUs = r.anclaUnixUs + transcurrido + transcurrido / 1000 * r.derivaPpb / 1000000;
+  return true;
+}
+
+// Instante para el diario: segundos desde EPOCA_RELOJ si ya hay hora; si no,
+// segundos desde el arranque con INSTANTE_RELATIVO, que se convierten al subir
+uint32_t marcarInstante(uint32_t detectadaMs) {
+  int64_t monoUs = halRelojUs() - (int64_t)(uint32_t)(halMillis() - detectadaMs) * 1000;
+  int64_t unixUs;
+  if (relojAUnix(monoUs, unixUs) && unixUs / 1000000 > (int64_t)EPOCA_RELOJ) {
+    return (uint32_t)(unixUs / 1000000 - EPOCA_RELOJ) & ~INSTANTE_RELATIVO;
+  }
+  return INSTANTE_RELATIVO | (uint32_t)(monoUs / 1000000);
+}
+
+// Segundos Unix del toque, o 0 si no se puede saber
+uint32_t instanteUnix(uint32_t instante, bool mismoArranque) {
+  if (instante == 0) return 0;
+  if (!(instante & INSTANTE_RELATIVO)) return instante + EPOCA_RELOJ;
+  
+  // Relativo al arranque: solo sirve si el esp_timer es el mismo que lo midió
+  int64_t unixUs;
+  if (!mismoArranque || !relojAUnix((int64_t)(instante & ~INSTANTE_RELATIVO) * 1000000, unixUs)) return 0;
+  return unixUs / 1000000;
+}
+
+// ==================== MEMORIA ====================
+
+// El equipo pasa semanas sin reiniciarse: el historial permite ver cómo bajan
+// el heap libre, el mayor bloque y el margen de pila antes de que falle algo
+
+void tomarMuestraMemoria() {
+  multi_heap_info_t info;
+  heap_caps_get_info(&info, MALLOC_CAP_DEFAULT);
+  
+  MuestraMemoria m;
+  m.ms = halMillis();
+  m.libre = info.total_free_bytes;
+  m.bloqueMayor = info.largest_free_block;
+  m.minimoLibre = info.minimum_free_bytes;
+  m.bloques = info.allocated_blocks;
+  m.toques = toquesIntervalo;
+  m.bloquesToqueMax = bloquesToqueMax;
+  
+  // En ESP-IDF la marca de agua de la pila va en bytes
+#if PUERTO_METRICAS
+  TaskHandle_t tareas[NUM_TAREAS_MEDIDAS] = {tareaRedHandle, tareaLectorHandle, tareaLoopHandle, tareaMetricasHandle};
+#else
+  TaskHandle_t tareas[NUM_TAREAS_MEDIDAS] = {tareaRedHandle, tareaLectorHandle, tareaLoopHandle, nullptr};
+#endif
+  for (uint8_t t = 0; t < NUM_TAREAS_MEDIDAS; t++) {
+    m.pila[t] = tareas[t] ? uxTaskGetStackHighWaterMark(tareas[t]) : 0;
+  }
+  toquesIntervalo = 0;
+  bloquesToqueMax = 0;
+  
+  portENTER_CRITICAL(&memoriaMux);
+  historialMemoria[muestrasMemoria % MEMORIA_HISTORIAL] = m;
+  muestrasMemoria++;
+  portEXIT_CRITICAL(&memoriaMux);
+  
+  if (m.bloqueMayor < MEMORIA_AVISO_BLOQUE) {
+    Serial.print("Memoria: mayor bloque libre ");
+    Serial.print((unsigned long)m.bloqueMayor);
+    Serial.print(" de ");
+    Serial.print((unsigned long)m.libre);
+    Serial.println(" bytes libres");
+  }
+  for (uint8_t t = 0; t < NUM_TAREAS_MEDIDAS; t++) {
+    if (m.pila[t] == 0 || m.pila[t] >= MEMORIA_AVISO_PILA) continue;
+    Serial.print("Memoria: a la tarea ");
+    Serial.print(nombresTarea[t]);
+    Serial.print(" le quedan ");
+    Serial.print(m.pila[t]);
+    Serial.println(" bytes de pila");
+  }
+}
+
+// Historial de la más antigua a la más reciente, una línea por muestra
+void imprimirMemoria(Print& salida) {
+  salida.print("ms libre bloque_mayor minimo bloques toques bloques_toque_max");
+  for (uint8_t t = 0; t < NUM_TAREAS_MEDIDAS; t++) {
+    salida.print(" pila_");
+    salida.print(nombresTarea[t]);
+  }
+  salida.print("\n");
+  
+  portENTER_CRITICAL(&memoriaMux);
+  uint32_t total = muestrasMemoria;
+  portEXIT_CRITICAL(&memoriaMux);
+  uint32_t cantidad = total < MEMORIA_HISTORIAL ? total : MEMORIA_HISTORIAL;
+  
+  // Copia de una muestra cada vez: no se imprime con el mux tomado
+  for (uint32_t i = 0; i < cantidad; i++) {
+    MuestraMemoria m;
+    portENTER_CRITICAL(&memoriaMux);
+    m = historialMemoria[(total - cantidad + i) % MEMORIA_HISTORIAL];
+    portEXIT_CRITICAL(&memoriaMux);
+    imprimirMuestraMemoria(salida, m);
+  }
+}
+
+void imprimirMuestraMemoria(Print& salida, const MuestraMemoria& m) {
+  salida.print((unsigned long)m.ms);
+  salida.print(" ");
+  salida.print((unsigned long)m.libre);
+  salida.print(" ");
+  salida.print((unsigned long)m.bloqueMayor);
+  salida.print(" ");
+  salida.print((unsigned long)m.minimoLibre);
+  salida.print(" ");
+  salida.print(m.bloques);
+  salida.print(" ");
+  salida.print(m.toques);
+  salida.print(" ");
+  salida.print(m.bloquesToqueMax);
+  for (uint8_t t = 0; t < NUM_TAREAS_MEDIDAS; t++) {
+    salida.print(" ");
+    salida.print(m.pila[t]);
+  }
+  salida.print("\n");
+}
+
+// ==================== METRICAS ====================
+
+void Cronometro::iniciar() {
+  ciclos = halCiclos();
+  us = halMicros();
+}
+
+uint32_t Cronometro::transcurridoUs() const {
+  // El contador de ciclos da la vuelta en ~17 s a 240 MHz; las esperas de red
+  // largas se miden con micros()
+  uint32_t transcurrido = halMicros() - us;
+  if (transcurrido > 10000000) return transcurrido;
+  return (halCiclos() - ciclos) / halCiclosPorUs();
+}
+
+void anotarLatencia(uint8_t etapa, uint32_t us) {
+  Histograma& h = histogramas[etapa];
+  // Menor i con us <= 2^i
+  uint8_t cubeta = (us <= 1) ? 0 : 32 - __builtin_clz(us - 1);
+  if (cubeta < HISTO_CUBETAS) h.cubetas[cubeta]++;
+  h.cuenta++;
+  h.sumaUs += us;
+}
+
+// Formato de exposición de Prometheus; los límites van en segundos
+void escribirMetricas(Print& salida) {
+  salida.print("# HELP rfid_etapa_segundos Latencia de cada etapa de la tarjeta\n");
+  salida.print("# TYPE rfid_etapa_segundos histogram\n");
+  for (int e = 0; e < NUM_ETAPAS; e++) {
+    const Histograma& h = histogramas[e];
+    uint32_t acumulado = 0;
+    for (int i = 0; i < HISTO_CUBETAS; i++) {
+      acumulado += h.cubetas[i];
+      salida.print("rfid_etapa_segundos_bucket{etapa=\"");
+      salida.print(nombresEtapa[e]);
+      salida.print("\",le=\"");
+      salida.print((1UL << i) / 1e6, 6);
+      salida.print("\"} ");
+      salida.print(acumulado);
+      salida.print("\n");
+    }
+    salida.print("rfid_etapa_segundos_bucket{etapa=\"");
+    salida.print(nombresEtapa[e]);
+    salida.print("\",le=\"+Inf\"} ");
+    salida.print(h.cuenta);
+    salida.print("\nrfid_etapa_segundos_sum{etapa=\"");
+    salida.print(nombresEtapa[e]);
+    salida.print("\"} ");
+    salida.print(h.sumaUs / 1e6, 6);
+    salida.print("\nrfid_etapa_segundos_count{etapa=\"");
+    salida.print(nombresEtapa[e]);
+    salida.print("\"} ");
+    salida.print(h.cuenta);
+    salida.print("\n");
+  }
+  
+  salida.print("# HELP rfid_arranque_ms Hitos del arranque desde el encendido (0: pendiente)\n");
+  salida.print("# TYPE rfid_arranque_ms gauge\n");
+  for (int i = 0; i < NUM_HITOS; i++) {
+    salida.print("rfid_arranque_ms{hito=\"");
+    salida.print(nombresHito[i]);
+    salida.print("\"} ");
+    salida.print((unsigned long)hitosArranque[i]);
+    salida.print("\n");
+  }
+  
+  salida.print("# HELP rfid_lista_sincronizaciones_total Actualizaciones de la lista blanca por tipo\n");
+  salida.print("# TYPE rfid_lista_sincronizaciones_total counter\n");
+  salida.print("rfid_lista_sincronizaciones_total{tipo=\"delta\"} ");
+  salida.print(sincronizacionesDelta);
+  salida.print("\nrfid_lista_sincronizaciones_total{tipo=\"completa\"} ");
+  salida.print(sincronizacionesCompletas);
+  salida.print("\n# HELP rfid_lista_bytes_total Bytes descargados para la lista blanca por tipo\n");
+  salida.print("# TYPE rfid_lista_bytes_total counter\n");
+  salida.print("rfid_lista_bytes_total{tipo=\"delta\"} ");
+  salida.print(bytesDelta);
+  salida.print("\nrfid_lista_bytes_total{tipo=\"completa\"} ");
+  salida.print(bytesCompletas);
+  salida.print("\n# HELP rfid_lista_version Version de la lista blanca en flash\n");
+  salida.print("# TYPE rfid_lista_version gauge\n");
+  salida.print("rfid_lista_version ");
+  salida.print((unsigned long)versionListaLocal());
+  salida.print("\n# HELP rfid_toques_unicos_total Tarjetas resueltas con una sola peticion al backend\n");
+  salida.print("# TYPE rfid_toques_unicos_total counter\n");
+  salida.print("rfid_toques_unicos_total ");
+  salida.print(toquesUnicos);
+  salida.print("\n# HELP rfid_toques_por_separado_total Transacciones de toque sin respuesta valida que siguieron por separado\n");
+  salida.print("# TYPE rfid_toques_por_separado_total counter\n");
+  salida.print("rfid_toques_por_separado_total ");
+  salida.print(toquesPorSeparado);
+  salida.print("\n# HELP rfid_plazos_vencidos_total Tarjetas que agotaron PLAZO_TOQUE_MS\n");
+  salida.print("# TYPE rfid_plazos_vencidos_total counter\n");
+  salida.print("rfid_plazos_vencidos_total ");
+  salida.print(plazosVencidos);
+  salida.print("\n# HELP rfid_peticiones_canceladas_total Peticiones de tarjeta no enviadas por plazo agotado o corte abierto\n");
+  salida.print("# TYPE rfid_peticiones_canceladas_total counter\n");
+  salida.print("rfid_peticiones_canceladas_total ");
+  salida.print(peticionesCanceladas);
+  salida.print("\n# HELP rfid_peticiones_cedidas_total Peticiones de fondo abandonadas para atender una tarjeta\n");
+  salida.print("# TYPE rfid_peticiones_cedidas_total counter\n");
+  salida.print("rfid_peticiones_cedidas_total ");
+  salida.print(peticionesCedidas);
+  salida.print("\n# HELP rfid_corte_backend Corte del backend (0 cerrado, 1 abierto)\n");
+  salida.print("# TYPE rfid_corte_backend gauge\n");
+  salida.print("rfid_corte_backend ");
+  salida.print(estadoCorte);
+  salida.print("\n# HELP rfid_corte_aperturas_total Veces que se abrio el corte del backend\n");
+  salida.print("# TYPE rfid_corte_aperturas_total counter\n");
+  salida.print("rfid_corte_aperturas_total ");
+  salida.print(aperturasCorte);
+  salida.print("\n# HELP rfid_decisiones_sin_backend_total Tarjetas desconocidas resueltas en local por falta de backend\n");
+  salida.print("# TYPE rfid_decisiones_sin_backend_total counter\n");
+  salida.print("rfid_decisiones_sin_backend_total ");
+  salida.print(decisionesSinBackend);
+  salida.print("\n# HELP rfid_capturas_pendientes Tarjetas desconocidas esperando a enviarse a captura\n");
+  salida.print("# TYPE rfid_capturas_pendientes gauge\n");
+  salida.print("rfid_capturas_pendientes ");
+  salida.print(capturasEnCola);
+  salida.print("\n# HELP rfid_capturas_descartadas_total Capturas perdidas con la cola llena\n");
+  salida.print("# TYPE rfid_capturas_descartadas_total counter\n");
+  salida.print("rfid_capturas_descartadas_total ");
+  salida.print(capturasDescartadas);
+  salida.print("\n# HELP rfid_verificaciones_evitadas_total Tarjetas resueltas con la lista sin consultar /verificar\n");
+  salida.print("# TYPE rfid_verificaciones_evitadas_total counter\n");
+  salida.print("rfid_verificaciones_evitadas_total ");
+  salida.print(verificacionesEvitadas);
+  salida.print("\n");
+  
+  portENTER_CRITICAL(&relojMux);
+  EstadoReloj r = reloj;
+  portEXIT_CRITICAL(&relojMux);
+  salida.print("# HELP rfid_reloj_fuente Origen de la hora de los fichajes (0 sin hora, 1 RTC, 2 NTP)\n");
+  salida.print("# TYPE rfid_reloj_fuente gauge\n");
+  salida.print("rfid_reloj_fuente ");
+  salida.print(r.fuente);
+  salida.print("\n# HELP rfid_reloj_deriva_ppb Deriva estimada del reloj local\n");
+  salida.print("# TYPE rfid_reloj_deriva_ppb gauge\n");
+  salida.print("rfid_reloj_deriva_ppb ");
+  salida.print((long)r.derivaPpb);
+  salida.print("\n# HELP rfid_reloj_error_us Prediccion menos NTP en la ultima sincronizacion\n");
+  salida.print("# TYPE rfid_reloj_error_us gauge\n");
+  salida.print("rfid_reloj_error_us ");
+  salida.print((long)r.ultimoErrorUs);
+  salida.print("\n# HELP rfid_reloj_sincronizaciones_total Sincronizaciones NTP recibidas\n");
+  salida.print("# TYPE rfid_reloj_sincronizaciones_total counter\n");
+  salida.print("rfid_reloj_sincronizaciones_total ");
+  salida.print((unsigned long)r.sincronizaciones);
+  salida.print("\n");
+  
+  // Última muestra de memoria; el historial completo está en /memoria
+  MuestraMemoria m = {};
+  portENTER_CRITICAL(&memoriaMux);
+  if (muestrasMemoria > 0) m = historialMemoria[(muestrasMemoria - 1) % MEMORIA_HISTORIAL];
+  portEXIT_CRITICAL(&memoriaMux);
+  salida.print("# HELP rfid_heap_libre_bytes Heap libre en la ultima muestra\n");
+  salida.print("# TYPE rfid_heap_libre_bytes gauge\n");
+  salida.print("rfid_heap_libre_bytes ");
+  salida.print((unsigned long)m.libre);
+  salida.print("\n# HELP rfid_heap_bloque_mayor_bytes Mayor bloque reservable en la ultima muestra\n");
+  salida.print("# TYPE rfid_heap_bloque_mayor_bytes gauge\n");
+  salida.print("rfid_heap_bloque_mayor_bytes ");
+  salida.print((unsigned long)m.bloqueMayor);
+  salida.print("\n# HELP rfid_heap_minimo_bytes Minimo de heap libre desde el arranque\n");
+  salida.print("# TYPE rfid_heap_minimo_bytes gauge\n");
+  salida.print("rfid_heap_minimo_bytes ");
+  salida.print((unsigned long)m.minimoLibre);
+  salida.print("\n# HELP rfid_heap_bloques Bloques reservados en la ultima muestra\n");
+  salida.print("# TYPE rfid_heap_bloques gauge\n");
+  salida.print("rfid_heap_bloques ");
+  salida.print(m.bloques);
+  salida.print("\n# HELP rfid_pila_libre_bytes Pila nunca usada por cada tarea\n");
+  salida.print("# TYPE rfid_pila_libre_bytes gauge\n");
+  for (uint8_t t = 0; t < NUM_TAREAS_MEDIDAS; t++) {
+    salida.print("rfid_pila_libre_bytes{tarea=\"");
+    salida.print(nombresTarea[t]);
+    salida.print("\"} ");
+    salida.print(m.pila[t]);
+    salida.print("\n");
+  }
+  salida.print("# HELP rfid_toque_bloques_media Variacion media de bloques del heap por tarjeta\n");
+  salida.print("# TYPE rfid_toque_bloques_media gauge\n");
+  salida.print("rfid_toque_bloques_media ");
+  salida.print(toquesMedidos ? (double)bloquesToqueSuma / toquesMedidos : 0.0, 2);
+  salida.print("\n# HELP rfid_tarjetas_con_reservas_total Tarjetas cuya ruta sin red reservo heap\n");
+  salida.print("# TYPE rfid_tarjetas_con_reservas_total counter\n");
+  salida.print("rfid_tarjetas_con_reservas_total ");
+  salida.print(tarjetasConAsignaciones);
+  salida.print("\n");
+  
+  // Por lector, para ver cómo cambia la detección al añadir lectores al bus
+  salida.print("# HELP rfid_lector_lecturas Tarjetas leidas por cada lector\n");
+  salida.print("# TYPE rfid_lector_lecturas counter\n");
+  for (uint8_t l = 0; l < NUM_LECTORES; l++) {
+    salida.print("rfid_lector_lecturas{lector=\"");
+    salida.print(l);
+    salida.print("\"} ");
+    salida.print(estadisticasLector[l].lecturas);
+    salida.print("\n");
+  }
+  salida.print("# HELP rfid_lector_deteccion_media_us Deteccion -> UID media de cada lector\n");
+  salida.print("# TYPE rfid_lector_deteccion_media_us gauge\n");
+  for (uint8_t l = 0; l < NUM_LECTORES; l++) {
+    const EstadisticasLector& e = estadisticasLector[l];
+    salida.print("rfid_lector_deteccion_media_us{lector=\"");
+    salida.print(l);
+    salida.print("\"} ");
+    salida.print(e.lecturas ? e.deteccionSumaUs / e.lecturas : 0);
+    salida.print("\n");
+  }
+  salida.print("# HELP rfid_lector_deteccion_max_us Deteccion -> UID maxima de cada lector\n");
+  salida.print("# TYPE rfid_lector_deteccion_max_us gauge\n");
+  for (uint8_t l = 0; l < NUM_LECTORES; l++) {
+    salida.print("rfid_lector_deteccion_max_us{lector=\"");
+    salida.print(l);
+    salida.print("\"} ");
+    salida.print(estadisticasLector[l].deteccionMaximoUs);
+    salida.print("\n");
+  }
+  salida.print("# HELP rfid_lector_hueco_max_ms Mayor tiempo sin sondear cada lector\n");
+  salida.print("# TYPE rfid_lector_hueco_max_ms gauge\n");
+  for (uint8_t l = 0; l < NUM_LECTORES; l++) {
+    salida.print("rfid_lector_hueco_max_ms{lector=\"");
+    salida.print(l);
+    salida.print("\"} ");
+    salida.print((unsigned long)estadisticasLector[l].huecoMaximoMs);
+    salida.print("\n");
+  }
+}
+
+// Tarea de métricas: atiende /metrics y /memoria con la prioridad más baja
+// del núcleo de red, así que la tarea de red la desaloja en cuanto tiene trabajo
+void tareaMetricas(void* parametro) {
+#if PUERTO_METRICAS
+  while (!halRedConectada()) {
+    vTaskDelay(pdMS_TO_TICKS(INTERVALO_METRICAS_MS));
+  }
+  halIniciarServidorMetricas();
+  
+  for (;;) {
+    atenderMetricas();
+    vTaskDelay(pdMS_TO_TICKS(INTERVALO_METRICAS_MS));
+  }
+#endif
+}
+
+// Un cliente por vuelta de la tarea de métricas; solo se mira la línea de petición
+void atenderMetricas() {
+#if PUERTO_METRICAS
+  Client* conexion = halClienteMetricas();
+  if (conexion == nullptr) return;
+  Client& cliente = *conexion;
+  
+  // Timeout de Stream en ms (WiFiClient::setTimeout usa segundos en el core 2.x)
+  cliente.Stream::setTimeout(METRICAS_TIMEOUT_MS);
+  char peticion[64];
+  size_t largo = cliente.readBytesUntil('\n', peticion, sizeof(peticion) - 1);
+  peticion[largo] = '\0';
+  
+  // Descartar cabeceras hasta la línea vacía
+  char linea[64];
+  while (cliente.readBytesUntil('\n', linea, sizeof(linea)) > 1) {}
+  
+  if (strncmp(peticion, "GET /metrics ", 13) == 0) {
+    cliente.print("HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+    escribirMetricas(cliente);
+  } else if (strncmp(peticion, "GET /memoria ", 13) == 0) {
+    cliente.print("HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\n");
+    imprimirMemoria(cliente);
+  } else {
+    cliente.print("HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+  }
+  cliente.stop();
+#endif
+}
+
+// ==================== CAPA DE HARDWARE ====================
+
+// Única parte del firmware que toca pines, SPI, I2C, la radio, los sockets,
+// la flash y los relojes. La lógica de fichaje solo ve estas funciones; con
+// HAL_NATIVO las sustituye host/hal_nativo.h y el firmware corre en Linux
+
+bool halRedConectada() {
+  // El backend simulado no necesita red
+  if (BANCO_PRUEBAS) return true;
+  return halWiFiConectada();
+}
+
+#if HAL_NATIVO
+#include "host/hal_nativo.h"
+#else
+
+MFRC522 lectores[NUM_LECTORES];
+Preferences preferencias;
+WiFiClient socketsBackend[NUM_SOCKETS];
+#if PUERTO_METRICAS
+WiFiServer servidorMetricas(PUERTO_METRICAS);
+WiFiClient clienteMetricas;
+#endif
+const esp_partition_t* particionesLista[2] = {nullptr, nullptr};
+void (*avisoRed)(uint8_t evento) = nullptr;
+
+// Secuencia de arranque de Adafruit_SSD1306::begin para 128x64 con la bomba
+// de carga interna. El framebuffer es el lienzo, así que no hace falta el suyo
+bool iniciarPanelOLED() {
+  static const uint8_t comandos[] = {
+    SSD1306_DISPLAYOFF,
+    SSD1306_SETDISPLAYCLOCKDIV, 0x80,
+    SSD1306_SETMULTIPLEX, SCREEN_HEIGHT - 1,
+    SSD1306_SETDISPLAYOFFSET, 0x00,
+    SSD1306_SETSTARTLINE | 0x00,
+    SSD1306_CHARGEPUMP, 0x14,
+    SSD1306_MEMORYMODE, 0x00,           // Horizontal: halEnviarPantalla escribe ventanas de una página
+    SSD1306_SEGREMAP | 0x01,
+    SSD1306_COMSCANDEC,
+    SSD1306_SETCOMPINS, 0x12,
+    SSD1306_SETCONTRAST, 0xCF,
+    SSD1306_SETPRECHARGE, 0xF1,
+    SSD1306_SETVCOMDETECT, 0x40,
+    SSD1306_DISPLAYALLON_RESUME,
+    SSD1306_NORMALDISPLAY,
+    SSD1306_DEACTIVATE_SCROLL,
+    SSD1306_DISPLAYON
+  };
+  Wire.beginTransmission(OLED_DIRECCION);
+  Wire.write((uint8_t)0x00);
+  Wire.write(comandos, sizeof(comandos));
+  return Wire.endTransmission() == 0;
+}
+
+void halIniciar() {
+  for (uint8_t l = 0; l < NUM_LECTORES; l++) {
+    pinMode(pinesLedVerde[l], OUTPUT);
+    pinMode(pinesLedRojo[l], OUTPUT);
+    // Todos los SS en alto antes de hablar con ninguno: uno flotando
+    // contestaría a la vez que el lector que se está iniciando
+    pinMode(pinesSSLector[l], OUTPUT);
+    digitalWrite(pinesSSLector[l], HIGH);
+  }
+  pinMode(BUZZER, OUTPUT);
+  digitalWrite(BUZZER, LOW);
+  
+  // Lectores RFID en el mismo bus SPI; el primero hace el reset por hardware
+  // (RST común) y los demás solo el reset por software
+  SPI.begin();
+  for (uint8_t l = 0; l < NUM_LECTORES; l++) {
+    lectores[l].PCD_Init(pinesSSLector[l], RST_PIN);
+  }
+  
+  // OLED por I2C
+  Wire.begin(OLED_SDA, OLED_SCL);
+  Wire.setClock(OLED_I2C_HZ);
+  if (!iniciarPanelOLED()) {
+    Serial.println("Error al inicializar OLED");
+    for(;;);
+  }
+  Serial.println("OLED inicializado correctamente");
+}
+
+void halLed(uint8_t pin, int nivel) {
+  digitalWrite(pin, nivel);
+}
+
+void halTono(unsigned int frecuencia, unsigned long duracionMs) {
+  tone(BUZZER, frecuencia, duracionMs);
+}
+
+void halSilencio() {
+  noTone(BUZZER);
+}
+
+uint32_t halCiclos() {
+  return ESP.getCycleCount();
+}
+
+uint32_t halCiclosPorUs() {
+  return ESP.getCpuFreqMHz();
+}
+
+void halConfigurarIrqLector() {
+  // Todas las líneas IRQ despiertan a la misma tarea; luego se mira cuál fue
+  for (uint8_t l = 0; l < NUM_LECTORES; l++) {
+    pinMode(pinesIrqLector[l], INPUT_PULLUP);
+    // IRqInv + RxIEn: la línea baja cuando llega una respuesta de tarjeta
+    lectores[l].PCD_WriteRegister(MFRC522::ComIEnReg, 0xA0);
+    halLimpiarIrqLector(l);
+    attachInterrupt(digitalPinToInterrupt(pinesIrqLector[l]), interrupcionLector, FALLING);
+  }
+}
+
+void halDesactivarIrqLector() {
+  for (uint8_t l = 0; l < NUM_LECTORES; l++) {
+    detachInterrupt(digitalPinToInterrupt(pinesIrqLector[l]));
+    lectores[l].PCD_WriteRegister(MFRC522::ComIEnReg, 0x80);
+  }
+}
+
+void halArmarREQA(uint8_t lector) {
+  // REQA de 7 bits con Transceive; si una tarjeta responde salta RxIRq. Misma
+  // preparación que PICC_REQA_or_WUPA: tras una colisión o un comando cortado
+  // el siguiente REQA se perdería sin ella
+  MFRC522& m = lectores[lector];
+  m.PCD_ClearRegisterBitMask(MFRC522::CollReg, 0x80);   // ValuesAfterColl: bits tras colisión a 0
+  m.PCD_WriteRegister(MFRC522::CommandReg, MFRC522::PCD_Idle);
+  m.PCD_WriteRegister(MFRC522::ComIrqReg, 0x7F);
+  m.PCD_WriteRegister(MFRC522::FIFOLevelReg, 0x80);
+  m.PCD_WriteRegister(MFRC522::FIFODataReg, MFRC522::PICC_CMD_REQA);
+  m.PCD_WriteRegister(MFRC522::BitFramingReg, 0x07);
+  m.PCD_WriteRegister(MFRC522::CommandReg, MFRC522::PCD_Transceive);
+  m.PCD_SetRegisterBitMask(MFRC522::BitFramingReg, 0x80); // StartSend
+}
+
+bool halRespuestaLector(uint8_t lector) {
+  // RxIRq: una tarjeta contestó al último REQA
+  return (lectores[lector].PCD_ReadRegister(MFRC522::ComIrqReg) & 0x20) != 0;
+}
+
+void halLimpiarIrqLector(uint8_t lector) {
+  lectores[lector].PCD_WriteRegister(MFRC522::ComIrqReg, 0x7F);
+}
+
+bool halHayTarjetaNueva(uint8_t lector) {
+  // El lector virtual hace de lector 0
+  if (LECTOR_VIRTUAL) return lector == 0 && colaLectorVirtual.ocupacion() > 0;
+  return lectores[lector].PICC_IsNewCardPresent();
+}
+
+bool halLeerUID(uint8_t lector, Uid& uid) {
+  if (LECTOR_VIRTUAL) return lector == 0 && colaLectorVirtual.desencolar(uid);
+  
+  // Tras el ATQA la tarjeta está lista para anticolisión y selección
+  MFRC522& m = lectores[lector];
+  if (!m.PICC_ReadCardSerial()) return false;
+  uid.asignar(m.uid.uidByte, m.uid.size);
+  m.PICC_HaltA();
+  return true;
+}
+
+bool halEnviarPantalla(uint8_t pagina, uint8_t desde, uint8_t hasta, const uint8_t* datos) {
+  // Ventana de escritura: una página, columnas desde..hasta (modo horizontal)
+  Wire.beginTransmission(OLED_DIRECCION);
+  Wire.write((uint8_t)0x00);
+  Wire.write((uint8_t)SSD1306_PAGEADDR);
+  Wire.write(pagina);
+  Wire.write(pagina);
+  Wire.write((uint8_t)SSD1306_COLUMNADDR);
+  Wire.write(desde);
+  Wire.write(hasta);
+  if (Wire.endTransmission() != 0) return false;
+  
+  size_t restante = hasta - desde + 1;
+  while (restante > 0) {
+    size_t bloque = restante > OLED_BLOQUE_I2C ? OLED_BLOQUE_I2C : restante;
+    Wire.beginTransmission(OLED_DIRECCION);
+    Wire.write((uint8_t)0x40);
+    Wire.write(datos, bloque);
+    if (Wire.endTransmission() != 0) return false;
+    datos += bloque;
+    restante -= bloque;
+  }
+  return true;
+}
+
+unsigned long halMillis() {
+  return millis();
+}
+
+// En IRAM: también la llama la interrupción del lector
+unsigned long IRAM_ATTR halMicros() {
+  return micros();
+}
+
+unsigned long halMicrosReales() {
+  return micros();
+}
+
+void halEsperar(uint32_t ms) {
+  delay(ms);
+}
+
+int64_t halRelojUs() {
+  return esp_timer_get_time();
+}
+
+void halHoraSistema(struct timeval& ahora) {
+  gettimeofday(&ahora, nullptr);
+}
+
+bool halHoraLocal(struct tm& hora) {
+  return getLocalTime(&hora);
+}
+
+void halIniciarNTP(void (*aviso)(struct timeval*)) {
+  configTime(gmtOffset_sec, daylightOffset_sec, ntpServer);
+  sntp_set_time_sync_notification_cb(aviso);
+}
+
+// Tarea de eventos WiFi: traduce al evento de la lógica y no hace nada más
+void eventoRadio(arduino_event_id_t evento, arduino_event_info_t info) {
+  if (evento == ARDUINO_EVENT_WIFI_STA_CONNECTED) {
+    avisoRed(RED_ASOCIADA);
+  } else if (evento == ARDUINO_EVENT_WIFI_STA_DISCONNECTED) {
+    // ASSOC_LEAVE es la desconexión que pide el propio firmware antes de
+    // reintentar, no una caída ni un intento fallido
+    if (info.wifi_sta_disconnected.reason != WIFI_REASON_ASSOC_LEAVE) avisoRed(RED_CAIDA);
+  } else if (evento == ARDUINO_EVENT_WIFI_STA_GOT_IP) {
+    avisoRed(RED_CON_IP);
+  }
+}
+
+void halIniciarWiFi(void (*aviso)(uint8_t evento)) {
+  avisoRed = aviso;
+  WiFi.persistent(false);
+  WiFi.mode(WIFI_STA);
+  WiFi.setAutoReconnect(false);
+  WiFi.onEvent(eventoRadio);
+}
+
+void halConectarWiFi(const char* red, const char* clave, uint8_t canal, const uint8_t* bssid) {
+  // Con canal y BSSID no hay escaneo
+  if (bssid != nullptr) {
+    WiFi.begin(red, clave, canal, bssid);
+  } else {
+    WiFi.begin(red, clave);
+  }
+}
+
+void halDesconectarWiFi() {
+  WiFi.disconnect();
+}
+
+void halConfigurarDireccion(uint32_t ip, uint32_t puerta, uint32_t mascara, uint32_t dns) {
+  // Todo a 0.0.0.0 activa el DHCP
+  WiFi.config(IPAddress(ip), IPAddress(puerta), IPAddress(mascara), IPAddress(dns));
+}
+
+bool halWiFiConectada() {
+  return WiFi.status() == WL_CONNECTED;
+}
+
+bool halLeerRed(RedGuardada& red) {
+  uint8_t* bssid = WiFi.BSSID();
+  if (bssid == nullptr) return false;
+  memset(&red, 0, sizeof(red));
+  memcpy(red.bssid, bssid, sizeof(red.bssid));
+  red.canal = WiFi.channel();
+  red.ip = WiFi.localIP();
+  red.puerta = WiFi.gatewayIP();
+  red.mascara = WiFi.subnetMask();
+  red.dns = WiFi.dnsIP();
+  return true;
+}
+
+uint32_t halIPLocal() {
+  return WiFi.localIP();
+}
+
+bool halLeerAjustes(const char* espacio, const char* clave, void* datos, size_t largo) {
+  preferencias.begin(espacio, true);
+  bool leido = preferencias.getBytes(clave, datos, largo) == largo;
+  preferencias.end();
+  return leido;
+}
+
+void halGuardarAjustes(const char* espacio, const char* clave, const void* datos, size_t largo) {
+  preferencias.begin(espacio, false);
+  preferencias.putBytes(clave, datos, largo);
+  preferencias.end();
+}
+
+bool halMontarArchivos() {
+  // Formatea la partición si no tiene sistema de archivos
+  return LittleFS.begin(true);
+}
+
+File halAbrirArchivo(const char* ruta, const char* modo, bool crear) {
+  return LittleFS.open(ruta, modo, crear);
+}
+
+bool halExisteArchivo(const char* ruta) {
+  return LittleFS.exists(ruta);
+}
+
+void halCrearDirectorio(const char* ruta) {
+  LittleFS.mkdir(ruta);
+}
+
+void halBorrarArchivo(const char* ruta) {
+  LittleFS.remove(ruta);
+}
+
+const uint8_t* halMapearLista(uint8_t particion, size_t& tamano) {
+  const char* etiquetas[2] = {"lista_a", "lista_b"};
+  const esp_partition_t* p = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, etiquetas[particion]);
+  if (!p) return nullptr;
+  
+  // No se libera el handle: la lista se consulta en el sitio mientras dure el programa
+  const void* mapa = nullptr;
+  spi_flash_mmap_handle_t handle;
+  if (esp_partition_mmap(p, 0, p->size, SPI_FLASH_MMAP_DATA, &mapa, &handle) != ESP_OK) return nullptr;
+  particionesLista[particion] = p;
+  tamano = p->size;
+  return (const uint8_t*)mapa;
+}
+
+bool halBorrarLista(uint8_t particion, size_t bytes) {
+  // Se borra por sectores enteros de 4 KB
+  size_t sectores = (bytes + 4095) & ~(size_t)4095;
+  return esp_partition_erase_range(particionesLista[particion], 0, sectores) == ESP_OK;
+}
+
+bool halEscribirLista(uint8_t particion, size_t offset, const void* datos, size_t bytes) {
+  return esp_partition_write(particionesLista[particion], offset, datos, bytes) == ESP_OK;
+}
+
+Client& halSocket(uint8_t socket) {
+  return socketsBackend[socket];
+}
+
+bool halConectarSocket(uint8_t socket, uint32_t timeoutMs) {
+  // Sin Nagle: cabeceras y cuerpo salen en cuanto se escriben
+  if (!socketsBackend[socket].connect(serverIP, serverPort, timeoutMs)) return false;
+  socketsBackend[socket].setNoDelay(true);
+  return true;
+}
+
+void halIniciarServidorMetricas() {
+#if PUERTO_METRICAS
+  servidorMetricas.begin();
+#endif
+}
+
+Client* halClienteMetricas() {
+#if PUERTO_METRICAS
+  clienteMetricas = servidorMetricas.available();
+  if (clienteMetricas) return &clienteMetricas;
+#endif
+  return nullptr;
+}
+
+// Bloques vivos reservados por la tarea que llama, según el seguimiento por
+// tarea del heap. Lo que se reserva y se libera entre dos lecturas no se ve,
+// pero sí lo que la ruta de la tarjeta deja reservado
+size_t halReservasTarea() {
+#if COMPROBAR_HEAP
+  TaskHandle_t tarea = xTaskGetCurrentTaskHandle();
+  heap_task_totals_t totales[1] = {};
+  size_t numTotales = 0;
+  heap_task_info_params_t parametros = {};
+  parametros.caps[0] = MALLOC_CAP_8BIT;
+  parametros.mask[0] = MALLOC_CAP_8BIT;
+  parametros.tasks = &tarea;
+  parametros.num_tasks = 1;
+  parametros.totals = totales;
+  parametros.num_totals = &numTotales;
+  parametros.max_totals = 1;
+  heap_caps_get_per_task_info(&parametros);
+  return numTotales > 0 ? totales[0].count[0] : 0;
+#else
+  return 0;
+#endif
+}
+
+#endif
+
+// ==================== MONITOR SERIE ====================
+
+// Lee líneas sin bloquear: "pantalla" vuelca el framebuffer en PBM,
+// "metricas" imprime los histogramas de latencia, "memoria" el historial
+// de heap y pilas, con LECTOR_VIRTUAL
+// "tarjeta <uid hex>" simula acercar una tarjeta y con BANCO_PRUEBAS
+// "toque" carga una traza y "banco" la reproduce
+void atenderSerie() {
+  static char linea[48];
+  static uint8_t largo = 0;
+  
+  while (Serial.available() > 0) {
+    char c = Serial.read();
+    if (c != '\n' && c != '\r') {
+      if (largo < sizeof(linea) - 1) linea[largo++] = c;
+      continue;
+    }
+    if (largo == 0) continue;
+    linea[largo] = '\0';
+    largo = 0;
+    
+    if (strcmp(linea, "pantalla") == 0) {
+      volcarPBM();
+    } else if (strcmp(linea, "metricas") == 0) {
+      escribirMetricas(Serial);
+    } else if (strcmp(linea, "memoria") == 0) {
+      imprimirMemoria(Serial);
+    } else if (BANCO_PRUEBAS && strcmp(linea, "banco") == 0) {
+      iniciarBanco();
+    } else if (BANCO_PRUEBAS && strncmp(linea, "toque ", 6) == 0) {
+      // Traza grabada: "toque <ms desde el inicio> <uid hex>", en orden
+      char* resto;
+      uint32_t ms = strtoul(linea + 6, &resto, 10);
+      while (*resto == ' ') resto++;
+      uint8_t bytes[UID_MAX];
+      uint8_t n = 0;
+      for (const char* h = resto; h[0] != '\0' && h[1] != '\0' && n < UID_MAX; h += 2) {
+        char par[3] = {h[0], h[1], '\0'};
+        bytes[n++] = strtoul(par, nullptr, 16);
+      }
+      if (n == 0 || toquesTraza >= BANCO_MAX_TOQUES || estadoBanco != BANCO_PARADO) {
+        Serial.println("Toque no aceptado");
+      } else {
+        trazaBanco[toquesTraza].ms = ms;
+        trazaBanco[toquesTraza].uid.asignar(bytes, n);
+        trazaBanco[toquesTraza].lector = 0;
+        toquesTraza++;
+      }
+    } else if (LECTOR_VIRTUAL && strncmp(linea, "tarjeta ", 8) == 0) {
+      uint8_t bytes[UID_MAX];
+      uint8_t n = 0;
+      for (const char* h = linea + 8; h[0] != '\0' && h[1] != '\0' && n < UID_MAX; h += 2) {
+        char par[3] = {h[0], h[1], '\0'};
+        bytes[n++] = strtoul(par, nullptr, 16);
+      }
+      Uid uid;
+      uid.asignar(bytes, n);
+      if (n == 0 || !colaLectorVirtual.encolar(uid)) {
+        Serial.println("Tarjeta virtual no aceptada");
+      }
+    } else {
+      Serial.print("Comando desconocido: ");
+      Serial.println(linea);
+    }
+  }
+}
+
+void volcarPBM() {
+  // PBM binario (P4): filas de izquierda a derecha, bit más alto primero,
+  // 1 = píxel encendido. Entre marcas para separarlo del resto del log
+  const uint8_t* buffer = lienzo.getBuffer();
+  Serial.println("--- PBM ---");
+  Serial.print("P4\n");
+  Serial.print(SCREEN_WIDTH);
+  Serial.print(" ");
+  Serial.print(SCREEN_HEIGHT);
+  Serial.print("\n");
+  for (int y = 0; y < SCREEN_HEIGHT; y++) {
+    uint8_t fila[SCREEN_WIDTH / 8];
+    for (int b = 0; b < SCREEN_WIDTH / 8; b++) {
+      uint8_t bits = 0;
+      for (int i = 0; i < 8; i++) {
+        int x = b * 8 + i;
+        if ((buffer[(y / 8) * SCREEN_WIDTH + x] >> (y & 7)) & 1) bits |= 0x80 >> i;
+      }
+      fila[b] = bits;
+    }
+    Serial.write(fila, sizeof(fila));
   }
+  Serial.println();
+  Serial.println("--- FIN PBM ---");
 }
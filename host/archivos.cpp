@@ -0,0 +1,178 @@
+// Flash del build nativo: LittleFS sobre una carpeta del host, las dos
+// particiones de la lista blanca en memoria (borradas a 0xFF, como la flash
+// nueva) y el NVS de Preferences como un mapa
+
+#include <FS.h>
+#include <dirent.h>
+#include <map>
+#include <sys/stat.h>
+#include <vector>
+#include "nativo.h"
+
+struct ArchivoNativo {
+  FILE* archivo = nullptr;
+  std::string nombre;
+  std::string ruta;                     // Ruta dentro de la partición
+  DIR* dir = nullptr;
+
+  ~ArchivoNativo() {
+    if (archivo != nullptr) fclose(archivo);
+    if (dir != nullptr) closedir(dir);
+  }
+};
+
+namespace {
+
+const size_t TAMANO_PARTICION_LISTA = 0x10000;
+
+std::string carpeta = "fs";
+std::vector<uint8_t> particiones[2];
+std::map<std::string, std::vector<uint8_t>> ajustes;
+
+std::string rutaHost(const char* ruta) {
+  return carpeta + (ruta[0] == '/' ? "" : "/") + ruta;
+}
+
+void crearPadres(const std::string& ruta) {
+  for (size_t i = carpeta.size() + 1; (i = ruta.find('/', i)) != std::string::npos; i++) {
+    mkdir(ruta.substr(0, i).c_str(), 0755);
+  }
+}
+
+File abrir(const std::string& ruta, const char* modo) {
+  std::string host = rutaHost(ruta.c_str());
+  auto archivo = std::make_shared<ArchivoNativo>();
+  archivo->ruta = ruta;
+  archivo->nombre = ruta.substr(ruta.rfind('/') + 1);
+
+  struct stat info;
+  if (strcmp(modo, FILE_READ) == 0 && stat(host.c_str(), &info) == 0 && S_ISDIR(info.st_mode)) {
+    archivo->dir = opendir(host.c_str());
+    return archivo->dir ? File(archivo) : File();
+  }
+  const char* modoHost = strcmp(modo, FILE_APPEND) == 0 ? "ab+" : strcmp(modo, FILE_WRITE) == 0 ? "wb+" : "rb";
+  archivo->archivo = fopen(host.c_str(), modoHost);
+  return archivo->archivo ? File(archivo) : File();
+}
+
+}
+
+size_t File::write(const uint8_t* datos, size_t largo) {
+  if (!_archivo || !_archivo->archivo) return 0;
+  return fwrite(datos, 1, largo, _archivo->archivo);
+}
+
+int File::available() {
+  if (!_archivo || !_archivo->archivo) return 0;
+  return (int)(size() - position());
+}
+
+int File::read() {
+  uint8_t c;
+  return read(&c, 1) == 1 ? c : -1;
+}
+
+size_t File::read(uint8_t* destino, size_t largo) {
+  if (!_archivo || !_archivo->archivo) return 0;
+  return fread(destino, 1, largo, _archivo->archivo);
+}
+
+int File::peek() {
+  if (!_archivo || !_archivo->archivo) return -1;
+  int c = fgetc(_archivo->archivo);
+  if (c != EOF) ungetc(c, _archivo->archivo);
+  return c == EOF ? -1 : c;
+}
+
+void File::flush() {
+  if (_archivo && _archivo->archivo) fflush(_archivo->archivo);
+}
+
+bool File::seek(uint32_t posicion, SeekMode modo) {
+  if (!_archivo || !_archivo->archivo) return false;
+  int origen = modo == SeekCur ? SEEK_CUR : modo == SeekEnd ? SEEK_END : SEEK_SET;
+  return fseek(_archivo->archivo, posicion, origen) == 0;
+}
+
+size_t File::position() const {
+  if (!_archivo || !_archivo->archivo) return 0;
+  return (size_t)ftell(_archivo->archivo);
+}
+
+size_t File::size() const {
+  if (!_archivo || !_archivo->archivo) return 0;
+  fflush(_archivo->archivo);
+  struct stat info;
+  return fstat(fileno(_archivo->archivo), &info) == 0 ? (size_t)info.st_size : 0;
+}
+
+void File::close() {
+  _archivo.reset();
+}
+
+const char* File::name() const {
+  return _archivo ? _archivo->nombre.c_str() : "";
+}
+
+bool File::isDirectory() const {
+  return _archivo && _archivo->dir != nullptr;
+}
+
+File File::openNextFile(const char* modo) {
+  if (!isDirectory()) return File();
+  while (dirent* entrada = readdir(_archivo->dir)) {
+    if (strcmp(entrada->d_name, ".") == 0 || strcmp(entrada->d_name, "..") == 0) continue;
+    return abrir(_archivo->ruta + "/" + entrada->d_name, modo);
+  }
+  return File();
+}
+
+namespace nativo {
+
+void fijarCarpetaArchivos(const std::string& ruta) {
+  carpeta = ruta;
+}
+
+bool montarArchivos() {
+  mkdir(carpeta.c_str(), 0755);
+  struct stat info;
+  return stat(carpeta.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+File abrirArchivo(const char* ruta, const char* modo, bool crear) {
+  if (crear) crearPadres(rutaHost(ruta));
+  return abrir(ruta, modo);
+}
+
+bool existeArchivo(const char* ruta) {
+  struct stat info;
+  return stat(rutaHost(ruta).c_str(), &info) == 0;
+}
+
+void crearDirectorio(const char* ruta) {
+  mkdir(rutaHost(ruta).c_str(), 0755);
+}
+
+void borrarArchivo(const char* ruta) {
+  remove(rutaHost(ruta).c_str());
+}
+
+uint8_t* particionLista(uint8_t particion, size_t& tamano) {
+  if (particion > 1) return nullptr;
+  if (particiones[particion].empty()) particiones[particion].assign(TAMANO_PARTICION_LISTA, 0xFF);
+  tamano = particiones[particion].size();
+  return particiones[particion].data();
+}
+
+bool leerAjustes(const std::string& clave, void* datos, size_t largo) {
+  auto it = ajustes.find(clave);
+  if (it == ajustes.end() || it->second.size() != largo) return false;
+  memcpy(datos, it->second.data(), largo);
+  return true;
+}
+
+void guardarAjustes(const std::string& clave, const void* datos, size_t largo) {
+  ajustes[clave].assign((const uint8_t*)datos, (const uint8_t*)datos + largo);
+}
+
+}
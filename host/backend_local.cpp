@@ -0,0 +1,196 @@
+// Backend local del build nativo: los sockets del firmware hablan HTTP/1.1
+// con un servidor en proceso que atiende las rutas de RfidController.cpp.
+// La respuesta queda disponible tras la latencia configurada, en reloj
+// virtual, y al tirar el backend se cortan las conexiones abiertas
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <map>
+#include <set>
+#include "nativo.h"
+
+namespace {
+
+bool caido = false;
+uint32_t latenciaMs = 20;
+uint32_t generacion = 0;                // Cambia al caer el backend: corta lo abierto
+std::map<std::string, std::string> tarjetas;
+std::map<std::string, uint32_t> latenciasRuta;  // Por ruta, en vez de latenciaMs
+std::set<std::string> rutasQuitadas;            // Contestan 404, como un backend sin ellas
+
+std::string mayusculas(std::string texto) {
+  for (char& c : texto) c = toupper((unsigned char)c);
+  return texto;
+}
+
+std::string nombreTarjeta(const std::string& uid) {
+  auto it = tarjetas.find(mayusculas(uid));
+  return it == tarjetas.end() ? "" : it->second;
+}
+
+// Devuelve el código HTTP y deja el cuerpo JSON de la respuesta
+int atender(const std::string& metodo, const std::string& ruta, const std::string& cuerpo, std::string& respuesta) {
+  static const std::string verificar = "/api/rfid/verificar/";
+  static const std::string telegram = "/api/telegramnotifications/";
+  std::string camino = ruta.substr(0, ruta.find('?'));
+  respuesta = "{}";
+  if (rutasQuitadas.count(camino)) return 404;
+
+  if (camino == "/api/rfid/toque") {
+    if (metodo == "OPTIONS") return 200;
+    StaticJsonDocument<256> doc;
+    if (deserializeJson(doc, cuerpo.c_str(), cuerpo.size())) return 400;
+    const char* uid = doc["codigoRFID"];
+    std::string nombre = nombreTarjeta(uid ? uid : "");
+    respuesta = nombre.empty() ? "{\"resultado\":\"denegado\"}"
+                               : "{\"resultado\":\"permitido\",\"nombreEmpleado\":\"" + nombre + "\"}";
+    return 200;
+  }
+  if (metodo == "GET" && camino.compare(0, verificar.size(), verificar) == 0) {
+    std::string nombre = nombreTarjeta(camino.substr(verificar.size()));
+    respuesta = nombre.empty() ? "{\"valida\":false}"
+                               : "{\"valida\":true,\"nombreEmpleado\":\"" + nombre + "\"}";
+    return 200;
+  }
+  if (metodo == "POST" && camino == "/api/fichajes/rfid/lote") {
+    StaticJsonDocument<4096> doc;
+    if (deserializeJson(doc, cuerpo.c_str(), cuerpo.size())) return 400;
+    respuesta = "{\"resultados\":[";
+    bool primero = true;
+    for (JsonVariant fichaje : doc["fichajes"].as<JsonArray>()) {
+      uint32_t secuencia = fichaje["secuencia"];
+      respuesta += (primero ? "" : ",") + std::string("{\"secuencia\":") + std::to_string(secuencia) + ",\"ok\":true}";
+      primero = false;
+    }
+    respuesta += "]}";
+    return 200;
+  }
+  if (metodo == "POST" && (camino == "/api/fichajes/rfid" || camino == "/api/Rfid/capture/unknown" ||
+                           camino.compare(0, telegram.size(), telegram) == 0)) {
+    return 200;
+  }
+  // Sin lista blanca ni suscripción: el firmware decide con el backend
+  return 404;
+}
+
+class SocketLocal : public Client {
+ public:
+  bool abrir() {
+    stop();
+    if (caido) return false;
+    _abierto = true;
+    _generacion = generacion;
+    return true;
+  }
+
+  int connect(IPAddress ip, uint16_t puerto) override { return abrir(); }
+  int connect(const char* host, uint16_t puerto) override { return abrir(); }
+
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t* datos, size_t largo) override {
+    if (!connected()) return 0;
+    _peticion.append((const char*)datos, largo);
+    procesar();
+    return largo;
+  }
+
+  int available() override {
+    if (!connected() || nativo::ahoraUs() < _disponibleUs) return 0;
+    return (int)(_respuesta.size() - _leidos);
+  }
+  int read() override {
+    uint8_t c;
+    return read(&c, 1) == 1 ? c : -1;
+  }
+  int read(uint8_t* destino, size_t largo) override {
+    size_t n = min(largo, (size_t)available());
+    memcpy(destino, _respuesta.data() + _leidos, n);
+    _leidos += n;
+    return (int)n;
+  }
+  int peek() override { return available() > 0 ? (uint8_t)_respuesta[_leidos] : -1; }
+  void flush() override {}
+
+  void stop() override {
+    _abierto = false;
+    _peticion.clear();
+    _respuesta.clear();
+    _leidos = 0;
+  }
+  uint8_t connected() override { return _abierto && _generacion == generacion; }
+  operator bool() override { return connected(); }
+
+ private:
+  // Atiende cada petición en cuanto tiene las cabeceras y el cuerpo completos
+  void procesar() {
+    for (;;) {
+      size_t finCabeceras = _peticion.find("\r\n\r\n");
+      if (finCabeceras == std::string::npos) return;
+      size_t largoCuerpo = 0;
+      size_t pos = _peticion.find("Content-Length:");
+      if (pos != std::string::npos && pos < finCabeceras) largoCuerpo = strtoul(_peticion.c_str() + pos + 15, nullptr, 10);
+      if (_peticion.size() < finCabeceras + 4 + largoCuerpo) return;
+
+      std::string linea = _peticion.substr(0, _peticion.find("\r\n"));
+      std::string metodo = linea.substr(0, linea.find(' '));
+      std::string ruta = linea.substr(metodo.size() + 1, linea.rfind(' ') - metodo.size() - 1);
+      std::string cuerpo = _peticion.substr(finCabeceras + 4, largoCuerpo);
+      _peticion.erase(0, finCabeceras + 4 + largoCuerpo);
+
+      std::string json;
+      int codigo = atender(metodo, ruta, cuerpo, json);
+      nativo::escribirSerie(("[backend] " + metodo + " " + ruta + " -> " + std::to_string(codigo) + "\n").c_str());
+      if (metodo == "HEAD") json.clear();
+      _respuesta += "HTTP/1.1 " + std::to_string(codigo) + (codigo == 200 ? " OK" : " Error") + "\r\n"
+                    "Content-Type: application/json\r\n"
+                    "Content-Length: " + std::to_string(json.size()) + "\r\n"
+                    "Connection: keep-alive\r\n\r\n" + json;
+      auto latencia = latenciasRuta.find(ruta.substr(0, ruta.find('?')));
+      _disponibleUs = nativo::ahoraUs() + (uint64_t)(latencia != latenciasRuta.end() ? latencia->second : latenciaMs) * 1000;
+    }
+  }
+
+  bool _abierto = false;
+  uint32_t _generacion = 0;
+  std::string _peticion;
+  std::string _respuesta;
+  size_t _leidos = 0;
+  uint64_t _disponibleUs = 0;
+};
+
+SocketLocal sockets[2];
+
+}
+
+namespace nativo {
+
+Client& socketBackend(uint8_t socket) {
+  return sockets[socket];
+}
+
+bool conectarSocket(uint8_t socket) {
+  return sockets[socket].abrir();
+}
+
+void backendCaido(bool estado) {
+  caido = estado;
+  if (caido) generacion++;
+}
+
+void latenciaBackend(uint32_t ms) {
+  latenciaMs = ms;
+}
+
+void latenciaRuta(const std::string& ruta, uint32_t ms) {
+  latenciasRuta[ruta] = ms;
+}
+
+void quitarRuta(const std::string& ruta) {
+  rutasQuitadas.insert(ruta);
+}
+
+void altaTarjeta(const std::string& uid, const std::string& nombre) {
+  tarjetas[mayusculas(uid)] = nombre;
+}
+
+}
@@ -0,0 +1,206 @@
+// Capa de hardware del build nativo (HAL_NATIVO). Se incluye dentro de
+// RfidController.cpp, en la sección de la capa de hardware, y reenvía cada
+// función al entorno simulado de host/nativo.h: reloj virtual, radio, flash
+// en una carpeta del host y un backend local en proceso
+#pragma once
+
+#include <chrono>
+#include "nativo.h"
+
+void halIniciar() {
+  Serial.println("OLED inicializado correctamente");
+}
+
+// Sin LEDs ni zumbador: las animaciones se siguen por el monitor serie
+void halLed(uint8_t pin, int nivel) {}
+
+void halTono(unsigned int frecuencia, unsigned long duracionMs) {}
+
+void halSilencio() {}
+
+// Ciclos de un ESP32 a 240 MHz sobre el reloj virtual
+uint32_t halCiclos() {
+  return (uint32_t)(nativo::ahoraUs() * 240);
+}
+
+uint32_t halCiclosPorUs() {
+  return 240;
+}
+
+// El lector virtual no tiene línea IRQ: deteccionIrq queda a false
+void halConfigurarIrqLector() {}
+
+void halDesactivarIrqLector() {}
+
+void halArmarREQA(uint8_t lector) {}
+
+bool halRespuestaLector(uint8_t lector) {
+  return false;
+}
+
+void halLimpiarIrqLector(uint8_t lector) {}
+
+bool halHayTarjetaNueva(uint8_t lector) {
+  return lector == 0 && colaLectorVirtual.ocupacion() > 0;
+}
+
+bool halLeerUID(uint8_t lector, Uid& uid) {
+  return lector == 0 && colaLectorVirtual.desencolar(uid);
+}
+
+bool halEnviarPantalla(uint8_t pagina, uint8_t desde, uint8_t hasta, const uint8_t* datos) {
+  nativo::escribirPanel(pagina, desde, hasta, datos);
+  return true;
+}
+
+unsigned long halMillis() {
+  return (unsigned long)(nativo::ahoraUs() / 1000);
+}
+
+unsigned long halMicros() {
+  return (unsigned long)nativo::ahoraUs();
+}
+
+// Tiempo de CPU de verdad, para medir cálculo: el reloj virtual no avanza
+unsigned long halMicrosReales() {
+  return (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void halEsperar(uint32_t ms) {
+  nativo::dormir((uint64_t)ms * 1000);
+}
+
+int64_t halRelojUs() {
+  return (int64_t)nativo::ahoraUs();
+}
+
+void halHoraSistema(struct timeval& ahora) {
+  // Antes del NTP, como el ESP32: segundos desde el arranque
+  int64_t us = nativo::horaSincronizada() ? nativo::horaUnixUs() : (int64_t)nativo::ahoraUs();
+  ahora.tv_sec = us / 1000000;
+  ahora.tv_usec = us % 1000000;
+}
+
+bool halHoraLocal(struct tm& hora) {
+  if (!nativo::horaSincronizada()) return false;
+  time_t segundos = nativo::horaUnixUs() / 1000000 + gmtOffset_sec + daylightOffset_sec;
+  gmtime_r(&segundos, &hora);
+  return true;
+}
+
+void halIniciarNTP(void (*aviso)(struct timeval*)) {
+  nativo::iniciarNTP(aviso);
+}
+
+void halIniciarWiFi(void (*aviso)(uint8_t evento)) {
+  // EventoRadio y EventoRed van en el mismo orden
+  static_assert((uint8_t)nativo::RADIO_ASOCIADA == RED_ASOCIADA && (uint8_t)nativo::RADIO_CAIDA == RED_CAIDA &&
+                (uint8_t)nativo::RADIO_CON_IP == RED_CON_IP, "eventos de radio desalineados");
+  nativo::iniciarRadio(aviso);
+}
+
+void halConectarWiFi(const char* red, const char* clave, uint8_t canal, const uint8_t* bssid) {
+  // Sin canal ni BSSID guardados el ESP32 escanea antes de asociarse
+  nativo::conectarRadio(bssid == nullptr);
+}
+
+void halDesconectarWiFi() {
+  nativo::desconectarRadio();
+}
+
+void halConfigurarDireccion(uint32_t ip, uint32_t puerta, uint32_t mascara, uint32_t dns) {
+  nativo::direccionFija(ip != 0);
+}
+
+bool halWiFiConectada() {
+  return nativo::radioConectada();
+}
+
+bool halLeerRed(RedGuardada& red) {
+  if (!nativo::radioConectada()) return false;
+  static const uint8_t bssid[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+  memset(&red, 0, sizeof(red));
+  memcpy(red.bssid, bssid, sizeof(red.bssid));
+  red.canal = 6;
+  red.ip = nativo::ipRadio();
+  red.puerta = IPAddress(192, 168, 1, 1);
+  red.mascara = IPAddress(255, 255, 255, 0);
+  red.dns = IPAddress(192, 168, 1, 1);
+  return true;
+}
+
+uint32_t halIPLocal() {
+  return nativo::ipRadio();
+}
+
+bool halLeerAjustes(const char* espacio, const char* clave, void* datos, size_t largo) {
+  return nativo::leerAjustes(std::string(espacio) + "/" + clave, datos, largo);
+}
+
+void halGuardarAjustes(const char* espacio, const char* clave, const void* datos, size_t largo) {
+  nativo::guardarAjustes(std::string(espacio) + "/" + clave, datos, largo);
+}
+
+bool halMontarArchivos() {
+  return nativo::montarArchivos();
+}
+
+File halAbrirArchivo(const char* ruta, const char* modo, bool crear) {
+  return nativo::abrirArchivo(ruta, modo, crear);
+}
+
+bool halExisteArchivo(const char* ruta) {
+  return nativo::existeArchivo(ruta);
+}
+
+void halCrearDirectorio(const char* ruta) {
+  nativo::crearDirectorio(ruta);
+}
+
+void halBorrarArchivo(const char* ruta) {
+  nativo::borrarArchivo(ruta);
+}
+
+const uint8_t* halMapearLista(uint8_t particion, size_t& tamano) {
+  return nativo::particionLista(particion, tamano);
+}
+
+bool halBorrarLista(uint8_t particion, size_t bytes) {
+  size_t tamano;
+  uint8_t* mapa = nativo::particionLista(particion, tamano);
+  size_t sectores = (bytes + 4095) & ~(size_t)4095;
+  if (sectores > tamano) return false;
+  memset(mapa, 0xFF, sectores);
+  return true;
+}
+
+bool halEscribirLista(uint8_t particion, size_t offset, const void* datos, size_t bytes) {
+  // Como la flash: escribir solo baja bits, hay que borrar antes
+  size_t tamano;
+  uint8_t* mapa = nativo::particionLista(particion, tamano);
+  if (offset + bytes > tamano) return false;
+  const uint8_t* origen = (const uint8_t*)datos;
+  for (size_t i = 0; i < bytes; i++) mapa[offset + i] &= origen[i];
+  return true;
+}
+
+Client& halSocket(uint8_t socket) {
+  return nativo::socketBackend(socket);
+}
+
+bool halConectarSocket(uint8_t socket, uint32_t timeoutMs) {
+  return nativo::conectarSocket(socket);
+}
+
+// Las métricas por HTTP se prueban en el dispositivo; aquí salen por serie
+void halIniciarServidorMetricas() {}
+
+Client* halClienteMetricas() {
+  return nullptr;
+}
+
+// Cada malloc y new del hilo de la tarea, también los ya liberados
+size_t halReservasTarea() {
+  return nativo::reservasHilo();
+}
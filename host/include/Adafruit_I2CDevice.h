@@ -0,0 +1,3 @@
+// Adafruit_GFX incluye los dispositivos de Adafruit BusIO para Adafruit_SPITFT,
+// que el firmware no usa: en el build nativo no hace falta nada de ellos
+#pragma once
@@ -0,0 +1,2 @@
+// Ver Adafruit_I2CDevice.h
+#pragma once
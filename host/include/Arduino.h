@@ -0,0 +1,138 @@
+// Núcleo de Arduino para el build nativo (HAL_NATIVO): solo lo que usa
+// RfidController.cpp. Sin millis(), micros() ni delay(): la lógica llega al
+// reloj por la capa de hardware y aquí no tiene por dónde saltársela
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <time.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <deque>
+#include <string>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define IRAM_ATTR
+#define HIGH 0x1
+#define LOW 0x0
+#define DEC 10
+#define HEX 16
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+using std::min;
+using std::max;
+
+// Solo para las firmas de la Adafruit_GFX de verdad (getTextBounds y print
+// con F()): el firmware no usa String ni cadenas en flash
+class __FlashStringHelper;
+#define F(texto) (reinterpret_cast<const __FlashStringHelper*>(texto))
+
+class String {
+ public:
+  String(const char* texto = "") : _texto(texto) {}
+  const char* c_str() const { return _texto.c_str(); }
+  unsigned int length() const { return (unsigned int)_texto.size(); }
+ private:
+  std::string _texto;
+};
+
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t* datos, size_t largo);
+  size_t write(const char* texto) { return texto ? write((const uint8_t*)texto, strlen(texto)) : 0; }
+
+  size_t print(const char* texto) { return write(texto); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(unsigned char n, int base = DEC) { return print((unsigned long long)n, base); }
+  size_t print(int n, int base = DEC) { return print((long long)n, base); }
+  size_t print(unsigned int n, int base = DEC) { return print((unsigned long long)n, base); }
+  size_t print(long n, int base = DEC) { return print((long long)n, base); }
+  size_t print(unsigned long n, int base = DEC) { return print((unsigned long long)n, base); }
+  size_t print(long long n, int base = DEC);
+  size_t print(unsigned long long n, int base = DEC);
+  size_t print(double n, int decimales = 2);
+
+  size_t println() { return write("\r\n"); }
+  template<class T> size_t println(T valor) { size_t n = print(valor); return n + println(); }
+  template<class T> size_t println(T valor, int formato) { size_t n = print(valor, formato); return n + println(); }
+};
+
+class Stream : public Print {
+ public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  virtual void flush() {}
+
+  void setTimeout(unsigned long timeoutMs) { _timeoutMs = timeoutMs; }
+  size_t readBytes(char* destino, size_t largo);
+  size_t readBytes(uint8_t* destino, size_t largo) { return readBytes((char*)destino, largo); }
+  size_t readBytesUntil(char terminador, char* destino, size_t largo);
+
+ protected:
+  // Como en el core: espera hasta el timeout, aquí cediendo el reloj virtual
+  int timedRead();
+  unsigned long _timeoutMs = 1000;
+};
+
+class IPAddress {
+ public:
+  IPAddress() : _direccion(0) {}
+  IPAddress(uint32_t direccion) : _direccion(direccion) {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+    : _direccion(a | (b << 8) | (c << 16) | ((uint32_t)d << 24)) {}
+  bool fromString(const char* texto);
+  operator uint32_t() const { return _direccion; }
+  uint8_t operator[](int i) const { return (_direccion >> (8 * i)) & 0xFF; }
+ private:
+  uint32_t _direccion;  // Primer octeto en el byte bajo
+};
+
+class Client : public Stream {
+ public:
+  virtual int connect(IPAddress ip, uint16_t puerto) = 0;
+  virtual int connect(const char* host, uint16_t puerto) = 0;
+  size_t write(uint8_t c) override = 0;
+  size_t write(const uint8_t* datos, size_t largo) override = 0;
+  int available() override = 0;
+  int read() override = 0;
+  virtual int read(uint8_t* destino, size_t largo) = 0;
+  int peek() override = 0;
+  void flush() override = 0;
+  virtual void stop() = 0;
+  virtual uint8_t connected() = 0;
+  virtual operator bool() = 0;
+};
+
+// Monitor serie: la entrada la escribe el guion de la prueba y la salida va a
+// stdout y a la copia en la que el guion busca lo esperado
+class HardwareSerial : public Stream {
+ public:
+  void begin(unsigned long baudios) {}
+  int available() override { return (int)_entrada.size(); }
+  int read() override;
+  int peek() override { return _entrada.empty() ? -1 : (uint8_t)_entrada.front(); }
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t* datos, size_t largo) override;
+  using Print::write;
+
+  void inyectar(const std::string& texto) { _entrada.insert(_entrada.end(), texto.begin(), texto.end()); }
+  const std::string& salida() const { return _salida; }
+
+ private:
+  std::deque<char> _entrada;
+  std::string _salida;
+};
+
+extern HardwareSerial Serial;
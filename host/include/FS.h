@@ -0,0 +1,40 @@
+// fs::File para el build nativo: archivos y directorios del host bajo la
+// carpeta que hace de partición (ver host/archivos.cpp)
+#pragma once
+
+#include <memory>
+#include "Arduino.h"
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+enum SeekMode { SeekSet = 0, SeekCur = 1, SeekEnd = 2 };
+
+struct ArchivoNativo;
+
+class File : public Stream {
+ public:
+  File() = default;
+  explicit File(std::shared_ptr<ArchivoNativo> archivo) : _archivo(archivo) {}
+
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t* datos, size_t largo) override;
+  int available() override;
+  int read() override;
+  size_t read(uint8_t* destino, size_t largo);
+  int peek() override;
+  void flush() override;
+  bool seek(uint32_t posicion, SeekMode modo = SeekSet);
+  size_t position() const;
+  size_t size() const;
+  void close();
+  operator bool() const { return _archivo != nullptr; }
+
+  const char* name() const;
+  bool isDirectory() const;
+  File openNextFile(const char* modo = FILE_READ);
+
+ private:
+  std::shared_ptr<ArchivoNativo> _archivo;
+};
@@ -0,0 +1,4 @@
+// Adafruit_GFX incluye Print.h aparte; aquí Print está en Arduino.h
+#pragma once
+
+#include "Arduino.h"
@@ -0,0 +1,6 @@
+#pragma once
+
+#include <stdint.h>
+
+// CRC-32 de la ROM del ESP32: entrada y salida invertidas, así se encadena
+uint32_t esp_crc32_le(uint32_t crc, const uint8_t* datos, uint32_t largo);
@@ -0,0 +1,25 @@
+// FreeRTOS para el build nativo: las tareas son hilos del planificador
+// cooperativo de host/planificador.cpp y un tick es 1 ms del reloj virtual
+#pragma once
+
+#include <stdint.h>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+typedef void* TaskHandle_t;
+typedef void (*TaskFunction_t)(void*);
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdPASS 1
+#define portMAX_DELAY 0xFFFFFFFFUL
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+
+// Solo corre una tarea a la vez y nunca se la desaloja a mitad de código:
+// las secciones críticas no tienen nada que excluir
+typedef struct { int reservado; } portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED {0}
+#define portENTER_CRITICAL(mux) ((void)(mux))
+#define portEXIT_CRITICAL(mux) ((void)(mux))
+#define portYIELD_FROM_ISR() ((void)0)
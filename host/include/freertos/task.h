@@ -0,0 +1,12 @@
+#pragma once
+
+#include "FreeRTOS.h"
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t funcion, const char* nombre, uint32_t pila, void* parametro,
+                                   UBaseType_t prioridad, TaskHandle_t* tarea, BaseType_t nucleo);
+TaskHandle_t xTaskGetCurrentTaskHandle();
+void vTaskDelay(TickType_t ticks);
+uint32_t ulTaskNotifyTake(BaseType_t limpiar, TickType_t espera);
+BaseType_t xTaskNotifyGive(TaskHandle_t tarea);
+void vTaskNotifyGiveFromISR(TaskHandle_t tarea, BaseType_t* despertar);
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t tarea);
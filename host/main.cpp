@@ -0,0 +1,229 @@
+// Arranque del build nativo: corre setup() y loop() de RfidController.cpp
+// sobre el reloj virtual mientras un guion mueve el entorno y comprueba el
+// monitor serie. Uso: rfid_nativo <guion> [carpeta de la flash]
+//
+// Cada línea del guion es "<ms> <acción> [argumentos]", en ms de reloj
+// virtual desde el arranque ('#' comenta):
+//   serie <texto>            escribe una línea en el monitor serie
+//   espera <texto>           el texto tiene que haber salido por serie después
+//                            de lo último que encontró otra "espera"
+//   dentro <ms> <texto>      el texto tiene que salir por serie en menos de <ms>
+//   nunca <texto>            el texto no puede salir por serie desde ahora
+//                            hasta el final de la prueba
+//   maximo <n> <patrón>      cada línea que encaje con el patrón desde ahora
+//                            hasta el final (o hasta otro maximo con el mismo
+//                            patrón) lleva un número que no pasa de <n>, y
+//                            tiene que salir al menos una. En el patrón '*' es
+//                            una palabra cualquiera y '#' el número
+//   backend caido|activo     tira o levanta el backend (caído rechaza conexiones)
+//   backend latencia <ms>    retraso de las respuestas del backend
+//   backend lenta <ruta> <ms>  retraso de las respuestas de una ruta
+//   backend sin <ruta>       la ruta contesta 404, como un backend sin ella
+//   backend alta <uid> <nombre>  tarjeta conocida por el backend
+//   wifi caido|activo        corta o devuelve la radio
+//   wifi parpadeo            la próxima conexión cae nada más tener IP
+//   ipfija <ip> <puerta>     IP fija en vez de DHCP; vale desde el arranque
+//                            sea cual sea su instante
+//   pbm <archivo>            guarda lo que muestra el panel
+//   fin                      termina la prueba con éxito
+
+#include <Arduino.h>
+#include <filesystem>
+#include <fstream>
+#include <regex>
+#include <sstream>
+#include <vector>
+#include "nativo.h"
+
+void setup();
+void loop();
+extern const char* ipFija;
+extern const char* puertaEnlaceFija;
+
+namespace {
+
+size_t cursorSerie = 0;
+
+struct Prohibido {
+  int linea;
+  std::string texto;
+  size_t desde;
+};
+std::vector<Prohibido> prohibidos;
+
+// Cota de un número medido por el firmware, como "Resultado * en # ms"
+struct Cota {
+  int linea;
+  std::string patron;
+  uint64_t maximo;
+  size_t desde;
+  size_t hasta;
+};
+std::vector<Cota> cotas;
+
+[[noreturn]] void fallar(int linea, const std::string& motivo) {
+  fflush(stdout);
+  fprintf(stderr, "FALLO en la línea %d del guion (%.3f s): %s\n", linea, nativo::ahoraUs() / 1e6, motivo.c_str());
+  std::_Exit(1);
+}
+
+std::string resto(std::istringstream& entrada) {
+  std::string texto;
+  std::getline(entrada >> std::ws, texto);
+  return texto;
+}
+
+void comprobarCota(const Cota& cota) {
+  std::string expresion;
+  for (char c : cota.patron) {
+    if (c == '*') {
+      expresion += "\\S+";
+    } else if (c == '#') {
+      expresion += "([0-9]+)";
+    } else {
+      if (strchr("\\^$.|?+()[]{}", c) != nullptr) expresion += '\\';
+      expresion += c;
+    }
+  }
+  std::regex encaje(expresion);
+  std::string salida = Serial.salida().substr(cota.desde, cota.hasta - cota.desde);
+  std::istringstream lineas(salida);
+  std::string texto;
+  int vistas = 0;
+  while (std::getline(lineas, texto)) {
+    std::smatch partes;
+    if (!std::regex_search(texto, partes, encaje)) continue;
+    vistas++;
+    if (partes.size() > 1 && std::stoull(partes[1]) > cota.maximo) {
+      fallar(cota.linea, "\"" + partes[0].str() + "\" pasa de " + std::to_string(cota.maximo));
+    }
+  }
+  if (vistas == 0) fallar(cota.linea, "no salió por serie \"" + cota.patron + "\"");
+}
+
+void ejecutar(int linea, const std::string& accion, std::istringstream& entrada) {
+  if (accion == "serie") {
+    Serial.inyectar(resto(entrada) + "\n");
+  } else if (accion == "espera") {
+    std::string texto = resto(entrada);
+    size_t pos = Serial.salida().find(texto, cursorSerie);
+    if (pos == std::string::npos) fallar(linea, "no salió por serie \"" + texto + "\"");
+    cursorSerie = pos + texto.size();
+  } else if (accion == "dentro") {
+    uint32_t ms = 0;
+    entrada >> ms;
+    std::string texto = resto(entrada);
+    size_t desde = Serial.salida().size();
+    nativo::programar(nativo::ahoraUs() + (uint64_t)ms * 1000, [linea, texto, desde, ms] {
+      if (Serial.salida().find(texto, desde) == std::string::npos) {
+        fallar(linea, "no salió por serie \"" + texto + "\" en " + std::to_string(ms) + " ms");
+      }
+    });
+  } else if (accion == "nunca") {
+    prohibidos.push_back({linea, resto(entrada), Serial.salida().size()});
+  } else if (accion == "maximo") {
+    Cota cota{linea, "", 0, Serial.salida().size(), std::string::npos};
+    entrada >> cota.maximo;
+    cota.patron = resto(entrada);
+    for (Cota& anterior : cotas) {
+      if (anterior.patron == cota.patron && anterior.hasta == std::string::npos) anterior.hasta = cota.desde;
+    }
+    cotas.push_back(cota);
+  } else if (accion == "backend") {
+    std::string que;
+    entrada >> que;
+    if (que == "caido" || que == "activo") {
+      nativo::backendCaido(que == "caido");
+    } else if (que == "latencia") {
+      uint32_t ms = 0;
+      entrada >> ms;
+      nativo::latenciaBackend(ms);
+    } else if (que == "lenta") {
+      std::string ruta;
+      uint32_t ms = 0;
+      entrada >> ruta >> ms;
+      nativo::latenciaRuta(ruta, ms);
+    } else if (que == "sin") {
+      nativo::quitarRuta(resto(entrada));
+    } else if (que == "alta") {
+      std::string uid;
+      entrada >> uid;
+      nativo::altaTarjeta(uid, resto(entrada));
+    } else {
+      fallar(linea, "backend " + que + " no existe");
+    }
+  } else if (accion == "wifi") {
+    std::string que;
+    entrada >> que;
+    if (que == "parpadeo") {
+      nativo::parpadeoRadio();
+    } else if (que == "caido" || que == "activo") {
+      nativo::cortarRadio(que == "caido");
+    } else {
+      fallar(linea, "wifi " + que + " no existe");
+    }
+  } else if (accion == "pbm") {
+    std::string ruta = resto(entrada);
+    if (!nativo::guardarPBM(ruta.c_str())) fallar(linea, "no se pudo escribir " + ruta);
+  } else if (accion == "fin") {
+    for (const Prohibido& p : prohibidos) {
+      if (Serial.salida().find(p.texto, p.desde) != std::string::npos) {
+        fallar(p.linea, "salió por serie \"" + p.texto + "\"");
+      }
+    }
+    for (const Cota& cota : cotas) comprobarCota(cota);
+    fflush(stdout);
+    std::_Exit(0);
+  } else {
+    fallar(linea, "acción desconocida: " + accion);
+  }
+}
+
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Uso: %s <guion> [carpeta de la flash]\n", argv[0]);
+    return 2;
+  }
+  std::ifstream guion(argv[1]);
+  if (!guion) {
+    fprintf(stderr, "No se puede abrir %s\n", argv[1]);
+    return 2;
+  }
+
+  // Flash vacía en cada prueba: el diario de una no se sube en la siguiente
+  std::string carpeta = argc > 2 ? argv[2] : "flash_nativa";
+  std::filesystem::remove_all(carpeta);
+  nativo::fijarCarpetaArchivos(carpeta);
+
+  nativo::iniciarPlanificador();
+  std::string texto;
+  for (int linea = 1; std::getline(guion, texto); linea++) {
+    std::istringstream entrada(texto);
+    uint64_t ms;
+    if (!(entrada >> ms)) {
+      if (texto.find_first_not_of(" \t\r") != std::string::npos && texto[texto.find_first_not_of(" \t")] != '#') {
+        fallar(linea, "sin instante: " + texto);
+      }
+      continue;
+    }
+    std::string accion;
+    entrada >> accion;
+    if (accion == "ipfija") {
+      static std::string ip, puerta;
+      entrada >> ip >> puerta;
+      ipFija = ip.c_str();
+      puertaEnlaceFija = puerta.c_str();
+      continue;
+    }
+    auto resto = std::make_shared<std::string>(texto.substr(std::min(texto.size(), (size_t)entrada.tellg())));
+    nativo::programar(ms * 1000, [linea, accion, resto] {
+      std::istringstream argumentos(*resto);
+      ejecutar(linea, accion, argumentos);
+    });
+  }
+
+  setup();
+  for (;;) loop();
+}
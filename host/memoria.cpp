@@ -0,0 +1,55 @@
+// Recuento de reservas del heap por hilo para VERIFICAR_HEAP: malloc,
+// calloc y realloc (y con ellos new, que llama a malloc) pasan por aquí antes
+// de llegar a glibc. Cada tarea del firmware es un hilo, así que el recuento
+// del hilo es el de la tarea
+
+#include "nativo.h"
+#include <stdlib.h>
+
+extern "C" {
+void* __libc_malloc(size_t largo);
+void* __libc_calloc(size_t n, size_t largo);
+void* __libc_realloc(void* bloque, size_t largo);
+}
+
+namespace {
+
+thread_local size_t reservas = 0;
+thread_local int sinContar = 0;
+
+void contar() {
+  if (sinContar == 0) reservas++;
+}
+
+}
+
+extern "C" void* malloc(size_t largo) {
+  contar();
+  return __libc_malloc(largo);
+}
+
+extern "C" void* calloc(size_t n, size_t largo) {
+  contar();
+  return __libc_calloc(n, largo);
+}
+
+extern "C" void* realloc(void* bloque, size_t largo) {
+  contar();
+  return __libc_realloc(bloque, largo);
+}
+
+namespace nativo {
+
+size_t reservasHilo() {
+  return reservas;
+}
+
+SinContar::SinContar() {
+  sinContar++;
+}
+
+SinContar::~SinContar() {
+  sinContar--;
+}
+
+}
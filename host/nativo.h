@@ -0,0 +1,80 @@
+// Entorno del build nativo: reloj virtual, planificador y los periféricos
+// simulados que hay detrás de host/hal_nativo.h. El guion de la prueba
+// (host/main.cpp) los maneja con las funciones de más abajo
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+#include <string>
+#include <sys/time.h>
+
+class Client;
+class File;
+
+namespace nativo {
+
+// Reloj virtual en us desde el arranque. Solo avanza cuando todas las tareas
+// esperan, y entonces salta a la próxima que despierta o al próximo evento
+uint64_t ahoraUs();
+void iniciarPlanificador();
+void dormir(uint64_t us);
+void programar(uint64_t instanteUs, std::function<void()> accion);
+
+// Monitor serie
+void escribirSerie(const char* texto);
+
+// Reservas del heap (malloc, calloc, realloc, new) hechas por el hilo que
+// llama. Lo que hace el propio entorno simulado por el firmware (guardar la
+// salida serie, programar eventos) va dentro de un SinContar: en el ESP32 no
+// reserva
+size_t reservasHilo();
+class SinContar {
+public:
+  SinContar();
+  ~SinContar();
+  SinContar(const SinContar&) = delete;
+  SinContar& operator=(const SinContar&) = delete;
+};
+
+// Pantalla: copia de lo que se envió al panel, volcable en PBM
+void escribirPanel(uint8_t pagina, uint8_t desde, uint8_t hasta, const uint8_t* datos);
+bool guardarPBM(const char* ruta);
+
+// Radio: la asociación y la IP llegan un rato después de conectar, como en el ESP32
+enum EventoRadio : uint8_t { RADIO_ASOCIADA, RADIO_CAIDA, RADIO_CON_IP };
+void iniciarRadio(void (*aviso)(uint8_t evento));
+void conectarRadio(bool escaneo);
+void desconectarRadio();
+void direccionFija(bool fija);
+bool radioConectada();
+uint32_t ipRadio();
+void cortarRadio(bool caida);
+void parpadeoRadio();
+
+// Hora: el NTP contesta poco después de tener IP
+void iniciarNTP(void (*aviso)(struct timeval*));
+bool horaSincronizada();
+int64_t horaUnixUs();
+
+// Flash: archivos bajo una carpeta del host, particiones y NVS en memoria
+void fijarCarpetaArchivos(const std::string& carpeta);
+bool montarArchivos();
+File abrirArchivo(const char* ruta, const char* modo, bool crear);
+bool existeArchivo(const char* ruta);
+void crearDirectorio(const char* ruta);
+void borrarArchivo(const char* ruta);
+uint8_t* particionLista(uint8_t particion, size_t& tamano);
+bool leerAjustes(const std::string& clave, void* datos, size_t largo);
+void guardarAjustes(const std::string& clave, const void* datos, size_t largo);
+
+// Backend local: atiende en proceso las rutas del firmware
+Client& socketBackend(uint8_t socket);
+bool conectarSocket(uint8_t socket);
+void backendCaido(bool caido);
+void latenciaBackend(uint32_t ms);
+void latenciaRuta(const std::string& ruta, uint32_t ms);
+void quitarRuta(const std::string& ruta);
+void altaTarjeta(const std::string& uid, const std::string& nombre);
+
+}
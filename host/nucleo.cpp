@@ -0,0 +1,117 @@
+// Implementación de los shims de host/include: Print, Stream, IPAddress, el
+// monitor serie, el CRC de la ROM y la información de heap
+
+#include <Arduino.h>
+#include <esp_crc.h>
+#include <esp_heap_caps.h>
+#include "nativo.h"
+
+HardwareSerial Serial;
+
+size_t Print::write(const uint8_t* datos, size_t largo) {
+  size_t n = 0;
+  while (n < largo && write(datos[n])) n++;
+  return n;
+}
+
+size_t Print::print(long long n, int base) {
+  if (n < 0 && base == DEC) {
+    size_t escritos = print('-');
+    return escritos + print((unsigned long long)(-(n + 1)) + 1, base);
+  }
+  return print((unsigned long long)n, base);
+}
+
+size_t Print::print(unsigned long long n, int base) {
+  char texto[66];
+  char* p = texto + sizeof(texto) - 1;
+  *p = '\0';
+  if (base < 2) base = DEC;
+  do {
+    int digito = n % base;
+    *--p = digito < 10 ? '0' + digito : 'A' + digito - 10;
+    n /= base;
+  } while (n > 0);
+  return write(p);
+}
+
+size_t Print::print(double n, int decimales) {
+  char texto[64];
+  snprintf(texto, sizeof(texto), "%.*f", decimales, n);
+  return write(texto);
+}
+
+int Stream::timedRead() {
+  uint64_t limite = nativo::ahoraUs() + (uint64_t)_timeoutMs * 1000;
+  for (;;) {
+    int c = read();
+    if (c >= 0) return c;
+    if (nativo::ahoraUs() >= limite) return -1;
+    nativo::dormir(1000);
+  }
+}
+
+size_t Stream::readBytes(char* destino, size_t largo) {
+  size_t n = 0;
+  while (n < largo) {
+    int c = timedRead();
+    if (c < 0) break;
+    destino[n++] = (char)c;
+  }
+  return n;
+}
+
+size_t Stream::readBytesUntil(char terminador, char* destino, size_t largo) {
+  size_t n = 0;
+  while (n < largo) {
+    int c = timedRead();
+    if (c < 0 || c == terminador) break;
+    destino[n++] = (char)c;
+  }
+  return n;
+}
+
+bool IPAddress::fromString(const char* texto) {
+  unsigned a, b, c, d;
+  char resto;
+  if (texto == nullptr || sscanf(texto, "%u.%u.%u.%u%c", &a, &b, &c, &d, &resto) != 4) return false;
+  if (a > 255 || b > 255 || c > 255 || d > 255) return false;
+  *this = IPAddress(a, b, c, d);
+  return true;
+}
+
+int HardwareSerial::read() {
+  if (_entrada.empty()) return -1;
+  char c = _entrada.front();
+  _entrada.pop_front();
+  return (uint8_t)c;
+}
+
+size_t HardwareSerial::write(const uint8_t* datos, size_t largo) {
+  // El UART del ESP32 copia a un búfer fijo; la copia del host no cuenta
+  nativo::SinContar sinContar;
+  fwrite(datos, 1, largo, stdout);
+  _salida.append((const char*)datos, largo);
+  return largo;
+}
+
+void nativo::escribirSerie(const char* texto) {
+  Serial.print(texto);
+}
+
+uint32_t esp_crc32_le(uint32_t crc, const uint8_t* datos, uint32_t largo) {
+  crc = ~crc;
+  while (largo--) {
+    crc ^= *datos++;
+    for (int i = 0; i < 8; i++) crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+  }
+  return ~crc;
+}
+
+void heap_caps_get_info(multi_heap_info_t* info, uint32_t capacidades) {
+  memset(info, 0, sizeof(*info));
+  info->total_free_bytes = 180000;
+  info->largest_free_block = 110000;
+  info->minimum_free_bytes = 170000;
+  info->allocated_blocks = 400;
+}
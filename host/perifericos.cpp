@@ -0,0 +1,172 @@
+// Periféricos simulados del build nativo: la memoria del panel OLED, la
+// radio WiFi con sus eventos y el servidor NTP. Los eventos llegan por el
+// planificador con los retardos típicos del ESP32, sin bloquear a nadie
+
+#include "nativo.h"
+#include <stdio.h>
+#include <string.h>
+
+namespace {
+
+const uint8_t ANCHO_PANEL = 128;
+const uint8_t PAGINAS_PANEL = 8;
+const uint64_t ASOCIACION_US = 200000;  // De WiFi.begin a STA_CONNECTED con canal y BSSID
+const uint64_t ESCANEO_US = 1500000;    // Lo mismo cuando WiFi.begin tiene que escanear antes
+const uint64_t FALLO_US = 150000;       // De WiFi.begin sin AP a STA_DISCONNECTED, con canal y BSSID
+const uint64_t FALLO_ESCANEO_US = 2000000; // Lo mismo escaneando todos los canales
+const uint64_t DHCP_US = 100000;        // De asociada a STA_GOT_IP
+const uint64_t NTP_US = 300000;         // De tener IP a la primera respuesta
+const uint64_t RESINCRONIZACION_US = 3600ULL * 1000000;
+const int64_t EPOCA_NTP_S = 1767600000; // 2026-01-05, donde arranca el reloj simulado
+
+uint8_t panel[ANCHO_PANEL * PAGINAS_PANEL];
+
+void (*avisoRadio)(uint8_t evento) = nullptr;
+bool asociada = false;
+bool conIP = false;
+bool cortada = false;
+bool parpadeo = false;                  // La próxima conexión cae justo después de dar la IP
+bool fija = false;                      // IP fija: STA_GOT_IP sin esperar al DHCP
+uint32_t generacion = 0;                // Invalida los eventos de una conexión anterior
+
+void (*avisoNTP)(struct timeval*) = nullptr;
+bool sincronizada = false;
+bool ntpPendiente = false;
+
+void avisar(uint8_t evento) {
+  if (avisoRadio != nullptr) avisoRadio(evento);
+}
+
+void sincronizarNTP() {
+  ntpPendiente = false;
+  if (!conIP || avisoNTP == nullptr) return;
+  sincronizada = true;
+  int64_t us = nativo::horaUnixUs();
+  struct timeval tv;
+  tv.tv_sec = us / 1000000;
+  tv.tv_usec = us % 1000000;
+  avisoNTP(&tv);
+  ntpPendiente = true;
+  nativo::programar(nativo::ahoraUs() + RESINCRONIZACION_US, sincronizarNTP);
+}
+
+void pedirNTP() {
+  if (ntpPendiente || avisoNTP == nullptr || !conIP) return;
+  ntpPendiente = true;
+  nativo::programar(nativo::ahoraUs() + NTP_US, sincronizarNTP);
+}
+
+// Solo avisa si la caída no la pidió el firmware: el ESP32 marca las suyas
+// con ASSOC_LEAVE y la capa de hardware no las pasa
+void caer(bool avisarCaida) {
+  bool estaba = asociada;
+  asociada = false;
+  conIP = false;
+  generacion++;
+  if (estaba && avisarCaida) avisar(nativo::RADIO_CAIDA);
+}
+
+void darIP(uint32_t intento) {
+  if (intento != generacion) return;
+  conIP = true;
+  avisar(nativo::RADIO_CON_IP);
+  if (parpadeo) {
+    parpadeo = false;
+    caer(true);
+    return;
+  }
+  pedirNTP();
+}
+
+}
+
+namespace nativo {
+
+void escribirPanel(uint8_t pagina, uint8_t desde, uint8_t hasta, const uint8_t* datos) {
+  if (pagina >= PAGINAS_PANEL || hasta >= ANCHO_PANEL || desde > hasta) return;
+  memcpy(panel + pagina * ANCHO_PANEL + desde, datos, hasta - desde + 1);
+}
+
+bool guardarPBM(const char* ruta) {
+  FILE* archivo = fopen(ruta, "wb");
+  if (archivo == nullptr) return false;
+  fprintf(archivo, "P4\n%d %d\n", ANCHO_PANEL, PAGINAS_PANEL * 8);
+  for (int y = 0; y < PAGINAS_PANEL * 8; y++) {
+    for (int b = 0; b < ANCHO_PANEL / 8; b++) {
+      uint8_t bits = 0;
+      for (int i = 0; i < 8; i++) {
+        if ((panel[(y / 8) * ANCHO_PANEL + b * 8 + i] >> (y & 7)) & 1) bits |= 0x80 >> i;
+      }
+      fputc(bits, archivo);
+    }
+  }
+  return fclose(archivo) == 0;
+}
+
+void iniciarRadio(void (*aviso)(uint8_t evento)) {
+  avisoRadio = aviso;
+}
+
+void conectarRadio(bool escaneo) {
+  // Como WiFi.begin: corta lo que hubiera y vuelve a asociarse. Sin AP el
+  // driver acaba avisando de la desconexión, antes si no escanea
+  caer(false);
+  uint32_t intento = generacion;
+  if (cortada) {
+    programar(ahoraUs() + (escaneo ? FALLO_ESCANEO_US : FALLO_US), [intento] {
+      if (intento == generacion) avisar(RADIO_CAIDA);
+    });
+    return;
+  }
+  programar(ahoraUs() + (escaneo ? ESCANEO_US : ASOCIACION_US), [intento] {
+    if (intento != generacion) return;
+    asociada = true;
+    avisar(RADIO_ASOCIADA);
+    if (fija) {
+      darIP(intento);
+      return;
+    }
+    programar(ahoraUs() + DHCP_US, [intento] { darIP(intento); });
+  });
+}
+
+void desconectarRadio() {
+  caer(false);
+}
+
+void direccionFija(bool activa) {
+  fija = activa;
+}
+
+bool radioConectada() {
+  return conIP;
+}
+
+uint32_t ipRadio() {
+  // 192.168.1.50 con el primer octeto en el byte bajo, como IPAddress
+  return conIP ? (192u | (168u << 8) | (1u << 16) | (50u << 24)) : 0;
+}
+
+void cortarRadio(bool caida) {
+  cortada = caida;
+  if (caida) caer(true);
+}
+
+void parpadeoRadio() {
+  parpadeo = true;
+}
+
+void iniciarNTP(void (*aviso)(struct timeval*)) {
+  avisoNTP = aviso;
+  pedirNTP();
+}
+
+bool horaSincronizada() {
+  return sincronizada;
+}
+
+int64_t horaUnixUs() {
+  return EPOCA_NTP_S * 1000000 + (int64_t)ahoraUs();
+}
+
+}
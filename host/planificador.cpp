@@ -0,0 +1,201 @@
+// Planificador cooperativo del build nativo. Cada tarea de FreeRTOS es un
+// hilo, pero solo uno tiene el turno: lo suelta al bloquearse (vTaskDelay,
+// ulTaskNotifyTake, halEsperar) y pasa a la tarea lista de más prioridad, por
+// turnos entre iguales. Si no hay ninguna lista, el reloj virtual salta a la
+// próxima que despierta o al próximo evento programado. Así una prueba de
+// minutos de reloj tarda milisegundos y da siempre el mismo resultado
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "nativo.h"
+#include "freertos/task.h"
+
+namespace {
+
+const uint64_t SIN_PLAZO = UINT64_MAX;
+
+struct Tarea {
+  const char* nombre;
+  UBaseType_t prioridad;
+  uint32_t pila;
+  std::condition_variable turno;
+  bool bloqueada = false;
+  bool porNotificacion = false;
+  uint64_t despertarUs = SIN_PLAZO;
+  uint32_t notificaciones = 0;
+  uint64_t orden = 0;                   // Última vez que tuvo el turno
+};
+
+std::mutex mutex;
+std::vector<Tarea*> tareas;
+Tarea* actual = nullptr;
+uint64_t turnos = 0;
+std::atomic<uint64_t> relojUs(0);
+std::multimap<uint64_t, std::function<void()>> eventos;
+thread_local Tarea* propia = nullptr;
+
+bool lista(const Tarea* t) {
+  if (!t->bloqueada) return true;
+  if (t->porNotificacion && t->notificaciones > 0) return true;
+  return t->despertarUs <= relojUs;
+}
+
+// Con el mutex tomado: pasa el turno y, si la tarea sigue viva, espera a recuperarlo
+void ceder(std::unique_lock<std::mutex>& bloqueo, bool terminar = false) {
+  Tarea* yo = propia;
+  for (;;) {
+    // Los eventos vencidos corren sin el mutex: pueden programar otros
+    while (!eventos.empty() && eventos.begin()->first <= relojUs) {
+      std::function<void()> accion = std::move(eventos.begin()->second);
+      eventos.erase(eventos.begin());
+      bloqueo.unlock();
+      accion();
+      bloqueo.lock();
+    }
+
+    Tarea* elegida = nullptr;
+    for (Tarea* t : tareas) {
+      if (!lista(t)) continue;
+      if (elegida == nullptr || t->prioridad > elegida->prioridad ||
+          (t->prioridad == elegida->prioridad && t->orden < elegida->orden)) {
+        elegida = t;
+      }
+    }
+    if (elegida != nullptr) {
+      elegida->bloqueada = false;
+      elegida->orden = ++turnos;
+      actual = elegida;
+      if (elegida == yo) return;
+      elegida->turno.notify_one();
+      if (terminar) return;
+      yo->turno.wait(bloqueo, [yo] { return actual == yo; });
+      return;
+    }
+
+    uint64_t siguiente = eventos.empty() ? SIN_PLAZO : eventos.begin()->first;
+    for (Tarea* t : tareas) {
+      if (t->despertarUs < siguiente) siguiente = t->despertarUs;
+    }
+    if (siguiente == SIN_PLAZO) {
+      fprintf(stderr, "Todas las tareas esperan sin plazo ni eventos pendientes\n");
+      fflush(stdout);
+      std::_Exit(2);
+    }
+    relojUs = siguiente;
+  }
+}
+
+void bloquear(uint64_t esperaUs, bool porNotificacion) {
+  std::unique_lock<std::mutex> bloqueo(mutex);
+  Tarea* yo = propia;
+  yo->bloqueada = true;
+  yo->porNotificacion = porNotificacion;
+  yo->despertarUs = esperaUs == SIN_PLAZO ? SIN_PLAZO : relojUs + esperaUs;
+  ceder(bloqueo);
+  yo->porNotificacion = false;
+  yo->despertarUs = SIN_PLAZO;
+}
+
+}
+
+namespace nativo {
+
+uint64_t ahoraUs() {
+  return relojUs;
+}
+
+void iniciarPlanificador() {
+  // El hilo principal hace de tarea de loop(), como en el core de Arduino
+  Tarea* t = new Tarea();
+  t->nombre = "loopTask";
+  t->prioridad = 1;
+  t->pila = 8192;
+  std::lock_guard<std::mutex> bloqueo(mutex);
+  tareas.push_back(t);
+  propia = t;
+  actual = t;
+}
+
+void dormir(uint64_t us) {
+  bloquear(us, false);
+}
+
+void programar(uint64_t instanteUs, std::function<void()> accion) {
+  std::lock_guard<std::mutex> bloqueo(mutex);
+  eventos.emplace(instanteUs, std::move(accion));
+}
+
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t funcion, const char* nombre, uint32_t pila, void* parametro,
+                                   UBaseType_t prioridad, TaskHandle_t* tarea, BaseType_t nucleo) {
+  Tarea* t = new Tarea();
+  t->nombre = nombre;
+  t->prioridad = prioridad;
+  t->pila = pila;
+  {
+    std::lock_guard<std::mutex> bloqueo(mutex);
+    t->orden = ++turnos;
+    tareas.push_back(t);
+  }
+  if (tarea != nullptr) *tarea = t;
+
+  // Arranca cuando el planificador le dé el turno por primera vez
+  std::thread([t, funcion, parametro] {
+    propia = t;
+    {
+      std::unique_lock<std::mutex> bloqueo(mutex);
+      t->turno.wait(bloqueo, [t] { return actual == t; });
+    }
+    funcion(parametro);
+    std::unique_lock<std::mutex> bloqueo(mutex);
+    tareas.erase(std::find(tareas.begin(), tareas.end(), t));
+    ceder(bloqueo, true);
+  }).detach();
+  return pdPASS;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle() {
+  return propia;
+}
+
+void vTaskDelay(TickType_t ticks) {
+  bloquear((uint64_t)ticks * 1000, false);
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t limpiar, TickType_t espera) {
+  Tarea* yo = propia;
+  bool esperar;
+  {
+    std::lock_guard<std::mutex> bloqueo(mutex);
+    esperar = yo->notificaciones == 0 && espera > 0;
+  }
+  if (esperar) bloquear(espera == portMAX_DELAY ? SIN_PLAZO : (uint64_t)espera * 1000, true);
+
+  std::lock_guard<std::mutex> bloqueo(mutex);
+  uint32_t valor = yo->notificaciones;
+  if (valor > 0) yo->notificaciones = limpiar ? 0 : valor - 1;
+  return valor;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t tarea) {
+  std::lock_guard<std::mutex> bloqueo(mutex);
+  ((Tarea*)tarea)->notificaciones++;
+  return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t tarea, BaseType_t* despertar) {
+  xTaskNotifyGive(tarea);
+  if (despertar != nullptr) *despertar = pdTRUE;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t tarea) {
+  // Los hilos del host no tienen la pila del ESP32: se informa la mitad libre
+  return ((Tarea*)tarea)->pila / 2;
+}
@@ -0,0 +1,42 @@
+// Sustituto de Adafruit_GFX para el build nativo cuando CMake no encuentra la
+// biblioteca: las mismas primitivas sobre drawPixel. Sin la fuente, cada
+// carácter que no es una cifra es un recuadro de 5x7 con el mismo avance,
+// suficiente para ver dónde cae el texto en el volcado PBM
+#pragma once
+
+#include "Arduino.h"
+
+class Adafruit_GFX : public Print {
+ public:
+  Adafruit_GFX(int16_t ancho, int16_t alto) : _ancho(ancho), _alto(alto) {}
+
+  virtual void drawPixel(int16_t x, int16_t y, uint16_t color) = 0;
+  virtual void drawFastVLine(int16_t x, int16_t y, int16_t h, uint16_t color);
+  virtual void drawFastHLine(int16_t x, int16_t y, int16_t w, uint16_t color);
+  virtual void fillScreen(uint16_t color);
+  virtual void fillRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t color);
+
+  void drawLine(int16_t x0, int16_t y0, int16_t x1, int16_t y1, uint16_t color);
+  void drawRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t color);
+  void drawCircle(int16_t x0, int16_t y0, int16_t r, uint16_t color);
+  void fillCircle(int16_t x0, int16_t y0, int16_t r, uint16_t color);
+  void fillTriangle(int16_t x0, int16_t y0, int16_t x1, int16_t y1, int16_t x2, int16_t y2, uint16_t color);
+
+  void setCursor(int16_t x, int16_t y) { _cursorX = x; _cursorY = y; }
+  void setTextSize(uint8_t tamano) { _tamanoTexto = tamano > 0 ? tamano : 1; }
+  void setTextColor(uint16_t color) { _colorTexto = color; }
+  void setTextColor(uint16_t color, uint16_t fondo) { _colorTexto = color; }
+  int16_t width() const { return _ancho; }
+  int16_t height() const { return _alto; }
+
+  size_t write(uint8_t c) override;
+  using Print::write;
+
+ protected:
+  int16_t _ancho;
+  int16_t _alto;
+  int16_t _cursorX = 0;
+  int16_t _cursorY = 0;
+  uint8_t _tamanoTexto = 1;
+  uint16_t _colorTexto = 0xFFFF;
+};
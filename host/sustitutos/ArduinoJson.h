@@ -0,0 +1,150 @@
+// Sustituto de ArduinoJson 6 para el build nativo cuando CMake no encuentra
+// la biblioteca: el subconjunto que usa el firmware
+// (documentos estáticos, filtro, límite de anidamiento y lectura de un
+// Stream). La ocupación se cuenta como en el ESP32, 16 bytes por valor más
+// las cadenas sin repetir, para que NoMemory salte en los mismos casos
+#pragma once
+
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "Arduino.h"
+
+#define JSON_ARRAY_SIZE(n) ((n) * 16)
+#define JSON_OBJECT_SIZE(n) ((n) * 16)
+
+struct NodoJson {
+  enum Tipo : uint8_t { NULO, BOOLEANO, NUMERO, TEXTO, ARRAY, OBJETO };
+  Tipo tipo = NULO;
+  bool booleano = false;
+  double numero = 0;
+  std::string texto;
+  std::vector<std::pair<std::string, NodoJson>> miembros;
+  std::vector<NodoJson> elementos;
+
+  const NodoJson* buscar(const char* clave) const;
+  NodoJson* buscar(const char* clave);
+};
+
+class JsonArray;
+
+class JsonVariant {
+ public:
+  JsonVariant(NodoJson* nodo = nullptr, NodoJson* padre = nullptr, const char* clave = nullptr)
+    : _nodo(nodo), _padre(padre), _clave(clave ? clave : "") {}
+
+  bool isNull() const { return _nodo == nullptr || _nodo->tipo == NodoJson::NULO; }
+  JsonVariant operator[](const char* clave) const {
+    return JsonVariant(_nodo ? _nodo->buscar(clave) : nullptr, _nodo, clave);
+  }
+  // Solo para construir filtros: crea el miembro en el objeto padre
+  JsonVariant& operator=(bool valor);
+
+  operator const char*() const {
+    return (_nodo && _nodo->tipo == NodoJson::TEXTO) ? _nodo->texto.c_str() : nullptr;
+  }
+  template<class T, typename std::enable_if<std::is_arithmetic<T>::value, int>::type = 0>
+  operator T() const {
+    if (_nodo == nullptr) return T();
+    if (_nodo->tipo == NodoJson::NUMERO) return (T)_nodo->numero;
+    if (_nodo->tipo == NodoJson::BOOLEANO) return (T)_nodo->booleano;
+    return T();
+  }
+  template<class T> T as() const;
+
+  NodoJson* nodo() const { return _nodo; }
+
+ private:
+  NodoJson* _nodo;
+  NodoJson* _padre;
+  std::string _clave;
+};
+
+inline bool operator|(const JsonVariant& variante, bool defecto) {
+  NodoJson* nodo = variante.nodo();
+  return (nodo && nodo->tipo == NodoJson::BOOLEANO) ? nodo->booleano : defecto;
+}
+
+class JsonArray {
+ public:
+  class iterator {
+   public:
+    explicit iterator(NodoJson* nodo) : _nodo(nodo) {}
+    JsonVariant operator*() const { return JsonVariant(_nodo); }
+    iterator& operator++() { _nodo++; return *this; }
+    bool operator!=(const iterator& otro) const { return _nodo != otro._nodo; }
+   private:
+    NodoJson* _nodo;
+  };
+
+  explicit JsonArray(NodoJson* nodo = nullptr) : _nodo(nodo) {}
+  iterator begin() const { return iterator(_nodo ? _nodo->elementos.data() : nullptr); }
+  iterator end() const { return iterator(_nodo ? _nodo->elementos.data() + _nodo->elementos.size() : nullptr); }
+  size_t size() const { return _nodo ? _nodo->elementos.size() : 0; }
+
+ private:
+  NodoJson* _nodo;
+};
+
+template<> inline JsonArray JsonVariant::as<JsonArray>() const {
+  return JsonArray((_nodo && _nodo->tipo == NodoJson::ARRAY) ? _nodo : nullptr);
+}
+
+class JsonDocument {
+ public:
+  explicit JsonDocument(size_t capacidad) : _capacidad(capacidad) {}
+  JsonVariant operator[](const char* clave) { return JsonVariant(_raiz.buscar(clave), &_raiz, clave); }
+  bool isNull() const { return _raiz.tipo == NodoJson::NULO; }
+  size_t memoryUsage() const;
+  size_t capacity() const { return _capacidad; }
+  void clear() { _raiz = NodoJson(); }
+  NodoJson& raiz() { return _raiz; }
+  const NodoJson& raiz() const { return _raiz; }
+
+ private:
+  NodoJson _raiz;
+  size_t _capacidad;
+};
+
+template<size_t N>
+class StaticJsonDocument : public JsonDocument {
+ public:
+  StaticJsonDocument() : JsonDocument(N) {}
+};
+
+class DeserializationError {
+ public:
+  enum Code { Ok, EmptyInput, IncompleteInput, InvalidInput, NoMemory, TooDeep };
+  DeserializationError(Code codigo = Ok) : _codigo(codigo) {}
+  explicit operator bool() const { return _codigo != Ok; }
+  friend bool operator==(const DeserializationError& a, Code b) { return a._codigo == b; }
+  friend bool operator!=(const DeserializationError& a, Code b) { return a._codigo != b; }
+  Code code() const { return _codigo; }
+  const char* c_str() const;
+
+ private:
+  Code _codigo;
+};
+
+namespace DeserializationOption {
+struct Filter {
+  explicit Filter(const JsonDocument& filtro) : filtro(&filtro.raiz()) {}
+  const NodoJson* filtro;
+};
+struct NestingLimit {
+  explicit NestingLimit(uint8_t limite) : limite(limite) {}
+  uint8_t limite;
+};
+}
+
+DeserializationError deserializeJson(JsonDocument& doc, Stream& origen);
+DeserializationError deserializeJson(JsonDocument& doc, Stream& origen, DeserializationOption::Filter filtro,
+                                     DeserializationOption::NestingLimit limite);
+DeserializationError deserializeJson(JsonDocument& doc, const char* texto, size_t largo);
+
+// El build nativo solo habla JSON: FORMATO_BINARIO se prueba en el dispositivo
+DeserializationError deserializeMsgPack(JsonDocument& doc, Stream& origen);
+DeserializationError deserializeMsgPack(JsonDocument& doc, Stream& origen, DeserializationOption::Filter filtro,
+                                        DeserializationOption::NestingLimit limite);
+DeserializationError deserializeMsgPack(JsonDocument& doc, const uint8_t* datos, size_t largo);
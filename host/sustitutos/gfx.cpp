@@ -0,0 +1,135 @@
+// Primitivas del sustituto de Adafruit_GFX, todas sobre drawPixel y
+// las líneas rápidas que redefine el lienzo del firmware
+
+#include <Adafruit_GFX.h>
+
+void Adafruit_GFX::drawFastVLine(int16_t x, int16_t y, int16_t h, uint16_t color) {
+  for (int16_t i = 0; i < h; i++) drawPixel(x, y + i, color);
+}
+
+void Adafruit_GFX::drawFastHLine(int16_t x, int16_t y, int16_t w, uint16_t color) {
+  for (int16_t i = 0; i < w; i++) drawPixel(x + i, y, color);
+}
+
+void Adafruit_GFX::fillRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t color) {
+  for (int16_t i = x; i < x + w; i++) drawFastVLine(i, y, h, color);
+}
+
+void Adafruit_GFX::fillScreen(uint16_t color) {
+  fillRect(0, 0, _ancho, _alto, color);
+}
+
+void Adafruit_GFX::drawLine(int16_t x0, int16_t y0, int16_t x1, int16_t y1, uint16_t color) {
+  int dx = abs(x1 - x0);
+  int dy = -abs(y1 - y0);
+  int sx = x0 < x1 ? 1 : -1;
+  int sy = y0 < y1 ? 1 : -1;
+  int error = dx + dy;
+  for (;;) {
+    drawPixel(x0, y0, color);
+    if (x0 == x1 && y0 == y1) break;
+    int doble = 2 * error;
+    if (doble >= dy) { error += dy; x0 += sx; }
+    if (doble <= dx) { error += dx; y0 += sy; }
+  }
+}
+
+void Adafruit_GFX::drawRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t color) {
+  drawFastHLine(x, y, w, color);
+  drawFastHLine(x, y + h - 1, w, color);
+  drawFastVLine(x, y, h, color);
+  drawFastVLine(x + w - 1, y, h, color);
+}
+
+void Adafruit_GFX::drawCircle(int16_t x0, int16_t y0, int16_t r, uint16_t color) {
+  int x = r;
+  int y = 0;
+  int error = 1 - r;
+  while (x >= y) {
+    drawPixel(x0 + x, y0 + y, color); drawPixel(x0 - x, y0 + y, color);
+    drawPixel(x0 + x, y0 - y, color); drawPixel(x0 - x, y0 - y, color);
+    drawPixel(x0 + y, y0 + x, color); drawPixel(x0 - y, y0 + x, color);
+    drawPixel(x0 + y, y0 - x, color); drawPixel(x0 - y, y0 - x, color);
+    y++;
+    if (error < 0) {
+      error += 2 * y + 1;
+    } else {
+      x--;
+      error += 2 * (y - x) + 1;
+    }
+  }
+}
+
+void Adafruit_GFX::fillCircle(int16_t x0, int16_t y0, int16_t r, uint16_t color) {
+  for (int dy = -r; dy <= r; dy++) {
+    int ancho = (int)sqrt((double)(r * r - dy * dy));
+    drawFastHLine(x0 - ancho, y0 + dy, 2 * ancho + 1, color);
+  }
+}
+
+void Adafruit_GFX::fillTriangle(int16_t x0, int16_t y0, int16_t x1, int16_t y1, int16_t x2, int16_t y2,
+                                uint16_t color) {
+  // Cada fila se rellena entre las intersecciones con los tres lados
+  int yMin = min(y0, min(y1, y2));
+  int yMax = max(y0, max(y1, y2));
+  const int16_t xs[3] = {x0, x1, x2};
+  const int16_t ys[3] = {y0, y1, y2};
+  for (int y = yMin; y <= yMax; y++) {
+    int desde = INT16_MAX;
+    int hasta = INT16_MIN;
+    for (int i = 0; i < 3; i++) {
+      int ax = xs[i], ay = ys[i], bx = xs[(i + 1) % 3], by = ys[(i + 1) % 3];
+      if ((y < ay && y < by) || (y > ay && y > by)) continue;
+      int x = (ay == by) ? ax : ax + (bx - ax) * (y - ay) / (by - ay);
+      if (ay == by) {
+        desde = min(desde, min(ax, bx));
+        hasta = max(hasta, max(ax, bx));
+      } else {
+        desde = min(desde, x);
+        hasta = max(hasta, x);
+      }
+    }
+    if (desde <= hasta) drawFastHLine(desde, y, hasta - desde + 1, color);
+  }
+}
+
+namespace {
+
+// "0".."9" y ":" de la fuente clásica de 5x7, por columnas: los que el reloj
+// compara con sus sprites con MEDIR_PANTALLAS
+const uint8_t DIGITOS[11][5] = {
+  {0x3E, 0x51, 0x49, 0x45, 0x3E}, {0x00, 0x42, 0x7F, 0x40, 0x00},
+  {0x72, 0x49, 0x49, 0x49, 0x46}, {0x21, 0x41, 0x49, 0x4D, 0x33},
+  {0x18, 0x14, 0x12, 0x7F, 0x10}, {0x27, 0x45, 0x45, 0x45, 0x39},
+  {0x3C, 0x4A, 0x49, 0x49, 0x31}, {0x41, 0x21, 0x11, 0x09, 0x07},
+  {0x36, 0x49, 0x49, 0x49, 0x36}, {0x46, 0x49, 0x49, 0x29, 0x1E},
+  {0x00, 0x00, 0x14, 0x00, 0x00}
+};
+
+}
+
+size_t Adafruit_GFX::write(uint8_t c) {
+  if (c == '\n') {
+    _cursorX = 0;
+    _cursorY += 8 * _tamanoTexto;
+  } else if ((c >= '0' && c <= '9') || c == ':') {
+    // Como drawChar: un píxel por bit, o un cuadrado del tamaño del texto
+    const uint8_t* columnas = DIGITOS[c == ':' ? 10 : c - '0'];
+    for (int i = 0; i < 5; i++) {
+      for (int j = 0; j < 7; j++) {
+        if (!((columnas[i] >> j) & 1)) continue;
+        if (_tamanoTexto == 1) {
+          drawPixel(_cursorX + i, _cursorY + j, _colorTexto);
+        } else {
+          fillRect(_cursorX + i * _tamanoTexto, _cursorY + j * _tamanoTexto, _tamanoTexto, _tamanoTexto, _colorTexto);
+        }
+      }
+    }
+    _cursorX += 6 * _tamanoTexto;
+  } else if (c != '\r') {
+    // Del resto, recuadro en lugar del glifo, con el avance de la fuente de 6x8
+    drawRect(_cursorX, _cursorY, 5 * _tamanoTexto, 7 * _tamanoTexto, _colorTexto);
+    _cursorX += 6 * _tamanoTexto;
+  }
+  return 1;
+}
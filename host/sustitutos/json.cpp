@@ -0,0 +1,308 @@
+// Analizador JSON del sustituto de ArduinoJson: lee carácter a carácter y se para
+// al cerrar el valor raíz, sin consumir lo que venga detrás en el socket
+
+#include <ArduinoJson.h>
+#include <functional>
+#include <set>
+
+const NodoJson* NodoJson::buscar(const char* clave) const {
+  if (tipo != OBJETO) return nullptr;
+  for (const auto& miembro : miembros) {
+    if (miembro.first == clave) return &miembro.second;
+  }
+  return nullptr;
+}
+
+NodoJson* NodoJson::buscar(const char* clave) {
+  return const_cast<NodoJson*>(static_cast<const NodoJson*>(this)->buscar(clave));
+}
+
+JsonVariant& JsonVariant::operator=(bool valor) {
+  if (_nodo == nullptr && _padre != nullptr) {
+    if (_padre->tipo != NodoJson::OBJETO) *_padre = NodoJson();
+    _padre->tipo = NodoJson::OBJETO;
+    _padre->miembros.emplace_back(_clave, NodoJson());
+    _nodo = &_padre->miembros.back().second;
+  }
+  if (_nodo != nullptr) {
+    *_nodo = NodoJson();
+    _nodo->tipo = NodoJson::BOOLEANO;
+    _nodo->booleano = valor;
+  }
+  return *this;
+}
+
+namespace {
+
+void contar(const NodoJson& nodo, size_t& bytes, std::set<std::string>& cadenas) {
+  for (const auto& miembro : nodo.miembros) {
+    bytes += 16;
+    cadenas.insert(miembro.first);
+    contar(miembro.second, bytes, cadenas);
+  }
+  for (const auto& elemento : nodo.elementos) {
+    bytes += 16;
+    contar(elemento, bytes, cadenas);
+  }
+  if (nodo.tipo == NodoJson::TEXTO) cadenas.insert(nodo.texto);
+}
+
+// Filtro que lo deja pasar todo (sin DeserializationOption::Filter)
+const NodoJson* filtroTodo() {
+  static NodoJson todo;
+  todo.tipo = NodoJson::BOOLEANO;
+  todo.booleano = true;
+  return &todo;
+}
+
+bool deja(const NodoJson* filtro) {
+  if (filtro == nullptr) return false;
+  if (filtro->tipo == NodoJson::BOOLEANO) return filtro->booleano;
+  return filtro->tipo == NodoJson::OBJETO || filtro->tipo == NodoJson::ARRAY;
+}
+
+class Analizador {
+ public:
+  Analizador(std::function<int()> leer, uint8_t limite) : _leer(leer), _limite(limite) {}
+
+  DeserializationError::Code raiz(NodoJson& destino, const NodoJson* filtro) {
+    if (saltarEspacios() < 0) return DeserializationError::EmptyInput;
+    return valor(deja(filtro) ? &destino : nullptr, filtro, 0);
+  }
+
+ private:
+  int mirar() {
+    if (_actual == SIN_LEER) _actual = _leer();
+    return _actual;
+  }
+
+  int tomar() {
+    int c = mirar();
+    _actual = SIN_LEER;
+    return c;
+  }
+
+  int saltarEspacios() {
+    while (mirar() == ' ' || mirar() == '\t' || mirar() == '\r' || mirar() == '\n') tomar();
+    return mirar();
+  }
+
+  // destino nulo: el filtro lo descarta, se lee sin guardarlo
+  DeserializationError::Code valor(NodoJson* destino, const NodoJson* filtro, int profundidad) {
+    int c = saltarEspacios();
+    if (c < 0) return DeserializationError::IncompleteInput;
+    if (c == '{' || c == '[') {
+      if (profundidad >= _limite) return DeserializationError::TooDeep;
+      return c == '{' ? objeto(destino, filtro, profundidad) : array(destino, filtro, profundidad);
+    }
+    if (c == '"') {
+      std::string texto;
+      DeserializationError::Code error = cadena(texto);
+      if (error == DeserializationError::Ok && destino) {
+        destino->tipo = NodoJson::TEXTO;
+        destino->texto = texto;
+      }
+      return error;
+    }
+    if (c == 't' || c == 'f' || c == 'n') return literal(destino);
+    return numero(destino);
+  }
+
+  DeserializationError::Code objeto(NodoJson* destino, const NodoJson* filtro, int profundidad) {
+    tomar();
+    if (destino) destino->tipo = NodoJson::OBJETO;
+    if (saltarEspacios() == '}') {
+      tomar();
+      return DeserializationError::Ok;
+    }
+    for (;;) {
+      if (saltarEspacios() < 0) return DeserializationError::IncompleteInput;
+      if (mirar() != '"') return DeserializationError::InvalidInput;
+      std::string clave;
+      DeserializationError::Code error = cadena(clave);
+      if (error != DeserializationError::Ok) return error;
+      if (saltarEspacios() != ':') return mirar() < 0 ? DeserializationError::IncompleteInput
+                                                       : DeserializationError::InvalidInput;
+      tomar();
+
+      const NodoJson* filtroMiembro = nullptr;
+      if (filtro && filtro->tipo == NodoJson::OBJETO) filtroMiembro = filtro->buscar(clave.c_str());
+      else if (deja(filtro)) filtroMiembro = filtro;
+      NodoJson* miembro = nullptr;
+      if (destino && deja(filtroMiembro)) {
+        destino->miembros.emplace_back(clave, NodoJson());
+        miembro = &destino->miembros.back().second;
+      }
+      error = valor(miembro, filtroMiembro, profundidad + 1);
+      if (error != DeserializationError::Ok) return error;
+
+      int c = saltarEspacios();
+      tomar();
+      if (c == '}') return DeserializationError::Ok;
+      if (c != ',') return c < 0 ? DeserializationError::IncompleteInput : DeserializationError::InvalidInput;
+    }
+  }
+
+  DeserializationError::Code array(NodoJson* destino, const NodoJson* filtro, int profundidad) {
+    tomar();
+    if (destino) destino->tipo = NodoJson::ARRAY;
+    // Como ArduinoJson: el primer elemento del filtro vale para todos
+    const NodoJson* filtroElemento = filtro;
+    if (filtro && filtro->tipo == NodoJson::ARRAY) {
+      filtroElemento = filtro->elementos.empty() ? nullptr : &filtro->elementos[0];
+    }
+    if (saltarEspacios() == ']') {
+      tomar();
+      return DeserializationError::Ok;
+    }
+    for (;;) {
+      NodoJson* elemento = nullptr;
+      if (destino && deja(filtroElemento)) {
+        destino->elementos.emplace_back();
+        elemento = &destino->elementos.back();
+      }
+      DeserializationError::Code error = valor(elemento, filtroElemento, profundidad + 1);
+      if (error != DeserializationError::Ok) return error;
+
+      int c = saltarEspacios();
+      tomar();
+      if (c == ']') return DeserializationError::Ok;
+      if (c != ',') return c < 0 ? DeserializationError::IncompleteInput : DeserializationError::InvalidInput;
+    }
+  }
+
+  DeserializationError::Code cadena(std::string& texto) {
+    tomar();
+    for (;;) {
+      int c = tomar();
+      if (c < 0) return DeserializationError::IncompleteInput;
+      if (c == '"') return DeserializationError::Ok;
+      if (c != '\\') {
+        texto += (char)c;
+        continue;
+      }
+      c = tomar();
+      switch (c) {
+        case 'b': texto += '\b'; break;
+        case 'f': texto += '\f'; break;
+        case 'n': texto += '\n'; break;
+        case 'r': texto += '\r'; break;
+        case 't': texto += '\t'; break;
+        case 'u': {
+          unsigned codigo = 0;
+          for (int i = 0; i < 4; i++) {
+            int h = tomar();
+            if (!isxdigit(h)) return h < 0 ? DeserializationError::IncompleteInput : DeserializationError::InvalidInput;
+            codigo = codigo * 16 + (isdigit(h) ? h - '0' : (tolower(h) - 'a' + 10));
+          }
+          if (codigo < 0x80) {
+            texto += (char)codigo;
+          } else if (codigo < 0x800) {
+            texto += (char)(0xC0 | (codigo >> 6));
+            texto += (char)(0x80 | (codigo & 0x3F));
+          } else {
+            texto += (char)(0xE0 | (codigo >> 12));
+            texto += (char)(0x80 | ((codigo >> 6) & 0x3F));
+            texto += (char)(0x80 | (codigo & 0x3F));
+          }
+          break;
+        }
+        case -1: return DeserializationError::IncompleteInput;
+        default: texto += (char)c; break;
+      }
+    }
+  }
+
+  DeserializationError::Code literal(NodoJson* destino) {
+    std::string palabra;
+    while (isalpha(mirar())) palabra += (char)tomar();
+    NodoJson nodo;
+    if (palabra == "true" || palabra == "false") {
+      nodo.tipo = NodoJson::BOOLEANO;
+      nodo.booleano = (palabra == "true");
+    } else if (palabra != "null") {
+      return mirar() < 0 ? DeserializationError::IncompleteInput : DeserializationError::InvalidInput;
+    }
+    if (destino) *destino = nodo;
+    return DeserializationError::Ok;
+  }
+
+  DeserializationError::Code numero(NodoJson* destino) {
+    std::string texto;
+    while (mirar() >= 0 && strchr("+-0123456789.eE", mirar())) texto += (char)tomar();
+    if (texto.empty()) return DeserializationError::InvalidInput;
+    char* fin;
+    double n = strtod(texto.c_str(), &fin);
+    if (*fin != '\0') return DeserializationError::InvalidInput;
+    if (destino) {
+      destino->tipo = NodoJson::NUMERO;
+      destino->numero = n;
+    }
+    return DeserializationError::Ok;
+  }
+
+  static const int SIN_LEER = -2;
+  std::function<int()> _leer;
+  uint8_t _limite;
+  int _actual = SIN_LEER;
+};
+
+DeserializationError analizar(JsonDocument& doc, std::function<int()> leer, const NodoJson* filtro, uint8_t limite) {
+  doc.clear();
+  Analizador analizador(leer, limite);
+  DeserializationError::Code error = analizador.raiz(doc.raiz(), filtro);
+  if (error == DeserializationError::Ok && doc.memoryUsage() > doc.capacity()) return DeserializationError::NoMemory;
+  return error;
+}
+
+std::function<int()> leerStream(Stream& origen) {
+  return [&origen]() {
+    char c;
+    return origen.readBytes(&c, 1) == 1 ? (int)(uint8_t)c : -1;
+  };
+}
+
+}
+
+size_t JsonDocument::memoryUsage() const {
+  size_t bytes = 0;
+  std::set<std::string> cadenas;
+  contar(_raiz, bytes, cadenas);
+  for (const std::string& cadena : cadenas) bytes += cadena.size() + 1;
+  return bytes;
+}
+
+const char* DeserializationError::c_str() const {
+  static const char* const nombres[] = {"Ok", "EmptyInput", "IncompleteInput", "InvalidInput", "NoMemory", "TooDeep"};
+  return nombres[_codigo];
+}
+
+DeserializationError deserializeJson(JsonDocument& doc, Stream& origen) {
+  return analizar(doc, leerStream(origen), filtroTodo(), 10);
+}
+
+DeserializationError deserializeJson(JsonDocument& doc, Stream& origen, DeserializationOption::Filter filtro,
+                                     DeserializationOption::NestingLimit limite) {
+  return analizar(doc, leerStream(origen), filtro.filtro, limite.limite);
+}
+
+DeserializationError deserializeJson(JsonDocument& doc, const char* texto, size_t largo) {
+  size_t pos = 0;
+  return analizar(doc, [&]() { return pos < largo ? (int)(uint8_t)texto[pos++] : -1; }, filtroTodo(), 10);
+}
+
+DeserializationError deserializeMsgPack(JsonDocument& doc, Stream& origen) {
+  doc.clear();
+  return DeserializationError::InvalidInput;
+}
+
+DeserializationError deserializeMsgPack(JsonDocument& doc, Stream& origen, DeserializationOption::Filter filtro,
+                                        DeserializationOption::NestingLimit limite) {
+  doc.clear();
+  return DeserializationError::InvalidInput;
+}
+
+DeserializationError deserializeMsgPack(JsonDocument& doc, const uint8_t* datos, size_t largo) {
+  doc.clear();
+  return DeserializationError::InvalidInput;
+}